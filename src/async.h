@@ -0,0 +1,139 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace compression {
+
+/*!
+ * \brief Executor resuming suspended operations
+ *
+ * \details Supplied by the user, e.g. backed by a thread pool or an event
+ *          loop. Tasks may be posted from any thread, including the reader and
+ *          worker threads of the writer, and should be queued rather than run
+ *          inline.
+ */
+class Executor {
+public:
+    /*!
+     * \brief Destructor
+     */
+    virtual ~Executor() = default;
+
+    /*!
+     * \brief Queue a task for execution
+     *
+     * \param task The task to run
+     */
+    virtual auto post(std::function<void()> task) -> void = 0;
+};
+
+/*!
+ * \brief Lazily started coroutine returning a value
+ *
+ * \details The coroutine starts once awaited and resumes the awaiting
+ *          coroutine on completion. Use `spawn()` to start a task from
+ *          regular code.
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        // Value passed to `co_return`
+        std::optional<T> value;
+        // Coroutine awaiting the task
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        auto get_return_object() -> Task { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        auto initial_suspend() noexcept -> std::suspend_always { return {}; }
+        auto final_suspend() noexcept {
+            struct Final {
+                auto await_ready() noexcept -> bool { return false; }
+                auto await_suspend(std::coroutine_handle<promise_type> handle) noexcept -> std::coroutine_handle<> {
+                    return handle.promise().continuation;
+                }
+                auto await_resume() noexcept -> void {}
+            };
+            return Final{};
+        }
+        auto return_value(T result) -> void { value.emplace(std::move(result)); }
+        auto unhandled_exception() -> void { std::terminate(); }
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+    auto operator=(Task &&) -> Task & = delete;
+    auto operator=(const Task &) -> Task & = delete;
+
+    /*!
+     * \brief Destructor
+     */
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> awaiting) noexcept -> std::coroutine_handle<> {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    auto await_resume() -> T { return std::move(*handle.promise().value); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    // Frame of the coroutine
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*!
+ * \brief Awaitable resuming the coroutine on the executor
+ */
+struct Schedule {
+    Executor &executor;
+
+    auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> handle) -> void {
+        executor.post([handle]() { handle.resume(); });
+    }
+    auto await_resume() const noexcept -> void {}
+};
+
+namespace detail {
+
+/*!
+ * \brief Coroutine running to completion without an owner
+ */
+struct Detached {
+    struct promise_type {
+        auto get_return_object() -> Detached { return {}; }
+        auto initial_suspend() noexcept -> std::suspend_never { return {}; }
+        auto final_suspend() noexcept -> std::suspend_never { return {}; }
+        auto return_void() -> void {}
+        auto unhandled_exception() -> void { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+/*!
+ * \brief Start a task on the executor
+ *
+ * \param executor The executor to start the task on
+ * \param task     The task to run
+ * \param done     Invoked with the result of the task
+ */
+template <typename T>
+auto spawn(Executor &executor, Task<T> task, std::function<void(T)> done) -> void {
+    [](Executor &executor, Task<T> task, std::function<void(T)> done) -> detail::Detached {
+        co_await Schedule{executor};
+        done(co_await task);
+    }(executor, std::move(task), std::move(done));
+}
+
+} // namespace compression
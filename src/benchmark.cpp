@@ -0,0 +1,359 @@
+#include "compression.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief Benchmark harness of the writer
+ *
+ * \details Generates file sets of different size distributions and writes
+ *          them repeatedly with every combination of archive type, buffer
+ *          size and mode. Each combination is measured after warmup runs and
+ *          reported as a single record of JSON lines or CSV.
+ *
+ *          Usage: benchmark [--dir PATH] [--scale N] [--warmup N] [--repeat N]
+ *                           [--threads N] [--format json|csv] [--output FILE]
+ */
+
+namespace {
+
+/*!
+ * \brief Set of input files
+ */
+struct Corpus {
+    std::string name;
+    std::vector<std::string> files;
+    uint64_t bytes = 0;
+};
+
+/*!
+ * \brief Configuration of a measurement
+ */
+struct Config {
+    compression::ArchiveType type;
+    size_t bufferSize;
+    compression::Mode mode;
+};
+
+/*!
+ * \brief Result of a measurement
+ */
+struct Measurement {
+    double seconds = 0;
+    uint64_t input = 0;
+    uint64_t output = 0;
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+    uint64_t peakRss = 0;
+};
+
+/*!
+ * \brief Counters of the process taken from procfs
+ */
+struct Counters {
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+
+    static auto now() -> Counters {
+        Counters counters;
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        uint64_t value;
+        while (io >> key >> value) {
+            if (key == "syscr:") {
+                counters.readCalls = value;
+            } else if (key == "syscw:") {
+                counters.writeCalls = value;
+            }
+        }
+        return counters;
+    }
+};
+
+/*!
+ * \brief Reset the peak resident set size of the process
+ */
+auto resetPeakRss() -> void {
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5" << std::flush;
+}
+
+/*!
+ * \brief Peak resident set size of the process in KiB
+ */
+auto peakRss() -> uint64_t {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+/*!
+ * \brief Output sink counting the archive bytes
+ */
+struct Sink {
+    uint64_t bytes = 0;
+
+    static auto open(struct archive *, void *) -> int { return ARCHIVE_OK; }
+    static auto write(struct archive *, void *data, const void *, size_t length) -> la_ssize_t {
+        static_cast<Sink *>(data)->bytes += length;
+        return length;
+    }
+    static auto close(struct archive *, void *) -> int { return ARCHIVE_OK; }
+    static auto free(struct archive *, void *) -> int { return ARCHIVE_OK; }
+};
+
+/*!
+ * \brief Generate a file of moderately compressible text
+ */
+auto generate(const std::filesystem::path &path, size_t size, std::mt19937_64 &rng) -> void {
+    static const char *words[] = {"event", "timestamp", "value", "sensor", "\"id\":", "{", "}", "[", "]", "status",
+                                  "ok",    "error",     "0",     "1",      "42",    ",", ":", "\n", "name", "data"};
+    std::string content;
+    content.reserve(size + 16);
+    while (content.size() < size) {
+        auto pick = rng();
+        if (pick % 8 == 0) {
+            // Sprinkle some entropy
+            content += static_cast<char>('a' + (pick >> 8) % 26);
+            content += std::to_string((pick >> 16) % 100000);
+        } else {
+            content += words[(pick >> 8) % std::size(words)];
+        }
+        content += ' ';
+    }
+    content.resize(size);
+    std::ofstream(path, std::ios::binary).write(content.data(), content.size());
+}
+
+/*!
+ * \brief Generate the file sets
+ */
+auto createCorpora(const std::filesystem::path &dir, size_t scale) -> std::vector<Corpus> {
+    std::mt19937_64 rng(1);
+    std::vector<Corpus> corpora;
+
+    auto add = [&](const std::string &name, size_t count, auto size) {
+        Corpus corpus{name, {}, 0};
+        std::filesystem::create_directories(dir / name);
+        for (size_t i = 0; i < count; ++i) {
+            auto path = dir / name / ("f" + std::to_string(i));
+            auto bytes = size();
+            generate(path, bytes, rng);
+            corpus.files.push_back(path.string());
+            corpus.bytes += bytes;
+        }
+        corpora.push_back(std::move(corpus));
+    };
+
+    // Many tiny files
+    add("small", 2000 * scale, []() { return size_t(2048); });
+    // Log-uniform sizes between 1 KiB and 4 MiB
+    add("mixed", 64 * scale, [&]() {
+        return size_t(1024 * std::pow(4096.0, std::uniform_real_distribution<>(0, 1)(rng)));
+    });
+    // Few large files
+    add("large", 2 * scale, []() { return size_t(32 << 20); });
+    return corpora;
+}
+
+/*!
+ * \brief Write the corpus once
+ */
+auto run(const Corpus &corpus, const Config &config, size_t threads) -> compression::Result<Measurement> {
+    Sink sink;
+    auto options = compression::Writer::Options{.bufferSize = config.bufferSize, .threads = threads};
+    auto writer = compression::Writer::open(config.type, &Sink::open, &Sink::write, &Sink::close, &Sink::free, &sink,
+                                            options);
+    if (!writer) {
+        return std::unexpected(writer.error());
+    }
+
+    resetPeakRss();
+    auto before = Counters::now();
+    auto start = std::chrono::steady_clock::now();
+
+    writer.value()->add_files(corpus.files);
+    compression::Result<compression::State> res;
+    do {
+        res = writer.value()->write(config.mode);
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+    } while (res.value() == compression::State::InProgress);
+    writer.value()->close();
+
+    auto stop = std::chrono::steady_clock::now();
+    auto after = Counters::now();
+
+    Measurement measurement;
+    measurement.seconds = std::chrono::duration<double>(stop - start).count();
+    measurement.input = corpus.bytes;
+    measurement.output = sink.bytes;
+    measurement.readCalls = after.readCalls - before.readCalls;
+    measurement.writeCalls = after.writeCalls - before.writeCalls;
+    measurement.peakRss = peakRss();
+    return measurement;
+}
+
+/*!
+ * \brief Throughput of the CRC-32 of zip entries in MB/s
+ */
+auto checksumRate() -> double {
+    std::string data(64 << 20, '\0');
+    std::mt19937_64 rng(2);
+    for (auto &c : data) {
+        c = static_cast<char>(rng());
+    }
+    double best = 0;
+    uint32_t crc = 0;
+    for (int i = 0; i < 5; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        crc = compression::Crc32::update(crc, data);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::max(best, data.size() / seconds / 1e6);
+    }
+    return best;
+}
+
+auto typeName(compression::ArchiveType type) -> const char * {
+    switch (type) {
+    case compression::ArchiveType::Zip:
+        return "zip";
+    case compression::ArchiveType::TarLz4:
+        return "tar.lz4";
+    default:
+        return "tar.zst";
+    }
+}
+
+auto modeName(compression::Mode mode) -> const char * {
+    return (mode == compression::Mode::Block) ? "block" : "nonblock";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "compression-benchmark";
+    size_t scale = 1;
+    size_t warmup = 1;
+    size_t repeat = 5;
+    size_t threads = 0;
+    std::string format = "json";
+    std::string output;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+        if (arg == "--dir") {
+            dir = value;
+        } else if (arg == "--scale") {
+            scale = std::max<size_t>(std::stoul(value), 1);
+        } else if (arg == "--warmup") {
+            warmup = std::stoul(value);
+        } else if (arg == "--repeat") {
+            repeat = std::max<size_t>(std::stoul(value), 1);
+        } else if (arg == "--threads") {
+            threads = std::stoul(value);
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--output") {
+            output = value;
+        } else {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+    }
+    std::ostream &out = output.empty() ? std::cout : file;
+
+#if defined(HAVE_LIBDEFLATE_H) || defined(HAVE_ZLIB_H)
+    std::cerr << "CRC-32 (" << compression::Crc32::Backend << "): " << checksumRate() << " MB/s" << std::endl;
+#endif
+    std::cerr << "Generating input files in " << dir << std::endl;
+    auto corpora = createCorpora(dir, scale);
+
+    if (format == "csv") {
+        out << "corpus,type,buffer,mode,threads,files,input_bytes,output_bytes,ratio,median_s,min_s,max_s,mb_per_s,"
+               "read_syscalls,write_syscalls,peak_rss_kib\n";
+    }
+
+    const compression::ArchiveType types[] = {
+        compression::ArchiveType::Zip,
+        compression::ArchiveType::TarLz4,
+#if defined(HAVE_ZSTD_H)
+        compression::ArchiveType::TarZstd,
+#endif
+    };
+    const size_t buffers[] = {compression::Writer::AutoSize, 4096, 64 << 10, 1 << 20};
+    const compression::Mode modes[] = {compression::Mode::Block, compression::Mode::NonBlock};
+
+    for (auto &corpus : corpora) {
+        for (auto type : types) {
+            for (auto buffer : buffers) {
+                for (auto mode : modes) {
+                    Config config{type, buffer, mode};
+                    std::vector<Measurement> measurements;
+                    for (size_t i = 0; i < warmup + repeat; ++i) {
+                        auto res = run(corpus, config, threads);
+                        if (!res) {
+                            std::cerr << "Run failed " << static_cast<int>(res.error()) << std::endl;
+                            return 1;
+                        }
+                        if (i >= warmup) {
+                            measurements.push_back(res.value());
+                        }
+                    }
+
+                    std::sort(measurements.begin(), measurements.end(),
+                              [](auto &a, auto &b) { return a.seconds < b.seconds; });
+                    auto &median = measurements[measurements.size() / 2];
+                    double ratio = median.input ? double(median.output) / median.input : 0;
+                    double rate = median.input / median.seconds / 1e6;
+
+                    std::ostringstream record;
+                    if (format == "csv") {
+                        record << corpus.name << ',' << typeName(type) << ',' << buffer << ',' << modeName(mode) << ','
+                               << threads << ',' << corpus.files.size() << ',' << median.input << ','
+                               << median.output << ',' << ratio << ',' << median.seconds << ','
+                               << measurements.front().seconds << ',' << measurements.back().seconds << ',' << rate
+                               << ',' << median.readCalls << ',' << median.writeCalls << ',' << median.peakRss;
+                    } else {
+                        record << "{\"corpus\":\"" << corpus.name << "\",\"type\":\"" << typeName(type)
+                               << "\",\"buffer\":" << buffer << ",\"mode\":\"" << modeName(mode)
+                               << "\",\"threads\":" << threads << ",\"files\":" << corpus.files.size()
+                               << ",\"input_bytes\":" << median.input << ",\"output_bytes\":" << median.output
+                               << ",\"ratio\":" << ratio << ",\"median_s\":" << median.seconds
+                               << ",\"min_s\":" << measurements.front().seconds
+                               << ",\"max_s\":" << measurements.back().seconds << ",\"mb_per_s\":" << rate
+                               << ",\"read_syscalls\":" << median.readCalls
+                               << ",\"write_syscalls\":" << median.writeCalls
+                               << ",\"peak_rss_kib\":" << median.peakRss << "}";
+                    }
+                    out << record.str() << std::endl;
+                }
+            }
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+    return 0;
+}
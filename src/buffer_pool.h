@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Thread-safe pool of aligned buffers
+ *
+ * \details Buffers are allocated in power-of-two sizes from 4 KiB on and
+ *          aligned to 4 KiB, which satisfies the requirements of `O_DIRECT`.
+ *          Buffers of 2 MiB and more are aligned to and advised as huge pages.
+ *          Returned buffers are kept for reuse up to the capacity of the pool,
+ *          so short-lived writers don't allocate and fault in fresh memory.
+ */
+class BufferPool {
+public:
+    // Alignment and minimum size of the buffers
+    static constexpr size_t Alignment = 4 << 10;
+    // Size and alignment of huge pages
+    static constexpr size_t HugePageSize = 2 << 20;
+
+    /*!
+     * \brief Buffer leased from the pool
+     *
+     * \details Returned to the pool on destruction.
+     */
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(const Buffer &) = delete;
+        Buffer(Buffer &&other) noexcept { *this = std::move(other); }
+        ~Buffer() { reset(); }
+
+        auto operator=(const Buffer &) -> Buffer & = delete;
+        auto operator=(Buffer &&other) noexcept -> Buffer & {
+            if (this != &other) {
+                reset();
+                pool = std::exchange(other.pool, nullptr);
+                memory = std::exchange(other.memory, nullptr);
+                capacity = std::exchange(other.capacity, 0);
+            }
+            return *this;
+        }
+
+        auto get() const -> char * { return memory; }
+        auto size() const -> size_t { return capacity; }
+        explicit operator bool() const { return memory != nullptr; }
+
+        /*!
+         * \brief Return the buffer to the pool
+         */
+        auto reset() -> void {
+            if (memory) {
+                pool->release(memory, capacity);
+            }
+            pool = nullptr;
+            memory = nullptr;
+            capacity = 0;
+        }
+
+    private:
+        friend class BufferPool;
+
+        Buffer(BufferPool *pool, char *memory, size_t capacity) : pool(pool), memory(memory), capacity(capacity) {}
+
+        BufferPool *pool = nullptr;
+        char *memory = nullptr;
+        size_t capacity = 0;
+    };
+
+    /*!
+     * \brief Constructor
+     *
+     * \param capacity Maximum number of bytes kept for reuse
+     */
+    explicit BufferPool(size_t capacity = 64 << 20) : capacity(capacity) {}
+
+    BufferPool(const BufferPool &) = delete;
+    auto operator=(const BufferPool &) -> BufferPool & = delete;
+
+    /*!
+     * \brief Destructor
+     *
+     * \details Requires all buffers to be returned.
+     */
+    ~BufferPool() {
+        for (auto &list : buckets) {
+            for (auto memory : list) {
+                std::free(memory);
+            }
+        }
+    }
+
+    /*!
+     * \brief Pool shared by all writers of the process
+     */
+    static auto shared() -> BufferPool & {
+        static BufferPool pool;
+        return pool;
+    }
+
+    /*!
+     * \brief Lease a buffer
+     *
+     * \param size Minimum size of the buffer, rounded up to a power of two
+     *
+     * \return The buffer, throws `std::bad_alloc` if out of memory
+     */
+    auto lease(size_t size) -> Buffer {
+        auto bucket = index(size);
+        size_t length = size_t(1) << bucket;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!buckets[bucket].empty()) {
+                auto memory = buckets[bucket].back();
+                buckets[bucket].pop_back();
+                cached -= length;
+                return Buffer(this, memory, length);
+            }
+        }
+
+        auto alignment = (length >= HugePageSize) ? HugePageSize : Alignment;
+        auto memory = static_cast<char *>(std::aligned_alloc(alignment, length));
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        if (length >= HugePageSize) {
+            madvise(memory, length, MADV_HUGEPAGE);
+        }
+        return Buffer(this, memory, length);
+    }
+
+    /*!
+     * \brief Number of bytes kept for reuse
+     */
+    auto idle() -> size_t {
+        std::lock_guard<std::mutex> lock(mutex);
+        return cached;
+    }
+
+private:
+    static auto index(size_t size) -> size_t { return std::bit_width(std::max(size, Alignment) - 1); }
+
+    auto release(char *memory, size_t length) -> void {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cached + length <= capacity) {
+                buckets[index(length)].push_back(memory);
+                cached += length;
+                return;
+            }
+        }
+        std::free(memory);
+    }
+
+    // Maximum number of bytes kept for reuse
+    size_t capacity;
+    // Guards the buckets
+    std::mutex mutex;
+    // Returned buffers by the binary logarithm of their size
+    std::array<std::vector<char *>, 64> buckets;
+    // Number of bytes in the buckets
+    size_t cached = 0;
+};
+
+} // namespace compression
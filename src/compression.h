@@ -1,61 +1,39 @@
+#pragma once
+
+#include "async.h"
+#include "dedup.h"
+#include "entry.h"
+#include "index.h"
+#include "input.h"
+#include "manifest.h"
+#include "memory.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "progress.h"
+#include "sink.h"
+#include "sparse.h"
+#include "stats.h"
+#include "tuning.h"
+#include "types.h"
+#include "uring.h"
+#include "walk.h"
+#include <algorithm>
 #include <archive.h>
 #include <archive_entry.h>
+#include <cstring>
 #include <expected>
-#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <queue>
+#include <span>
 #include <string>
+#include <vector>
 
 namespace compression {
 
-/*!
- * \brief Error codes
- *
- * \details The Error codes are returned if an operation fails
- */
-enum class Error {
-    InitFailed = 0,
-    SetFormatFailed,
-    SetCompressionFailed,
-    OpenFailed,
-    WriteFailed,
-    StatFailed,
-    FileChanged,
-    InvalidType,
-};
-
-/*!
- * \brief Modes of operation
- *
- * \details The two possible modes are given as non-blocking and blocking.
- *          In case of non-blocking mode, the operation will perform only a
- *          single step before returning.
- */
-enum class Mode {
-    NonBlock,
-    Block,
-};
-
-/*!
- * \brief State of operation
- *
- * \details The state of operation is either given as in progress or finished.
- *          Any blocking call will guarantee that it's finished after a single
- *          call. A non-blocking call may return with 'InProgress' if the
- *          operation couldn't finish without blocking or if required multiple
- *          steps to fully finalize the operation.
- */
-enum class State {
-    InProgress,
-    Finished,
-};
-
-enum class ArchiveType {
-    Zip,
-    TarLz4,
-};
-
 /*!
  * \brief Writer of an archive file
  *
@@ -66,57 +44,169 @@ enum class ArchiveType {
 class Writer {
 public:
     template <typename T>
-    using Result = std::expected<T, Error>;
+    using Result = compression::Result<T>;
     using Pointer = std::unique_ptr<Writer>;
 
+    // Size determined by the writer
+    static constexpr size_t AutoSize = 0;
+
+    /*!
+     * \brief Options of the writer
+     */
+    struct Options {
+        // Size of the input-output buffer, tuned while writing if automatic
+        size_t bufferSize = AutoSize;
+        // Size of the output blocks, the buffer size is used if automatic
+        // unless the buffer size is automatic as well
+        size_t blockSize = AutoSize;
+        // Number of worker threads compressing entries, zero disables the
+        // parallel mode and compresses on the calling thread. For tar.zst
+        // the worker threads of zstd compress the stream instead.
+        size_t threads = 0;
+        // Size of the independently compressed chunks in parallel mode
+        size_t chunkSize = 4 << 20;
+        // Backend reading the input files
+        InputType input = InputType::Mmap;
+        // Number of chunks read ahead of the compression by the pipeline
+        size_t readAhead = 4;
+        // Files up to this size are read and written whole, several per
+        // step, zero disables the fast path
+        size_t smallFileSize = 64 << 10;
+        // Collect statistics of the entries and the archive, see `stats()`
+        bool stats = false;
+        // Invoked with the statistics of every written entry and the totals
+        // if statistics are collected
+        StatsCollector::Callback onEntry = nullptr;
+        // Append a random-access index to tar.lz4 archives, see `TarIndex`.
+        // Uses the parallel engine with at least one worker thread.
+        bool index = false;
+        // Levels and options of the codecs
+        CompressionOptions compression = {};
+        // Use of the page cache by the input and the output file
+        CacheMode cache = CacheMode::Keep;
+        // Number of output bytes collected before a batch is passed to a sink
+        size_t batchSize = 4 << 20;
+        // Write files identical to a preceding entry of a tar archive as hard
+        // link to it, detected by the fingerprints of the cache. The cache is
+        // updated with new fingerprints and can be saved for the next run.
+        // Zip archives have no hard links and ignore it.
+        std::shared_ptr<DedupCache> dedup = nullptr;
+        // Manifest of the previous run, files unchanged since aren't queued
+        std::shared_ptr<const Manifest> previous = nullptr;
+        // Receives the records of the written files and of the skipped
+        // unchanged files, to be saved as manifest for the next run once the
+        // archive is complete
+        std::shared_ptr<Manifest> manifest = nullptr;
+        // Store the user and group names of the files besides their
+        // identifiers, looked up once per identifier
+        bool ownerNames = true;
+        // Caps the input chunks read ahead and the compressed output in
+        // flight, shared by the writers under a common memory limit
+        std::shared_ptr<MemoryBudget> memory = nullptr;
+        // Receives the queued and written bytes and files, readable while
+        // writing from other threads, may be shared by several writers
+        std::shared_ptr<Progress> progress = nullptr;
+    };
+
     /*!
      * \brief Destructor of the writer
      *
      * \details The destructor will finalize the archive. If any file isn't
      *          written fully. The data will not be contained in the archive.
      */
-    ~Writer() = default;
+    ~Writer() { close(); }
 
     /*!
      * \brief Open new archive to write into
      *
      * \details Create a new archive under the given filename. The given buffer
      *          buffer size will determine the block size of any compression
-     *          step.
+     *          step. By default, the sizes are tuned by the writer.
      *
      * \param filename   Output filename of the archive
      * \param bufferSize The output buffer size
      *
      * \return Result container either a reference to the writer or an error code
      */
-    static auto open(std::string filename, ArchiveType type, size_t bufferSize = 512) -> Result<Pointer> {
-        auto writer = std::unique_ptr<Writer>(new Writer(bufferSize));
+    static auto open(std::string filename, ArchiveType type, size_t bufferSize = AutoSize) -> Result<Pointer> {
+        return open(std::move(filename), type, Options{.bufferSize = bufferSize});
+    }
+
+    /*!
+     * \brief Open new archive to write into
+     *
+     * \details Create a new archive under the given filename. If worker
+     *          threads are requested, the entries are compressed in parallel
+     *          and written in queue order.
+     *
+     * \param filename Output filename of the archive
+     * \param options  Options of the writer
+     *
+     * \return Result container either a reference to the writer or an error code
+     */
+    static auto open(std::string filename, ArchiveType type, Options options) -> Result<Pointer> {
+        auto writer = std::unique_ptr<Writer>(new Writer(options));
         auto res = writer->open(type);
 
         if (!res) {
             return std::unexpected<Error>(res.error());
         }
 
+        auto suffix = extension(type);
+        if (suffix.empty()) {
+            return std::unexpected(Error::InvalidType);
+        }
+        filename += suffix;
+
+        if (writer->collector || options.cache != CacheMode::Keep) {
+            // Write the file through the measured output, unpadded like a
+            // regular file opened by libarchive
+            writer->output.fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            writer->output.drop = options.cache != CacheMode::Keep;
+            if (writer->output.fd < 0) {
+                return std::unexpected(Error::OpenFailed);
+            }
+            archive_write_set_bytes_in_last_block(writer->archive.get(), 1);
+            if (archive_write_open2(writer->archive.get(), writer.get(), nullptr, &Writer::outputWrite,
+                                    &Writer::outputClose, nullptr) != ARCHIVE_OK) {
+                ::close(writer->output.fd);
+                writer->output.fd = -1;
+                return std::unexpected(Error::OpenFailed);
+            }
+        } else if (archive_write_open_filename(writer->archive.get(), filename.c_str()) != ARCHIVE_OK) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        res = writer->start();
+        if (!res) {
+            return std::unexpected<Error>(res.error());
+        }
+
+        return writer;
+    }
+
+    /*!
+     * \brief File extension appended to the filename of an archive type
+     *
+     * \return The extension, empty if the type isn't supported
+     */
+    static auto extension(ArchiveType type) -> std::string {
         switch (type) {
 #if defined(HAVE_ZLIB_H)
         case ArchiveType::Zip:
-            filename += ".zip";
-            break;
+            return ".zip";
 #endif
 #if defined(HAVE_LIBLZ4)
         case ArchiveType::TarLz4:
-            filename += ".tar.lz4";
-            break;
+            return ".tar.lz4";
+#endif
+#if defined(HAVE_ZSTD_H)
+        case ArchiveType::TarZstd:
+            return ".tar.zst";
 #endif
         default:
-            return std::unexpected(Error::InvalidType);
-        }
-
-        if (archive_write_open_filename(writer->archive.get(), filename.c_str()) != ARCHIVE_OK) {
-            return std::unexpected(Error::OpenFailed);
+            return std::string();
         }
-
-        return writer;
     }
 
     /*!
@@ -124,7 +214,7 @@ public:
      *
      * \details Create a new archive using custom callbacks. The given buffer
      *          buffer size will determine the block size of any compression
-     *          step.
+     *          step. By default, the sizes are tuned by the writer.
      *
      * \param open       Custom callback to open output archive
      * \param write      Custom callback to write to output archive
@@ -137,18 +227,96 @@ public:
      */
     static auto open(ArchiveType type, archive_open_callback open, archive_write_callback write,
                      archive_close_callback close, archive_free_callback free, void *userdata = nullptr,
-                     size_t bufferSize = 512) -> Result<Pointer> {
-        auto writer = std::unique_ptr<Writer>(new Writer(bufferSize));
+                     size_t bufferSize = AutoSize) -> Result<Pointer> {
+        return Writer::open(type, open, write, close, free, userdata, Options{.bufferSize = bufferSize});
+    }
+
+    /*!
+     * \brief Open new archive using custom callbacks
+     *
+     * \details Create a new archive using custom callbacks. If worker threads
+     *          are requested, the entries are compressed in parallel and the
+     *          callbacks are still only invoked from the thread calling
+     *          `write()` and `close()`.
+     *
+     * \param open     Custom callback to open output archive
+     * \param write    Custom callback to write to output archive
+     * \param close    Custom callback to close output archive
+     * \param free     Custom callback to free userdata
+     * \param userdata Userdata passed to all callbacks
+     * \param options  Options of the writer
+     *
+     * \return Result container either a reference to the writer or an error code
+     */
+    static auto open(ArchiveType type, archive_open_callback open, archive_write_callback write,
+                     archive_close_callback close, archive_free_callback free, void *userdata, Options options)
+        -> Result<Pointer> {
+        auto writer = std::unique_ptr<Writer>(new Writer(options));
+        auto res = writer->open(type);
+
+        if (!res) {
+            return std::unexpected<Error>(res.error());
+        }
+
+        if (writer->collector) {
+            // Measure the output through the writer
+            writer->output = Output{open, write, close, free, userdata};
+            if (archive_write_open2(writer->archive.get(), writer.get(), &Writer::outputOpen, &Writer::outputWrite,
+                                    &Writer::outputClose, &Writer::outputFree) != ARCHIVE_OK) {
+                return std::unexpected(Error::OpenFailed);
+            }
+        } else if (archive_write_open2(writer->archive.get(), userdata, open, write, close, free) != ARCHIVE_OK) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        res = writer->start();
+        if (!res) {
+            return std::unexpected<Error>(res.error());
+        }
+
+        return writer;
+    }
+
+    /*!
+     * \brief Open new archive writing into a sink
+     *
+     * \details The output blocks are collected and passed to the sink in
+     *          batches of `Options::batchSize` bytes, blocks of at least the
+     *          batch size are passed without a copy. The sink is only invoked
+     *          from the thread calling `write()` and `close()`.
+     *
+     * \param type    The archive type to write
+     * \param sink    Receives the output in batches of blocks
+     * \param options Options of the writer
+     *
+     * \return Result container either a reference to the writer or an error code
+     */
+    static auto open(ArchiveType type, Sink::Pointer sink, Options options) -> Result<Pointer> {
+        if (!sink) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        auto writer = std::unique_ptr<Writer>(new Writer(options));
         auto res = writer->open(type);
 
         if (!res) {
             return std::unexpected<Error>(res.error());
         }
 
-        if (archive_write_open2(writer->archive.get(), userdata, open, write, close, free) != ARCHIVE_OK) {
+        writer->output.sink = std::move(sink);
+        writer->output.batch = BufferPool::shared().lease(std::max<size_t>(options.batchSize, 1));
+        writer->output.batchSize = std::max<size_t>(options.batchSize, 1);
+        // Unpadded like a regular file
+        archive_write_set_bytes_in_last_block(writer->archive.get(), 1);
+        if (archive_write_open2(writer->archive.get(), writer.get(), &Writer::outputOpen, &Writer::outputWrite,
+                                &Writer::outputClose, nullptr) != ARCHIVE_OK) {
             return std::unexpected(Error::OpenFailed);
         }
 
+        res = writer->start();
+        if (!res) {
+            return std::unexpected<Error>(res.error());
+        }
+
         return writer;
     }
 
@@ -156,21 +324,80 @@ public:
      * \brief Add a file to the archive list
      *
      * \details Adds The given file to the list of files to write to the archive.
-     *          It fails if the specified file doesn't exist. Returns false in
-     *          this case. Return true otherwise.
+     *          It fails if the specified file doesn't exist, isn't a regular
+     *          file or symbolic link, or is unchanged since the previous
+     *          manifest and skipped.
      *
      * \param filename The filename to add to the list
      *
-     * \return True if files is added successfully. False otherwise.
+     * \return True if the file is queued, false otherwise
      */
     auto add_file(std::string filename) -> bool {
         struct stat64 stat;
-        if (0 == lstat64(filename.c_str(), &stat)) {
-            files.push(filename);
-            return true;
-        } else {
+        if (0 != lstat64(filename.c_str(), &stat)) {
             return false;
         }
+        return enqueue(std::move(filename), stat);
+    }
+
+    /*!
+     * \brief Add a file stated by the caller to the archive list
+     *
+     * \details The file isn't stated again, the size of the stats is used
+     *          as the entry size.
+     *
+     * \param filename The filename to add to the list
+     * \param stat     Stats of the file taken with `lstat64`
+     *
+     * \return True if queued, false if neither a regular file nor a symbolic
+     *         link, or unchanged since the previous manifest
+     */
+    auto add_file(std::string filename, const struct stat64 &stat) -> bool {
+        return enqueue(std::move(filename), stat);
+    }
+
+    /*!
+     * \brief Add multiple files to the archive list
+     *
+     * \details Adds the given files in order. Files that don't exist,
+     *          special files and files unchanged since the previous manifest
+     *          are skipped.
+     *
+     * \param filenames The filenames to add to the list
+     *
+     * \return Number of files queued
+     */
+    auto add_files(std::span<const std::string> filenames) -> size_t {
+        size_t added = 0;
+        for (auto &filename : filenames) {
+            added += add_file(filename) ? 1 : 0;
+        }
+        return added;
+    }
+
+    /*!
+     * \brief Add all regular files and symbolic links below a directory to the archive list
+     *
+     * \details Walks the directory tree once and queues the files with the
+     *          stats taken during the walk, the files aren't stated again on
+     *          write. Symbolic links are stored as links, special files are
+     *          skipped. On failure, the files found up to the failing
+     *          directory stay queued. Files unchanged since the previous
+     *          manifest are skipped.
+     *
+     * \param directory The directory to add
+     *
+     * \return Number of files queued on success, else error code
+     */
+    auto add_directory(const std::string &directory) -> Result<size_t> {
+        size_t added = 0;
+        auto res = walk(directory, [&](std::string path, const struct stat64 &stat) {
+            added += enqueue(std::move(path), stat) ? 1 : 0;
+        });
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        return added;
     }
 
     /*!
@@ -186,97 +413,92 @@ public:
      * \return Result with the state of operation on success, error code on failure.
      */
     auto write(Mode mode = Mode::Block) -> Result<State> {
-        // Nothing to do, archive is completely written
-        if (!input.is_open() && files.empty()) {
-            return State::Finished;
+        // Entries are compressed by the worker threads
+        if (engine) {
+            return writeParallel(mode);
         }
+        return writeSerial(mode, nullptr);
+    }
 
-        // Repeat in blocking mode until everything is written
-        do {
-            // Open file if not already opened
-            if (!input.is_open()) {
-                std::string file = files.front();
-                input.open(file.c_str(), std::ios_base::in);
-                files.pop();
-
-                // Failed to open input file
-                if (!input.is_open()) {
-                    return std::unexpected(Error::OpenFailed);
-                }
-
-                // Get stats of input file, especially its size
-                struct stat64 stat;
-                if (lstat64(file.c_str(), &stat) < 0) {
-                    return std::unexpected(Error::StatFailed);
-                }
-
-                // Create new entry for the file
-                entry.header.reset(archive_entry_new());
-
-                // Save total size, init remaining size to be written
-                entry.remainingSize = stat.st_size;
-                entry.totalSize = stat.st_size;
-
-                // Set entry meta information
-                archive_entry_set_pathname(entry.header.get(), file.c_str());
-                archive_entry_set_size(entry.header.get(), stat.st_size);
-                archive_entry_set_filetype(entry.header.get(), AE_IFREG);
-                archive_entry_set_uid(entry.header.get(), 1000);
-                archive_entry_set_gid(entry.header.get(), 1000);
-                archive_entry_set_mode(entry.header.get(), S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-
-                // Write header to archive
-                auto res = archive_write_header(archive.get(), entry.header.get());
-                if (res != ARCHIVE_OK) {
-                    return std::unexpected(Error::WriteFailed);
-                }
-            }
-
-            // Write until predefined size is written
-            if (entry.remainingSize > 0) {
-                // Read from file until buffer is full
-                if (buffer.size > buffer.filled && !input.eof()) {
-                    buffer.filled += input.readsome(&buffer.data.get()[buffer.filled], buffer.size - buffer.filled);
-                }
-
-                // Write from buffer into archive if data is available
-                if (buffer.filled - buffer.extracted > 0) {
-                    auto written = archive_write_data(archive.get(), &buffer.data.get()[buffer.extracted],
-                                                      buffer.filled - buffer.extracted);
-                    if (written < 0) {
-                        return std::unexpected(Error::WriteFailed);
-                    }
-
-                    entry.remainingSize -= written;
-                    buffer.extracted += written;
-                }
-
-                // Reset buffer if all is written
-                if (buffer.filled <= buffer.extracted) {
-                    buffer.filled = 0;
-                    buffer.extracted = 0;
-                }
-            }
+    /*!
+     * \brief Compress and write the queued files within a budget
+     *
+     * \details Performs non-blocking steps until the budget is used up, the
+     *          input isn't available without blocking or everything is
+     *          written. At least a single step is performed. In parallel
+     *          mode, the byte limit applies to the compressed data written.
+     *
+     * \param budget Time and number of bytes available to the call
+     *
+     * \return Result with the state of operation on success, error code on failure.
+     */
+    auto write(const Budget &budget) -> Result<State> {
+        if (engine) {
+            return writeParallel(Mode::NonBlock, budget);
+        }
+        return writeSerial(Mode::NonBlock, &budget);
+    }
 
-            // File content has changed after queuing
-            if (input.eof() && entry.remainingSize > 0) {
-                return std::unexpected(Error::FileChanged);
+    /*!
+     * \brief Compress and write the queued files asynchronously
+     *
+     * \details Writes in budgeted non-blocking steps. Between the steps, the
+     *          coroutine suspends until the writer can make progress and is
+     *          resumed on the executor. The writer has to outlive the task and
+     *          mustn't be used otherwise while the task runs.
+     *
+     * \param executor The executor to resume on
+     * \param budget   Budget of a single step
+     *
+     * \return Task resulting in the finished state on success, error code on failure.
+     */
+    auto write_async(Executor &executor, Budget budget = Budget{.time = std::chrono::microseconds(500)})
+        -> Task<Result<State>> {
+        while (true) {
+            auto res = write(budget);
+            if (!res || res.value() == State::Finished) {
+                co_return res;
             }
+            co_await Ready{*this, executor};
+        }
+    }
 
-            // Reset entry for next file
-            if (entry.remainingSize <= 0 || input.eof()) {
-                archive_write_finish_entry(archive.get());
-                entry.header.reset();
-                entry.remainingSize = 0;
-                entry.totalSize = 0;
-                input.close();
+    /*!
+     * \brief Invoke a callback once `write()` can make progress
+     *
+     * \details The callback is invoked immediately if the writer doesn't
+     *          wait for the input or the workers, else from the thread
+     *          providing the data.
+     *
+     * \param callback The callback to invoke once
+     */
+    auto notify(std::function<void()> callback) -> void {
+        if (engine) {
+            if (!files.empty() && !engine->full()) {
+                callback();
+            } else {
+                engine->notify(std::move(callback));
             }
-        } while (mode == Mode::Block &&
-                 ((input.is_open() && (!input.eof() || buffer.extracted >= buffer.filled)) || !files.empty()));
+        } else if (source && source->is_open() && entry.pending.empty()) {
+            source->notify(std::move(callback));
+        } else {
+            callback();
+        }
+    }
 
-        return ((input.is_open() && (!input.eof() || buffer.extracted >= buffer.filled)) || !files.empty())
-                   ? State::InProgress
-                   : State::Finished;
+    /*!
+     * \brief Statistics of the archive
+     *
+     * \details Includes the entry in progress. Empty if statistics aren't
+     *          collected, except for the usage of the memory budget.
+     */
+    auto stats() const -> Stats {
+        auto res = collector ? collector->stats() : Stats{};
+        if (options.memory) {
+            res.memoryUsed = options.memory->used();
+            res.memoryPeak = options.memory->peak();
+        }
+        return res;
     }
 
     /*!
@@ -286,77 +508,90 @@ public:
      *          that depends on the used compression and output file type.
      */
     auto close() -> void {
+        // Write the pending entries and the end of the archive
+        if (engine && archive) {
+            auto res = engine->drain(archive.get(), true);
+            while (res && !engine->idle()) {
+                res = engine->drain(archive.get(), true);
+            }
+            if (res) {
+                engine->finish(archive.get());
+            }
+        }
+        engine.reset();
         archive.reset();
-        std::queue<std::string> q;
+        std::queue<Queued> q;
         std::swap(q, files);
-        if (input.is_open()) {
-            input.close();
+        entry.pending = {};
+        entry.deferred = false;
+        entry.verifying = false;
+        entry.check.reset();
+        if (source) {
+            source->clear();
         }
     }
 
 private:
     /*!
-     * \brief Input-Output buffer
-     *
-     * \details The buffer is utilized to read input files and push the
-     *          content into the archive.
+     * \brief Entry information
      */
-    struct Buffer {
-        std::unique_ptr<char> data;
-        size_t size;
-        size_t filled;
-        size_t extracted;
-
-        /*!
-         * \brief Constructor
-         *
-         * \param size Size of the internal buffer
-         */
-        Buffer(size_t size) : data(new char[size]), size(size) {}
-
-        /*!
-         * \brief Destructor
-         */
-        ~Buffer() = default;
+    struct Entry {
+        std::unique_ptr<struct archive_entry, EntryDeleter> header;
+        size_t totalSize;
+        size_t remainingSize;
+        // Chunk of the input not yet consumed by the archive
+        std::span<const char> pending;
+        // Holes of the file, passed as zeros instead of read
+        SparseMap sparse;
+        // Position of the entry in the archive
+        uint64_t sequence = 0;
+        // The content is fingerprinted before the header, it has the size
+        // of a preceding entry, or compared with the entry it links to
+        bool verifying = false;
+        // Comparison with the preceding entry of the same fingerprint
+        std::optional<ContentCheck> check;
+        // Header is written once the first chunk is probed
+        bool deferred = false;
+        // Path and stats of the file, recorded in the manifest and the
+        // deduplication
+        std::string path;
+        struct stat64 stat = {};
+        // Content hashed for the manifest and deduplication unless fingerprinted
+        // before
+        Hasher hasher;
+        std::optional<Fingerprint> fingerprint;
     };
 
     /*!
-     * \brief Deleter of the `struct archive`
+     * \brief Queued file
      */
-    struct ArchiveDeleter {
-        auto operator()(struct archive *archive) -> void {
-            if (archive != nullptr) {
-                archive_write_free(archive);
-            }
-        }
+    struct Queued {
+        std::string path;
+        // Stats taken on queuing, the size is used as the entry size
+        struct stat64 stat;
     };
 
     /*!
-     * \brief Deleter of the `struct archive_entry`
+     * \brief Awaitable suspending until the writer can make progress
      */
-    struct EntryDeleter {
-        auto operator()(struct archive_entry *entry) -> void {
-            if (entry != nullptr) {
-                archive_entry_free(entry);
-            }
-        }
-    };
+    struct Ready {
+        Writer &writer;
+        Executor &executor;
 
-    /*!
-     * \brief Entry information
-     */
-    struct Entry {
-        std::unique_ptr<struct archive_entry, EntryDeleter> header;
-        size_t totalSize;
-        size_t remainingSize;
+        auto await_ready() const noexcept -> bool { return false; }
+        auto await_suspend(std::coroutine_handle<> handle) -> void {
+            auto &executor = this->executor;
+            writer.notify([&executor, handle]() { executor.post([handle]() { handle.resume(); }); });
+        }
+        auto await_resume() const noexcept -> void {}
     };
 
     /*!
      * \brief Constructor
      *
-     * \param bufferSize The size of the internal buffer
+     * \param options Options of the writer
      */
-    Writer(size_t bufferSize = 512) : buffer(bufferSize) {}
+    Writer(Options options) : options(options) {}
 
     /*!
      * \brief Opens the new output archive
@@ -368,6 +603,38 @@ private:
         if (archive == nullptr) {
             return std::unexpected(Error::InitFailed);
         }
+        if (options.stats) {
+            collector.emplace(options.onEntry);
+        }
+
+        if (options.dedup && type != ArchiveType::Zip) {
+            dedup.emplace(options.dedup);
+        }
+
+        // Derive the output block size
+        blockSize = options.blockSize;
+        if (blockSize == AutoSize) {
+            blockSize = (options.bufferSize == AutoSize) ? ChunkTuner::blockSize(type) : options.bufferSize;
+        }
+
+        // Compressed data is produced by the workers and passed through
+        // zstd compresses the stream with its own worker threads
+        bool parallel = options.threads > 0 && type != ArchiveType::TarZstd;
+        if (parallel || (options.index && type == ArchiveType::TarLz4)) {
+            return setupParallel(type);
+        }
+
+        // Tune the chunk size while writing
+        size_t chunkSize = options.bufferSize;
+        if (chunkSize == AutoSize) {
+            tuner.emplace(type);
+            chunkSize = tuner->chunkSize(UINT64_MAX);
+        }
+
+        auto res = setupSource(chunkSize);
+        if (!res) {
+            return res;
+        }
 
         switch (type) {
 #if defined(HAVE_ZLIB_H)
@@ -377,10 +644,51 @@ private:
 #if defined(HAVE_LIBLZ4)
         case ArchiveType::TarLz4:
             return setupLZ4();
+#endif
+#if defined(HAVE_ZSTD_H)
+        case ArchiveType::TarZstd:
+            return setupZstd();
+#endif
+        default:
+            return std::unexpected(Error::InvalidType);
+        }
+    }
+
+    /*!
+     * \brief Creates the input source of the configured backend
+     *
+     * \param chunkSize Initial size of the chunks to read
+     *
+     * \return Nothing on success, else error code
+     */
+    auto setupSource(size_t chunkSize) -> Result<void> {
+        switch (options.input) {
+        case InputType::Mmap:
+            source = std::make_unique<MmapSource>(chunkSize);
+            break;
+        case InputType::Pread:
+            source = std::make_unique<PreadSource>(chunkSize);
+            break;
+        case InputType::Pipeline:
+            source = std::make_unique<PipelineSource>(chunkSize, options.readAhead);
+            break;
+#if defined(HAVE_LINUX_IO_URING_H)
+        case InputType::IoUring: {
+            auto uring = std::make_unique<UringSource>(chunkSize);
+            if (!uring->valid()) {
+                return std::unexpected(Error::InitFailed);
+            }
+            source = std::move(uring);
+            break;
+        }
 #endif
         default:
             return std::unexpected(Error::InvalidType);
         }
+
+        source->cache(options.cache);
+        source->budget(options.memory.get());
+        return std::expected<void, Error>();
     }
 
     /*!
@@ -392,12 +700,23 @@ private:
         if (archive_write_set_format_pax(archive.get()) != ARCHIVE_OK) {
             return std::unexpected(Error::SetFormatFailed);
         }
+        pax = true;
 
         if (archive_write_add_filter_lz4(archive.get()) != ARCHIVE_OK) {
             return std::unexpected(Error::SetCompressionFailed);
         }
 
-        if (archive_write_set_bytes_per_block(archive.get(), buffer.size) != ARCHIVE_OK) {
+        auto &codec = options.compression;
+        auto level = std::to_string(codec.lz4Level);
+        auto block = std::to_string(codec.lz4BlockId());
+        if (archive_write_set_filter_option(archive.get(), "lz4", "compression-level", level.c_str()) != ARCHIVE_OK ||
+            archive_write_set_filter_option(archive.get(), "lz4", "block-size", block.c_str()) != ARCHIVE_OK ||
+            archive_write_set_filter_option(archive.get(), "lz4", "block-dependence",
+                                            codec.lz4BlockDependence ? "1" : nullptr) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        if (archive_write_set_bytes_per_block(archive.get(), blockSize) != ARCHIVE_OK) {
             return std::unexpected(Error::SetCompressionFailed);
         }
 
@@ -405,36 +724,1031 @@ private:
     }
 
     /*!
-     * \brief Initializes output archive to use ZIP compression
+     * \brief Initializes output archive to use zstd compression
+     *
+     * \details With worker threads configured, zstd compresses the stream
+     *          in parallel jobs.
      *
      * \return Nothing on success, else error code
      */
-    auto setupZip() -> Result<void> {
-        if (archive_write_set_format_zip(archive.get()) != ARCHIVE_OK) {
+    auto setupZstd() -> Result<void> {
+        if (archive_write_set_format_pax(archive.get()) != ARCHIVE_OK) {
             return std::unexpected(Error::SetFormatFailed);
         }
+        pax = true;
 
-        if (archive_write_zip_set_compression_deflate(archive.get()) != ARCHIVE_OK) {
+        if (archive_write_add_filter_zstd(archive.get()) != ARCHIVE_OK) {
             return std::unexpected(Error::SetCompressionFailed);
         }
 
-        if (archive_write_set_bytes_per_block(archive.get(), buffer.size) != ARCHIVE_OK) {
+        auto level = std::to_string(options.compression.zstdLevel);
+        if (archive_write_set_filter_option(archive.get(), "zstd", "compression-level", level.c_str()) !=
+            ARCHIVE_OK) {
             return std::unexpected(Error::SetCompressionFailed);
         }
 
-        return std::expected<void, Error>();
+        if (options.threads > 0) {
+            auto threads = std::to_string(options.threads);
+            if (archive_write_set_filter_option(archive.get(), "zstd", "threads", threads.c_str()) != ARCHIVE_OK) {
+                return std::unexpected(Error::SetCompressionFailed);
+            }
+        }
+
+        if (archive_write_set_bytes_per_block(archive.get(), blockSize) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Initializes output archive to use ZIP compression
+     *
+     * \return Nothing on success, else error code
+     */
+    auto setupZip() -> Result<void> {
+        if (archive_write_set_format_zip(archive.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetFormatFailed);
+        }
+
+        if (archive_write_zip_set_compression_deflate(archive.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        probing = options.compression.storeIncompressible;
+        if (options.compression.deflateLevel >= 0) {
+            auto level = std::to_string(options.compression.deflateLevel);
+            if (archive_write_set_format_option(archive.get(), "zip", "compression-level", level.c_str()) !=
+                ARCHIVE_OK) {
+                return std::unexpected(Error::SetCompressionFailed);
+            }
+        }
+
+        if (archive_write_set_bytes_per_block(archive.get(), blockSize) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Initializes output archive to pass through compressed data
+     *
+     * \details The raw format writes the data of a single entry without any
+     *          framing, the workers produce the complete archive content.
+     *
+     * \return Nothing on success, else error code
+     */
+    auto setupParallel(ArchiveType type) -> Result<void> {
+        switch (type) {
+#if defined(HAVE_ZLIB_H)
+        case ArchiveType::Zip:
+            break;
+#endif
+#if defined(HAVE_LIBLZ4)
+        case ArchiveType::TarLz4:
+            break;
+#endif
+        default:
+            return std::unexpected(Error::InvalidType);
+        }
+
+        if (archive_write_set_format_raw(archive.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetFormatFailed);
+        }
+
+        if (archive_write_set_bytes_per_block(archive.get(), blockSize) != ARCHIVE_OK ||
+            archive_write_set_bytes_in_last_block(archive.get(), 1) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        auto &codec = options.compression;
+        if (type == ArchiveType::TarLz4 && codec.lz4BlockId() == 0) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+        engine = std::make_unique<ParallelEngine>(type, options.input, std::max<size_t>(options.threads, 1),
+                                                  std::max<size_t>(options.chunkSize, 1), codec);
+        if (collector) {
+            engine->collect(&*collector);
+        }
+        if (options.index) {
+            engine->index();
+        }
+        if (dedup) {
+            engine->deduplicate(&*dedup);
+        }
+        if (options.manifest) {
+            engine->record(&*options.manifest);
+        }
+        engine->cache(options.cache);
+        engine->names(ownerNames());
+        engine->budget(options.memory.get());
+        engine->track(options.progress.get());
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Prepares the opened output archive for writing
+     *
+     * \return Nothing on success, else error code
+     */
+    auto start() -> Result<void> {
+        if (!engine) {
+            return std::expected<void, Error>();
+        }
+
+        // The raw format expects a single regular file entry
+        std::unique_ptr<struct archive_entry, EntryDeleter> header(archive_entry_new());
+        archive_entry_set_filetype(header.get(), AE_IFREG);
+        if (archive_write_header(archive.get(), header.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::WriteFailed);
+        }
+
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Queue a file with its stats
+     *
+     * \param path The file to queue
+     * \param stat Stats of the file
+     *
+     * \return True if queued, false if neither a regular file nor a symbolic
+     *         link, or unchanged since the previous manifest
+     */
+    auto enqueue(std::string path, const struct stat64 &stat) -> bool {
+        // Directories and special files have no content to write, a FIFO
+        // would block the read
+        if (!S_ISREG(stat.st_mode) && !S_ISLNK(stat.st_mode)) {
+            return false;
+        }
+        // Carried over into the new manifest
+        if (options.previous) {
+            if (auto record = options.previous->unchanged(path, stat)) {
+                if (options.manifest) {
+                    options.manifest->add(path, *record);
+                }
+                return false;
+            }
+        }
+        if (source && S_ISREG(stat.st_mode)) {
+            source->prefetch(path, stat.st_size);
+        }
+        if (options.progress) {
+            options.progress->queue(S_ISREG(stat.st_mode) ? stat.st_size : 0);
+        }
+        files.push(Queued{std::move(path), stat});
+        return true;
+    }
+
+    /*!
+     * \brief Record a written file in the manifest if enabled
+     */
+    auto record(const std::string &path, const struct stat64 &stat, const Fingerprint &fingerprint) -> void {
+        if (options.manifest) {
+            options.manifest->add(path, Manifest::Record::of(stat, fingerprint));
+        }
+    }
+
+    /*!
+     * \brief Count an entry written in one go in the progress if tracked
+     *
+     * \param size Bytes of its content
+     */
+    auto progressed(uint64_t size) -> void {
+        if (options.progress) {
+            options.progress->begin(size);
+            options.progress->advance(size);
+            options.progress->end();
+        }
+    }
+
+    /*!
+     * \brief Output callbacks wrapped by the writer to measure the output
+     */
+    struct Output {
+        archive_open_callback *open = nullptr;
+        archive_write_callback *write = nullptr;
+        archive_close_callback *close = nullptr;
+        archive_free_callback *free = nullptr;
+        void *userdata = nullptr;
+        // File written directly if opened by filename
+        int fd = -1;
+        // Drop the written pages of the file from the page cache
+        bool drop = false;
+        // Number of bytes written into the file
+        uint64_t written = 0;
+        // End of the range whose writeback is started
+        uint64_t flushed = 0;
+        // End of the range dropped from the page cache
+        uint64_t dropped = 0;
+        // Receives the output in batches if set
+        Sink::Pointer sink = nullptr;
+        // Output blocks collected for the sink
+        BufferPool::Buffer batch = {};
+        std::vector<struct iovec> blocks = {};
+        // Number of bytes collected and the limit of a batch
+        size_t batched = 0;
+        size_t batchSize = 0;
+    };
+
+    /*!
+     * \brief Pass the collected blocks to the sink
+     *
+     * \return True on success, else the error is set on the archive
+     */
+    static auto flushSink(struct archive *archive, Output &output) -> bool {
+        if (output.blocks.empty()) {
+            return true;
+        }
+        auto res = output.sink->write(output.blocks);
+        output.blocks.clear();
+        output.batched = 0;
+        if (!res) {
+            archive_set_error(archive, EIO, "Sink write failed");
+        }
+        return res.has_value();
+    }
+
+    /*!
+     * \brief Collect an output block for the sink
+     */
+    static auto sinkWrite(struct archive *archive, Output &output, const void *buffer, size_t length) -> la_ssize_t {
+        if (output.batched + length > output.batchSize && !flushSink(archive, output)) {
+            return ARCHIVE_FATAL;
+        }
+
+        // Large blocks are passed without a copy
+        if (length >= output.batchSize) {
+            struct iovec block{const_cast<void *>(buffer), length};
+            if (!output.sink->write(std::span<const struct iovec>(&block, 1))) {
+                archive_set_error(archive, EIO, "Sink write failed");
+                return ARCHIVE_FATAL;
+            }
+            return length;
+        }
+
+        auto data = output.batch.get() + output.batched;
+        std::memcpy(data, buffer, length);
+        output.blocks.push_back(iovec{data, length});
+        output.batched += length;
+        return length;
+    }
+
+    // Size of the output ranges written back and dropped at once
+    static constexpr uint64_t DropWindow = 8 << 20;
+
+    /*!
+     * \brief Drop the written output from the page cache
+     *
+     * \details The writeback of a range is started once it's complete, the
+     *          range before is waited for and dropped. This keeps the amount
+     *          of dirty pages bounded without waiting for the latest writes.
+     *
+     * \param output The output file
+     * \param final  Write back and drop everything
+     */
+    static auto dropOutput(Output &output, bool final) -> void {
+        if (!final && output.written - output.flushed < DropWindow) {
+            return;
+        }
+        auto end = final ? output.written : output.flushed;
+        if (end > output.dropped) {
+            sync_file_range(output.fd, output.dropped, end - output.dropped,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(output.fd, output.dropped, end - output.dropped, POSIX_FADV_DONTNEED);
+            output.dropped = end;
+        }
+        if (output.written > output.flushed) {
+            sync_file_range(output.fd, output.flushed, output.written - output.flushed, SYNC_FILE_RANGE_WRITE);
+            output.flushed = output.written;
+        }
+    }
+
+    static auto outputOpen(struct archive *archive, void *data) -> int {
+        auto &output = static_cast<Writer *>(data)->output;
+        if (output.sink) {
+            return output.sink->open() ? ARCHIVE_OK : ARCHIVE_FATAL;
+        }
+        return output.open ? output.open(archive, output.userdata) : ARCHIVE_OK;
+    }
+
+    static auto outputWrite(struct archive *archive, void *data, const void *buffer, size_t length) -> la_ssize_t {
+        auto writer = static_cast<Writer *>(data);
+        auto &output = writer->output;
+        auto begin = Counters::Clock::now();
+
+        la_ssize_t res;
+        if (output.sink) {
+            res = sinkWrite(archive, output, buffer, length);
+        } else if (output.write) {
+            res = output.write(archive, output.userdata, buffer, length);
+        } else {
+            do {
+                res = ::write(output.fd, buffer, length);
+            } while (res < 0 && errno == EINTR);
+            if (res < 0) {
+                archive_set_error(archive, errno, "Write failed");
+            } else if (output.drop) {
+                output.written += res;
+                dropOutput(output, false);
+            }
+        }
+
+        if (writer->collector) {
+            writer->collector->output(std::max<la_ssize_t>(res, 0), Counters::Clock::now() - begin);
+        }
+        return res;
+    }
+
+    static auto outputClose(struct archive *archive, void *data) -> int {
+        auto &output = static_cast<Writer *>(data)->output;
+        if (output.sink) {
+            bool flushed = flushSink(archive, output);
+            bool closed = output.sink->close().has_value();
+            return (flushed && closed) ? ARCHIVE_OK : ARCHIVE_FATAL;
+        }
+        if (output.fd >= 0) {
+            if (output.drop) {
+                dropOutput(output, true);
+            }
+            ::close(output.fd);
+            output.fd = -1;
+        }
+        return output.close ? output.close(archive, output.userdata) : ARCHIVE_OK;
+    }
+
+    static auto outputFree(struct archive *archive, void *data) -> int {
+        auto &output = static_cast<Writer *>(data)->output;
+        return output.free ? output.free(archive, output.userdata) : ARCHIVE_OK;
+    }
+
+    /*!
+     * \brief Invoke a libarchive call, measured as compression
+     */
+    template <typename F>
+    auto measured(F &&call) -> decltype(call()) {
+        if (!collector) {
+            return call();
+        }
+        auto begin = Counters::Clock::now();
+        auto res = call();
+        collector->compress(Counters::Clock::now() - begin);
+        return res;
+    }
+
+    /*!
+     * \brief Prepare the pooled header for the next entry
+     *
+     * \return The cleared header
+     */
+    auto resetHeader() -> struct archive_entry * {
+        if (entry.header) {
+            archive_entry_clear(entry.header.get());
+        } else {
+            entry.header.reset(archive_entry_new());
+        }
+        return entry.header.get();
+    }
+
+    /*!
+     * \brief Write the header of the current entry
+     *
+     * \details If zip entries are probed, the entry is stored without
+     *          compression if its leading data is incompressible.
+     *
+     * \param sample Leading data of the entry
+     *
+     * \return Nothing on success, else error code
+     */
+    auto writeHeader(std::span<const char> sample) -> Result<void> {
+        if (probing) {
+            auto path = archive_entry_pathname(entry.header.get());
+            auto res = Probe::incompressible(path, sample) ? archive_write_zip_set_compression_store(archive.get())
+                                                           : archive_write_zip_set_compression_deflate(archive.get());
+            if (res != ARCHIVE_OK) {
+                return std::unexpected(Error::SetCompressionFailed);
+            }
+        }
+        if (measured([&]() { return archive_write_header(archive.get(), entry.header.get()); }) != ARCHIVE_OK) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Check whether a queued file takes the small-file fast path
+     *
+     * \details Only the synchronous backends, the others read ahead of the
+     *          writer.
+     */
+    auto isSmall(const Queued &file) const -> bool {
+        return (options.input == InputType::Mmap || options.input == InputType::Pread) &&
+               S_ISREG(file.stat.st_mode) && static_cast<uint64_t>(file.stat.st_size) <= options.smallFileSize;
+    }
+
+    /*!
+     * \brief Write a batch of small files
+     *
+     * \details Each file is read with a single `pread` and written with its
+     *          header in one go. The batch ends once a chunk's worth of data
+     *          is written or the next file isn't small.
+     *
+     * \return Number of bytes written on success, else error code
+     */
+    auto writeSmallFiles() -> Result<size_t> {
+        auto limit = tuner ? tuner->chunkSize(UINT64_MAX) : options.bufferSize;
+        if (smallBuffer.size() < options.smallFileSize) {
+            smallBuffer = BufferPool::shared().lease(options.smallFileSize);
+        }
+
+        size_t total = 0;
+        do {
+            auto [file, stat] = std::move(files.front());
+            files.pop();
+            if (collector) {
+                collector->begin(file);
+            }
+
+            auto readBegin = Counters::Clock::now();
+            bool direct = false;
+            int fd = openInputFile(file, options.cache, direct);
+            if (fd < 0) {
+                return std::unexpected(Error::OpenFailed);
+            }
+            size_t length = 0;
+            ssize_t res = 1;
+            while (length < static_cast<size_t>(stat.st_size) && res > 0) {
+                auto buffer = smallBuffer.get() + length;
+                res = readInputFile(fd, buffer, stat.st_size - length, length, options.cache, direct);
+                if (res > 0) {
+                    length += res;
+                }
+            }
+            ::close(fd);
+            if (res < 0) {
+                return std::unexpected(Error::ReadFailed);
+            }
+
+            // File content has changed after queuing
+            if (length < static_cast<size_t>(stat.st_size)) {
+                return std::unexpected(Error::FileChanged);
+            }
+
+            if (collector) {
+                collector->read(length, Counters::Clock::now() - readBegin);
+            }
+
+            // Identical content is linked to its first entry
+            std::span<const char> content(smallBuffer.get(), length);
+            std::optional<std::string> target;
+            if (dedup && length > 0) {
+                auto fingerprint = Hasher::of(content);
+                dedup->reserve(length, sequence);
+                dedup->store(file, stat, fingerprint);
+                target = dedup->claim(fingerprint, length, sequence, file);
+                record(file, stat, fingerprint);
+
+                // Linked only if equal to the preceding entry
+                if (target) {
+                    auto check = ContentCheck::open(*target, length);
+                    if (!check || !check->compare(content)) {
+                        target.reset();
+                    }
+                }
+            } else if (options.manifest) {
+                record(file, stat, Hasher::of(content));
+            }
+            ++sequence;
+
+            setMetadata(resetHeader(), file, stat, ownerNames());
+            if (target) {
+                setHardlink(entry.header.get(), *target);
+                length = 0;
+            }
+            auto written = writeHeader(std::span<const char>(smallBuffer.get(), length));
+            if (!written) {
+                return std::unexpected(written.error());
+            }
+            for (size_t offset = 0; offset < length;) {
+                auto written = measured(
+                    [&]() { return archive_write_data(archive.get(), smallBuffer.get() + offset, length - offset); });
+                if (written <= 0) {
+                    return std::unexpected(Error::WriteFailed);
+                }
+                offset += written;
+            }
+            measured([&]() { return archive_write_finish_entry(archive.get()); });
+            if (collector) {
+                collector->step();
+                collector->end();
+            }
+            progressed(stat.st_size);
+            total += length;
+        } while (total < limit && !files.empty() && isSmall(files.front()));
+
+        return total;
+    }
+
+    /*!
+     * \brief Claim the content of the reserved entry
+     *
+     * \details A content contained already is compared with its preceding
+     *          entry before the entry is linked to it. The entry is written in
+     *          full if the file of the preceding entry can't be read anymore.
+     *
+     * \param file        Path of the file
+     * \param stat        Stats of the file taken on queuing
+     * \param sequence    Position of the entry in the archive
+     * \param fingerprint Fingerprint of the content
+     *
+     * \return The comparison with the preceding entry, no value if to be written in full
+     */
+    auto claimContent(const std::string &file, const struct stat64 &stat, uint64_t sequence,
+                      const Fingerprint &fingerprint) -> std::optional<ContentCheck> {
+        auto target = dedup->claim(fingerprint, stat.st_size, sequence, file);
+        if (!target) {
+            return std::nullopt;
+        }
+        auto check = ContentCheck::open(*target, stat.st_size);
+        if (!check) {
+            return std::nullopt;
+        }
+        return std::move(check.value());
+    }
+
+    /*!
+     * \brief Write the opened file as hard link to the preceding entry
+     *
+     * \param target Pathname of the preceding entry
+     *
+     * \return Nothing on success, else error code
+     */
+    auto writeLink(const std::string &target) -> Result<void> {
+        record(entry.path, entry.stat, *entry.fingerprint);
+
+        setMetadata(resetHeader(), entry.path, entry.stat, ownerNames());
+        setHardlink(entry.header.get(), target);
+        if (collector) {
+            collector->begin(entry.path);
+        }
+        auto res = writeHeader({});
+        if (!res) {
+            return res;
+        }
+        measured([&]() { return archive_write_finish_entry(archive.get()); });
+        if (collector) {
+            collector->step();
+            collector->end();
+        }
+        progressed(entry.stat.st_size);
+        return res;
+    }
+
+    /*!
+     * \brief Write a symbolic link without data
+     *
+     * \param file Path of the link
+     * \param stat Stats of the link taken on queuing
+     *
+     * \return Nothing on success, else error code
+     */
+    auto writeSymlink(const std::string &file, const struct stat64 &stat) -> Result<void> {
+        auto target = readSymlink(file, stat);
+        if (!target) {
+            return std::unexpected(target.error());
+        }
+        ++sequence;
+        record(file, stat, Hasher::of(target.value()));
+
+        setMetadata(resetHeader(), file, stat, ownerNames());
+        archive_entry_set_symlink(entry.header.get(), target->c_str());
+        if (collector) {
+            collector->begin(file);
+        }
+        auto res = writeHeader({});
+        if (!res) {
+            return res;
+        }
+        measured([&]() { return archive_write_finish_entry(archive.get()); });
+        if (collector) {
+            collector->step();
+            collector->end();
+        }
+        progressed(0);
+        return res;
+    }
+
+    /*!
+     * \brief Write the header of the opened file
+     *
+     * \return Nothing on success, else error code
+     */
+    auto beginEntry() -> Result<void> {
+        auto header = resetHeader();
+        setMetadata(header, entry.path, entry.stat, ownerNames());
+        entry.sparse = SparseMap::of(entry.path, entry.stat);
+        if (pax) {
+            setSparse(header, entry.sparse);
+        }
+        if (collector) {
+            collector->begin(entry.path);
+        }
+        if (options.progress) {
+            options.progress->begin(entry.totalSize);
+        }
+
+        // Write header to archive, a probed entry once its first chunk is read
+        entry.deferred = probing && entry.remainingSize > 0;
+        if (!entry.deferred) {
+            return writeHeader({});
+        }
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Read the opened file again from its start
+     *
+     * \details The file is written in full unless compared with its preceding
+     *          entry first.
+     *
+     * \return Nothing on success, else error code
+     */
+    auto rereadEntry() -> Result<void> {
+        if (!source->rewind()) {
+            source->close();
+            auto opened = source->open(entry.path, entry.totalSize);
+            if (!opened) {
+                return opened;
+            }
+        }
+        entry.remainingSize = entry.totalSize;
+        entry.verifying = entry.check.has_value();
+        if (entry.verifying) {
+            return std::expected<void, Error>();
+        }
+        return beginEntry();
+    }
+
+    /*!
+     * \brief Fingerprint or compare a chunk of the opened file before its header
+     *
+     * \details Once fingerprinted completely, the file is read again and
+     *          compared with the preceding entry of its content, if any. A
+     *          file equal to it is written as hard link, else the file is read
+     *          again from the source and written in full.
+     *
+     * \param mode Mode of operation
+     *
+     * \return Number of bytes read, zero if the data isn't available yet, else error code
+     */
+    auto verifyStep(Mode mode) -> Result<uint64_t> {
+        auto chunk = source->read(mode);
+        if (!chunk) {
+            dedup->settle(entry.totalSize, entry.sequence);
+            return std::unexpected(chunk.error());
+        }
+        if (!chunk->has_value()) {
+            return 0;
+        }
+        // File content has changed after queuing
+        if (chunk->value().empty()) {
+            dedup->settle(entry.totalSize, entry.sequence);
+            return std::unexpected(Error::FileChanged);
+        }
+        uint64_t length = std::min<uint64_t>(chunk->value().size(), entry.remainingSize);
+        auto data = chunk->value().first(length);
+        entry.remainingSize -= length;
+
+        // A difference to the preceding entry ends the comparison, the file is
+        // written in full then
+        if (entry.check) {
+            if (!entry.check->compare(data)) {
+                entry.check.reset();
+                auto res = rereadEntry();
+                if (!res) {
+                    return std::unexpected(res.error());
+                }
+                return length;
+            }
+            if (entry.remainingSize > 0) {
+                return length;
+            }
+            auto res = writeLink(entry.check->target());
+            if (!res) {
+                return std::unexpected(res.error());
+            }
+            entry.check.reset();
+            entry.verifying = false;
+            entry.remainingSize = 0;
+            entry.totalSize = 0;
+            source->close();
+            return length;
+        }
+
+        entry.hasher.update(data);
+        if (entry.remainingSize > 0) {
+            return length;
+        }
+        entry.fingerprint = entry.hasher.digest();
+        dedup->store(entry.path, entry.stat, *entry.fingerprint);
+        entry.check = claimContent(entry.path, entry.stat, entry.sequence, *entry.fingerprint);
+        auto res = rereadEntry();
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        return length;
+    }
+
+    /*!
+     * \brief Cache of the owner names if stored
+     */
+    auto ownerNames() const -> OwnerNames * { return options.ownerNames ? &OwnerNames::shared() : nullptr; }
+
+    /*!
+     * \brief Write the queued files on the calling thread
+     *
+     * \param mode   Mode of operation
+     * \param budget Budget of the non-blocking call, null for a single step
+     *
+     * \return Result with the state of operation on success, error code on failure.
+     */
+    auto writeSerial(Mode mode, const Budget *budget) -> Result<State> {
+        // Nothing to do, archive is completely written
+        if (!source->is_open() && files.empty()) {
+            return State::Finished;
+        }
+
+        // Repeat in blocking mode until everything is written, else until
+        // the budget is used
+        auto start = Budget::Clock::now();
+        uint64_t used = 0;
+        do {
+            // Invokes the progress callback once per interval
+            if (options.progress) {
+                options.progress->report();
+            }
+
+            // Measure the step for the buffer tuning
+            ChunkTuner::Clock::time_point begin;
+            size_t stepBytes = 0;
+            if (tuner) {
+                begin = ChunkTuner::Clock::now();
+            }
+
+            // Small files are written whole, several in a single step
+            if (!source->is_open() && isSmall(files.front())) {
+                auto written = writeSmallFiles();
+                if (!written) {
+                    return std::unexpected(written.error());
+                }
+                used += written.value();
+                if (tuner) {
+                    tuner->record(written.value(), ChunkTuner::Clock::now() - begin);
+                }
+                continue;
+            }
+
+            // Open file if not already opened
+            if (!source->is_open()) {
+                // Stats of the input file were taken on queuing
+                auto [file, stat] = std::move(files.front());
+                files.pop();
+
+                if (S_ISLNK(stat.st_mode)) {
+                    auto res = writeSymlink(file, stat);
+                    if (!res) {
+                        return std::unexpected(res.error());
+                    }
+                    continue;
+                }
+
+                // Identical content is linked to its first entry once compared
+                // equal. An entry of a size seen before is fingerprinted first
+                // unless cached, others are hashed while written
+                entry.fingerprint.reset();
+                entry.check.reset();
+                entry.verifying = false;
+                entry.sequence = sequence++;
+                if (dedup && stat.st_size > 0) {
+                    bool known = dedup->reserve(stat.st_size, entry.sequence);
+                    entry.fingerprint = dedup->cached(file, stat);
+                    if (entry.fingerprint) {
+                        entry.check = claimContent(file, stat, entry.sequence, *entry.fingerprint);
+                    }
+                    entry.verifying = entry.check || (known && !entry.fingerprint);
+                }
+
+                if (tuner) {
+                    source->resize(tuner->chunkSize(stat.st_size));
+                }
+
+                // Failed to open input file
+                auto opened = source->open(file, stat.st_size);
+                if (!opened) {
+                    if (dedup) {
+                        dedup->settle(stat.st_size, entry.sequence);
+                    }
+                    return std::unexpected(opened.error());
+                }
+
+                // Save total size, init remaining size to be written
+                entry.remainingSize = stat.st_size;
+                entry.totalSize = stat.st_size;
+                entry.path = file;
+                entry.stat = stat;
+                entry.hasher = Hasher();
+                if (!entry.verifying) {
+                    auto res = beginEntry();
+                    if (!res) {
+                        return std::unexpected(res.error());
+                    }
+                }
+            }
+
+            // Fingerprint and compare the content before deciding on the header
+            if (entry.verifying) {
+                auto res = verifyStep(mode);
+                if (!res) {
+                    return std::unexpected(res.error());
+                }
+                used += res.value();
+                if (entry.verifying && res.value() == 0) {
+                    return State::InProgress;
+                }
+                continue;
+            }
+
+            // Write until predefined size is written
+            if (entry.remainingSize > 0) {
+                // Fetch the next chunk from the input source
+                // Holes are passed as zeros without reading them
+                if (entry.pending.empty()) {
+                    auto zeros = entry.sparse.zerosAt(entry.totalSize - entry.remainingSize);
+                    if (!zeros.empty() && source->skip(zeros.size())) {
+                        entry.pending = zeros;
+                        if ((options.manifest || dedup) && !entry.fingerprint) {
+                            entry.hasher.update(entry.pending);
+                        }
+                    }
+                }
+                if (entry.pending.empty()) {
+                    auto readBegin = Counters::Clock::now();
+                    auto chunk = source->read(mode);
+                    if (!chunk) {
+                        return std::unexpected(chunk.error());
+                    }
+
+                    // Data isn't available yet, try again on the next step
+                    if (!chunk->has_value()) {
+                        return State::InProgress;
+                    }
+
+                    // File content has changed after queuing
+                    if (chunk->value().empty()) {
+                        return std::unexpected(Error::FileChanged);
+                    }
+                    entry.pending = chunk->value();
+                    if ((options.manifest || dedup) && !entry.fingerprint) {
+                        entry.hasher.update(entry.pending);
+                    }
+                    if (collector) {
+                        collector->read(entry.pending.size(), Counters::Clock::now() - readBegin);
+                    }
+                }
+
+                if (entry.deferred) {
+                    auto res = writeHeader(entry.pending);
+                    if (!res) {
+                        return std::unexpected(res.error());
+                    }
+                    entry.deferred = false;
+                }
+
+                // Write the chunk into the archive
+                auto written = measured(
+                    [&]() { return archive_write_data(archive.get(), entry.pending.data(), entry.pending.size()); });
+                if (written < 0) {
+                    return std::unexpected(Error::WriteFailed);
+                }
+
+                entry.remainingSize -= written;
+                entry.pending = entry.pending.subspan(written);
+                stepBytes = written;
+                used += written;
+                if (options.progress) {
+                    options.progress->advance(written);
+                }
+            }
+
+            // Adapt the chunk size once the current chunk is consumed
+            if (tuner) {
+                tuner->record(stepBytes, ChunkTuner::Clock::now() - begin);
+                if (entry.pending.empty()) {
+                    source->resize(tuner->chunkSize(entry.totalSize));
+                }
+            }
+
+            if (collector) {
+                collector->step();
+            }
+
+            // Reset entry for next file
+            if (entry.remainingSize <= 0) {
+                measured([&]() { return archive_write_finish_entry(archive.get()); });
+                if (collector) {
+                    collector->end();
+                }
+                if (options.progress) {
+                    options.progress->end();
+                }
+                // Hashed while written, later entries may link to it
+                auto fingerprint = entry.fingerprint.value_or(entry.hasher.digest());
+                if (dedup && !entry.fingerprint && entry.totalSize > 0) {
+                    dedup->store(entry.path, entry.stat, fingerprint);
+                    dedup->claim(fingerprint, entry.totalSize, entry.sequence, entry.path);
+                }
+                record(entry.path, entry.stat, fingerprint);
+                entry.remainingSize = 0;
+                entry.totalSize = 0;
+                entry.pending = {};
+                entry.sparse = {};
+                source->close();
+            }
+        } while ((mode == Mode::Block || (budget && budget->allows(start, used))) &&
+                 (source->is_open() || !files.empty()));
+
+        return finish((source->is_open() || !files.empty()) ? State::InProgress : State::Finished);
+    }
+
+    /*!
+     * \brief Hand queued files to the workers and write finished entries
+     *
+     * \param mode   Mode of operation
+     * \param budget Limits the data written by a non-blocking call
+     *
+     * \return Result with the state of operation on success, error code on failure.
+     */
+    auto writeParallel(Mode mode, const Budget &budget = {}) -> Result<State> {
+        do {
+            // Keep the workers busy
+            while (!files.empty() && !engine->full()) {
+                auto [file, stat] = std::move(files.front());
+                files.pop();
+                engine->submit(std::move(file), stat);
+            }
+
+            auto res = engine->drain(archive.get(), mode == Mode::Block, budget);
+            if (!res) {
+                return std::unexpected(res.error());
+            }
+        } while (mode == Mode::Block && (!files.empty() || !engine->idle()));
+
+        return finish((!files.empty() || !engine->idle()) ? State::InProgress : State::Finished);
+    }
+
+    /*!
+     * \brief Report the progress once everything is written
+     *
+     * \return The state of operation
+     */
+    auto finish(State state) -> State {
+        if (options.progress && state == State::Finished) {
+            options.progress->report(true);
+        }
+        return state;
     }
 
+    // Options of the writer
+    Options options;
     // Actively written entry
     Entry entry;
     // Output archive pointer
     std::unique_ptr<struct archive, ArchiveDeleter> archive;
     // Queue of files to include in zip
-    std::queue<std::string> files;
-    // Input file stream for files
-    std::ifstream input;
-    // Buffer used for input-output into zip
-    Buffer buffer;
+    std::queue<Queued> files;
+    // Source of the input files in serial mode
+    InputSource::Pointer source;
+    // Buffer receiving the small files, leased from the shared pool
+    BufferPool::Buffer smallBuffer;
+    // Zip entries are probed and stored if incompressible
+    bool probing = false;
+    // Entries are written as pax, which records the holes of sparse files
+    bool pax = false;
+    // Detection of identical entries if enabled
+    std::optional<Dedup> dedup;
+    // Number of entries started in serial mode, orders the claims
+    uint64_t sequence = 0;
+    // Tuner of the chunk size if not given by the options
+    std::optional<ChunkTuner> tuner;
+    // Size of the output blocks
+    size_t blockSize = 0;
+    // Collector of the statistics if enabled
+    std::optional<StatsCollector> collector;
+    // Wrapped output callbacks if statistics are collected
+    Output output;
+    // Workers compressing entries in parallel mode
+    std::unique_ptr<ParallelEngine> engine;
 };
 
 } // namespace compression
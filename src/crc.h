@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#if defined(HAVE_LIBDEFLATE_H)
+#include <libdeflate.h>
+#elif defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+namespace compression {
+
+#if defined(HAVE_LIBDEFLATE_H) || defined(HAVE_ZLIB_H)
+/*!
+ * \brief CRC-32 of the zip entries
+ *
+ * \details Computed by libdeflate if available, which folds with PCLMULQDQ
+ *          or the ARMv8 CRC instructions, else by zlib. zlib-ng, selected by
+ *          the `ZLIB_BACKEND` CMake option, accelerates the zlib function as
+ *          well as the CRC-32 computed by the zip writer of libarchive.
+ */
+class Crc32 {
+public:
+    // Name of the implementation
+#if defined(HAVE_LIBDEFLATE_H)
+    static constexpr const char *Backend = "libdeflate";
+#elif defined(ZLIBNG_VERSION)
+    static constexpr const char *Backend = "zlib-ng";
+#else
+    static constexpr const char *Backend = "zlib";
+#endif
+
+    /*!
+     * \brief Continue the CRC-32 with more data
+     *
+     * \param crc  CRC-32 of the preceding data, zero initially
+     * \param data The data to add
+     *
+     * \return CRC-32 including the data
+     */
+    static auto update(uint32_t crc, std::span<const char> data) -> uint32_t {
+#if defined(HAVE_LIBDEFLATE_H)
+        return libdeflate_crc32(crc, data.data(), data.size());
+#else
+        return crc32_z(crc, reinterpret_cast<const Bytef *>(data.data()), data.size());
+#endif
+    }
+};
+#endif
+
+} // namespace compression
@@ -0,0 +1,384 @@
+#pragma once
+
+#include "fingerprint.h"
+#include "manifest.h"
+#include "types.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+namespace compression {
+
+/*!
+ * \brief Fingerprints of input files, persistable between runs
+ *
+ * \details A fingerprint is reused as long as the file is unchanged, so
+ *          unchanged files aren't read to fingerprint them. The cache is saved
+ *          as `Manifest` holding the files looked up or stored since the cache
+ *          was loaded, files not seen in the run are dropped. Thread-safe.
+ */
+class DedupCache {
+public:
+    /*!
+     * \brief Load the cache from a file
+     *
+     * \details A missing file loads an empty cache.
+     *
+     * \param filename The file written by `save()` or a manifest
+     *
+     * \return Nothing on success, else error code
+     */
+    auto load(const std::string &filename) -> Result<void> {
+        Manifest loaded;
+        auto res = loaded.load(filename);
+        if (!res) {
+            return res;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        previous = std::move(loaded);
+        current = Manifest();
+        return res;
+    }
+
+    /*!
+     * \brief Save the cache into a file
+     *
+     * \param filename The file to write
+     *
+     * \return Nothing on success, else error code
+     */
+    auto save(const std::string &filename) const -> Result<void> {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current.save(filename);
+    }
+
+    /*!
+     * \brief Fingerprint of an unchanged file
+     *
+     * \param path Path of the file
+     * \param stat Current stats of the file
+     *
+     * \return The fingerprint, no value if unknown or changed
+     */
+    auto lookup(const std::string &path, const struct stat64 &stat) -> std::optional<Fingerprint> {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto record = current.unchanged(path, stat)) {
+            return record->fingerprint;
+        }
+        if (auto record = previous.unchanged(path, stat)) {
+            current.add(path, *record);
+            return record->fingerprint;
+        }
+        return std::nullopt;
+    }
+
+    /*!
+     * \brief Store the fingerprint of a file
+     *
+     * \param path        Path of the file
+     * \param stat        Stats of the file while it was read
+     * \param fingerprint Fingerprint of the content
+     */
+    auto store(const std::string &path, const struct stat64 &stat, const Fingerprint &fingerprint) -> void {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.add(path, Manifest::Record::of(stat, fingerprint));
+    }
+
+    /*!
+     * \brief Number of fingerprints loaded and stored since
+     */
+    auto size() const -> size_t {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto count = previous.size();
+        for (const auto &[path, record] : current.entries()) {
+            count += (previous.find(path) == nullptr) ? 1 : 0;
+        }
+        return count;
+    }
+
+private:
+    // Guards the manifests
+    mutable std::mutex mutex;
+    // Fingerprints of the loaded file
+    Manifest previous;
+    // Fingerprints looked up or stored since the load
+    Manifest current;
+};
+
+/*!
+ * \brief Comparison of an entry with the preceding entry it's linked to
+ *
+ * \details A matching fingerprint only selects the entry to link to, the
+ *          content is compared with the file of that entry chunk by chunk in
+ *          the order it's read. The entry is linked once every byte matched,
+ *          else it's written in full.
+ */
+class ContentCheck {
+public:
+    /*!
+     * \brief Open the file of the preceding entry
+     *
+     * \param target Path of the file, the pathname claimed by the entry
+     * \param size   Size of the content
+     *
+     * \return The comparison, error code if the file can't be read or its size changed
+     */
+    static auto open(const std::string &target, uint64_t size) -> Result<ContentCheck> {
+        int fd = ::open(target.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        ContentCheck check(fd, target, size);
+        struct stat64 stat;
+        if (fstat64(fd, &stat) != 0) {
+            return std::unexpected(Error::StatFailed);
+        }
+        if (!S_ISREG(stat.st_mode) || static_cast<uint64_t>(stat.st_size) != size) {
+            return std::unexpected(Error::FileChanged);
+        }
+        return check;
+    }
+
+    ContentCheck(ContentCheck &&other) noexcept
+        : fd(std::exchange(other.fd, -1)), path(std::move(other.path)), size(other.size), offset(other.offset),
+          buffer(std::move(other.buffer)) {}
+
+    ContentCheck &operator=(ContentCheck &&other) noexcept {
+        std::swap(fd, other.fd);
+        std::swap(path, other.path);
+        std::swap(size, other.size);
+        std::swap(offset, other.offset);
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+
+    ContentCheck(const ContentCheck &) = delete;
+    ContentCheck &operator=(const ContentCheck &) = delete;
+
+    ~ContentCheck() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    /*!
+     * \brief Compare the next chunk of the content
+     *
+     * \param data The chunk following the ones compared before
+     *
+     * \return True if equal, false if different or unreadable
+     */
+    auto compare(std::span<const char> data) -> bool {
+        if (data.size() > size - offset) {
+            return false;
+        }
+        while (!data.empty()) {
+            auto length = std::min(data.size(), ChunkSize);
+            if (!buffer) {
+                buffer = std::make_unique<char[]>(ChunkSize);
+            }
+            ssize_t res;
+            do {
+                res = pread64(fd, buffer.get(), length, offset);
+            } while (res < 0 && errno == EINTR);
+            if (res <= 0 || std::memcmp(buffer.get(), data.data(), res) != 0) {
+                return false;
+            }
+            offset += res;
+            data = data.subspan(res);
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Check whether the whole content was compared
+     */
+    auto complete() const -> bool { return offset == size; }
+
+    /*!
+     * \brief Pathname of the preceding entry
+     */
+    auto target() const -> const std::string & { return path; }
+
+private:
+    // Bytes read from the file at once
+    static constexpr size_t ChunkSize = 256 * 1024;
+
+    ContentCheck(int fd, std::string path, uint64_t size) : fd(fd), path(std::move(path)), size(size) {}
+
+    // The file of the preceding entry
+    int fd = -1;
+    std::string path;
+    uint64_t size = 0;
+    // Number of bytes compared
+    uint64_t offset = 0;
+    // Receives the content of the file, allocated on the first comparison
+    std::unique_ptr<char[]> buffer;
+};
+
+/*!
+ * \brief Detection of identical entries within an archive
+ *
+ * \details The first entry of a content is written in full, later entries of
+ *          the same size and fingerprint are written as hard link to it once
+ *          their content compared equal, see `ContentCheck`. The entries
+ *          are reserved by size in archive order first. An entry of a size
+ *          not reserved before is written in full and hashed while it's
+ *          written, only the later entries of a known size are fingerprinted
+ *          before their header. Thread-safe, entries may be claimed out of
+ *          order, a claim waits for the preceding entries of the same size.
+ */
+class Dedup {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param cache Fingerprints of the previous runs, updated with new ones
+     */
+    explicit Dedup(std::shared_ptr<DedupCache> cache) : cache(std::move(cache)) {}
+
+    /*!
+     * \brief Reserve an entry by the size of its content
+     *
+     * \details Has to be called in archive order, before the entry is claimed.
+     *
+     * \param size     Size of the content
+     * \param sequence Position of the entry in the archive
+     *
+     * \return True if a preceding entry has the same size, the entry has to be
+     *         fingerprinted before its header then
+     */
+    auto reserve(uint64_t size, uint64_t sequence) -> bool {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &group = sizes[size];
+        group.pending.insert(sequence);
+        return ++group.count > 1;
+    }
+
+    /*!
+     * \brief Fingerprint of an unchanged file cached by a previous run
+     *
+     * \param path Path of the file
+     * \param stat Stats of the file taken on queuing
+     *
+     * \return The fingerprint, no value if unknown or changed
+     */
+    auto cached(const std::string &path, const struct stat64 &stat) -> std::optional<Fingerprint> {
+        return cache->lookup(path, stat);
+    }
+
+    /*!
+     * \brief Store the fingerprint of a file read completely
+     *
+     * \param path        Path of the file
+     * \param stat        Stats of the file taken on queuing
+     * \param fingerprint Fingerprint of the content
+     */
+    auto store(const std::string &path, const struct stat64 &stat, const Fingerprint &fingerprint) -> void {
+        cache->store(path, stat, fingerprint);
+    }
+
+    /*!
+     * \brief Claim the content of an entry
+     *
+     * \details Waits until the preceding entries of the same size are claimed
+     *          or settled. An entry claiming a content first, or before all
+     *          entries preceding it, is written in full. Such a claim replaces
+     *          the claim of a later entry, both are written in full then. An
+     *          entry written in full before its claim ignores the result.
+     *
+     * \param fingerprint Fingerprint of the content
+     * \param size        Size of the content
+     * \param sequence    Position of the entry in the archive
+     * \param name        Pathname of the entry
+     *
+     * \return Pathname of the preceding entry to link to, no value if written in full
+     */
+    auto claim(const Fingerprint &fingerprint, uint64_t size, uint64_t sequence, const std::string &name)
+        -> std::optional<std::string> {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto &group = sizes[size];
+        settled.wait(lock, [&]() {
+            return cancelled || group.pending.empty() || *group.pending.begin() >= sequence;
+        });
+        if (group.pending.erase(sequence) > 0) {
+            settled.notify_all();
+        }
+
+        auto [it, inserted] = claims.try_emplace(fingerprint, Claim{size, sequence, name});
+        if (!inserted) {
+            if (it->second.size == size && it->second.sequence < sequence) {
+                return it->second.name;
+            }
+            if (it->second.sequence > sequence) {
+                it->second = Claim{size, sequence, name};
+            }
+        }
+        return std::nullopt;
+    }
+
+    /*!
+     * \brief Release a reserved entry that won't be claimed, e.g. on failure
+     *
+     * \param size     Size of the content
+     * \param sequence Position of the entry in the archive
+     */
+    auto settle(uint64_t size, uint64_t sequence) -> void {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto it = sizes.find(size); it != sizes.end() && it->second.pending.erase(sequence) > 0) {
+            settled.notify_all();
+        }
+    }
+
+    /*!
+     * \brief Stop waiting for preceding entries, claims are decided immediately
+     */
+    auto cancel() -> void {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        settled.notify_all();
+    }
+
+private:
+    struct Claim {
+        uint64_t size;
+        uint64_t sequence;
+        std::string name;
+    };
+
+    /*!
+     * \brief Entries of the same size
+     */
+    struct Group {
+        // Number of entries reserved
+        uint64_t count = 0;
+        // Positions of the entries reserved but not yet claimed
+        std::set<uint64_t> pending;
+    };
+
+    // Fingerprints of the previous runs
+    std::shared_ptr<DedupCache> cache;
+    // Guards the claims and the sizes
+    std::mutex mutex;
+    // Signals claimed or settled entries
+    std::condition_variable settled;
+    // Entries written in full by their content
+    std::unordered_map<Fingerprint, Claim, Fingerprint::Hash> claims;
+    // Reserved entries by size
+    std::unordered_map<uint64_t, Group> sizes;
+    // Set once claims don't wait anymore
+    bool cancelled = false;
+};
+
+} // namespace compression
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "sparse.h"
+#include "types.h"
+#include <archive.h>
+#include <archive_entry.h>
+#include <grp.h>
+#include <mutex>
+#include <pwd.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Deleter of the `struct archive`
+ */
+struct ArchiveDeleter {
+    auto operator()(struct archive *archive) -> void {
+        if (archive != nullptr) {
+            archive_write_free(archive);
+        }
+    }
+};
+
+/*!
+ * \brief Deleter of the `struct archive_entry`
+ */
+struct EntryDeleter {
+    auto operator()(struct archive_entry *entry) -> void {
+        if (entry != nullptr) {
+            archive_entry_free(entry);
+        }
+    }
+};
+
+/*!
+ * \brief Cache of the user and group names by identifier
+ *
+ * \details Every identifier is looked up once in the user and group
+ *          databases, the archives mostly contain files of few owners.
+ *          Thread-safe.
+ */
+class OwnerNames {
+public:
+    /*!
+     * \brief Cache shared by all writers
+     */
+    static auto shared() -> OwnerNames & {
+        static OwnerNames names;
+        return names;
+    }
+
+    /*!
+     * \brief Name of a user
+     *
+     * \return The name, null if unknown. Valid as long as the cache.
+     */
+    auto user(uid_t uid) -> const char * {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = users.try_emplace(uid);
+        if (inserted) {
+            struct passwd entry;
+            struct passwd *result = nullptr;
+            std::vector<char> buffer(bufferSize(_SC_GETPW_R_SIZE_MAX));
+            if (getpwuid_r(uid, &entry, buffer.data(), buffer.size(), &result) == 0 && result != nullptr) {
+                it->second = result->pw_name;
+            }
+        }
+        return it->second.empty() ? nullptr : it->second.c_str();
+    }
+
+    /*!
+     * \brief Name of a group
+     *
+     * \return The name, null if unknown. Valid as long as the cache.
+     */
+    auto group(gid_t gid) -> const char * {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = groups.try_emplace(gid);
+        if (inserted) {
+            struct group entry;
+            struct group *result = nullptr;
+            std::vector<char> buffer(bufferSize(_SC_GETGR_R_SIZE_MAX));
+            if (getgrgid_r(gid, &entry, buffer.data(), buffer.size(), &result) == 0 && result != nullptr) {
+                it->second = result->gr_name;
+            }
+        }
+        return it->second.empty() ? nullptr : it->second.c_str();
+    }
+
+private:
+    static auto bufferSize(int name) -> size_t {
+        auto size = sysconf(name);
+        return (size > 0) ? size : 16 << 10;
+    }
+
+    // Guards the names
+    std::mutex mutex;
+    // Names by identifier, empty if unknown
+    std::unordered_map<uid_t, std::string> users;
+    std::unordered_map<gid_t, std::string> groups;
+};
+
+/*!
+ * \brief Set the meta information of an archive entry
+ *
+ * \details Taken from the stats of the queued file without further system
+ *          calls. The modification time is stored in whole seconds, a
+ *          fraction would add a pax extended header to every entry.
+ *          Symbolic links need their target set, see `readSymlink()`.
+ *
+ * \param entry The entry to fill
+ * \param path  Pathname of the entry inside the archive
+ * \param stat  Stats of the input file
+ * \param names Names of the owners, null to store the identifiers only
+ */
+inline auto setMetadata(struct archive_entry *entry, const std::string &path, const struct stat64 &stat,
+                        OwnerNames *names = nullptr) -> void {
+    archive_entry_set_pathname(entry, path.c_str());
+    archive_entry_set_mode(entry, stat.st_mode);
+    archive_entry_set_size(entry, S_ISREG(stat.st_mode) ? stat.st_size : 0);
+    archive_entry_set_uid(entry, stat.st_uid);
+    archive_entry_set_gid(entry, stat.st_gid);
+    archive_entry_set_mtime(entry, stat.st_mtim.tv_sec, 0);
+    if (names != nullptr) {
+        if (auto user = names->user(stat.st_uid)) {
+            archive_entry_set_uname(entry, user);
+        }
+        if (auto group = names->group(stat.st_gid)) {
+            archive_entry_set_gname(entry, group);
+        }
+    }
+}
+
+/*!
+ * \brief Record the data regions of a sparse file in an archive entry
+ *
+ * \details The pax writer stores only the regions and drops the data passed
+ *          for the holes. Has to be set after the size, before the header is
+ *          written. Files without holes are left unchanged.
+ *
+ * \param entry The entry to fill
+ * \param map   Data regions of the file
+ */
+inline auto setSparse(struct archive_entry *entry, const SparseMap &map) -> void {
+    if (!map.holes()) {
+        return;
+    }
+    for (const auto &extent : map.extents()) {
+        archive_entry_sparse_add_entry(entry, extent.offset, extent.length);
+    }
+    // Terminates the map of a file ending in a hole
+    archive_entry_sparse_add_entry(entry, archive_entry_size(entry), 0);
+}
+
+/*!
+ * \brief Read the target of a symbolic link
+ *
+ * \param path Path of the link
+ * \param stat Stats of the link taken on queuing
+ *
+ * \return The target, error code if unreadable or changed since
+ */
+inline auto readSymlink(const std::string &path, const struct stat64 &stat) -> Result<std::string> {
+    std::string target(stat.st_size + 1, '\0');
+    auto length = ::readlink(path.c_str(), target.data(), target.size());
+    if (length < 0) {
+        return std::unexpected(Error::ReadFailed);
+    }
+    if (length != stat.st_size) {
+        return std::unexpected(Error::FileChanged);
+    }
+    target.resize(length);
+    return target;
+}
+
+/*!
+ * \brief Turn an archive entry into a hard link without data
+ *
+ * \param entry  The entry filled by `setMetadata()`
+ * \param target Pathname of the preceding entry holding the data
+ */
+inline auto setHardlink(struct archive_entry *entry, const std::string &target) -> void {
+    archive_entry_set_hardlink(entry, target.c_str());
+    archive_entry_set_size(entry, 0);
+}
+
+} // namespace compression
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+namespace compression {
+
+/*!
+ * \brief 128-bit fingerprint of the content of a file
+ */
+struct Fingerprint {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    auto operator==(const Fingerprint &other) const -> bool = default;
+
+    struct Hash {
+        auto operator()(const Fingerprint &fingerprint) const -> size_t { return fingerprint.low; }
+    };
+};
+
+/*!
+ * \brief Pseudo-random keys of the hash lanes, distinct per seed
+ */
+constexpr auto hashKeys(uint64_t seed) -> std::array<uint64_t, 8> {
+    std::array<uint64_t, 8> keys{};
+    for (auto &key : keys) {
+        seed += 0x9E3779B97F4A7C15ULL;
+        uint64_t value = seed;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        key = value ^ (value >> 31);
+    }
+    return keys;
+}
+
+/*!
+ * \brief Streaming hash producing the fingerprints
+ *
+ * \details Accumulates 64-byte stripes into eight independent lanes of
+ *          32x32-bit multiplications, which compilers map onto SIMD
+ *          registers. Every stripe position of a block is mixed with keys of
+ *          its own, and the lanes are scrambled after each block, so
+ *          reordered stripes change the fingerprint. The hash isn't
+ *          cryptographic, it only selects candidates: identical entries are
+ *          compared byte by byte before they are linked, see `ContentCheck`.
+ */
+class Hasher {
+public:
+    // Number of bytes consumed per accumulation
+    static constexpr size_t StripeSize = 64;
+    // Number of stripes between the scrambles of the lanes
+    static constexpr size_t BlockStripes = 16;
+
+    /*!
+     * \brief Hash the data
+     */
+    auto update(std::span<const char> data) -> void {
+        length += data.size();
+        if (buffered > 0) {
+            auto size = std::min(data.size(), StripeSize - buffered);
+            std::memcpy(stripe.data() + buffered, data.data(), size);
+            buffered += size;
+            data = data.subspan(size);
+            if (buffered < StripeSize) {
+                return;
+            }
+            accumulate(stripe.data());
+            buffered = 0;
+        }
+        while (data.size() >= StripeSize) {
+            accumulate(data.data());
+            data = data.subspan(StripeSize);
+        }
+        std::memcpy(stripe.data(), data.data(), data.size());
+        buffered = data.size();
+    }
+
+    /*!
+     * \brief Fingerprint of all hashed data
+     */
+    auto digest() const -> Fingerprint {
+        // The partial stripe is padded with zeros, the length tells it apart
+        Hasher final = *this;
+        if (buffered > 0) {
+            std::memset(final.stripe.data() + buffered, 0, StripeSize - buffered);
+            final.accumulate(final.stripe.data());
+        }
+        return Fingerprint{merge(final.lanes, length * Prime1, 0), merge(final.lanes, ~length * Prime2, 1)};
+    }
+
+    /*!
+     * \brief Fingerprint of a data block
+     */
+    static auto of(std::span<const char> data) -> Fingerprint {
+        Hasher hasher;
+        hasher.update(data);
+        return hasher.digest();
+    }
+
+private:
+    static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+
+    // Keys of every stripe position within a block
+    static constexpr auto StripeKeys = []() {
+        std::array<std::array<uint64_t, 8>, BlockStripes> keys{};
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[i] = hashKeys(16 + i);
+        }
+        return keys;
+    }();
+    static constexpr std::array<uint64_t, 8> ScrambleKeys = hashKeys(2);
+    static constexpr std::array<uint64_t, 8> MergeKeys[] = {hashKeys(3), hashKeys(4)};
+
+    static auto load(const char *data) -> uint64_t {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        if constexpr (std::endian::native == std::endian::big) {
+            value = std::byteswap(value);
+        }
+        return value;
+    }
+
+    auto accumulate(const char *data) -> void {
+        std::array<uint64_t, 8> words;
+        for (size_t i = 0; i < words.size(); ++i) {
+            words[i] = load(data + 8 * i);
+        }
+        auto &keys = StripeKeys[stripes % BlockStripes];
+        for (size_t i = 0; i < lanes.size(); ++i) {
+            auto key = words[i] ^ keys[i];
+            lanes[i] += words[i ^ 1] + (key & 0xFFFFFFFF) * (key >> 32);
+        }
+        if (++stripes % BlockStripes == 0) {
+            for (size_t i = 0; i < lanes.size(); ++i) {
+                lanes[i] = (lanes[i] ^ (lanes[i] >> 47) ^ ScrambleKeys[i]) * 0x9E3779B1U;
+            }
+        }
+    }
+
+    static auto merge(const std::array<uint64_t, 8> &lanes, uint64_t seed, size_t which) -> uint64_t {
+        auto &keys = MergeKeys[which];
+        uint64_t value = seed;
+        for (size_t i = 0; i < lanes.size(); i += 2) {
+            auto product = static_cast<unsigned __int128>(lanes[i] ^ keys[i]) * (lanes[i + 1] ^ keys[i + 1]);
+            value += static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+        }
+        value = (value ^ (value >> 37)) * Prime3;
+        return value ^ (value >> 32);
+    }
+
+    // Accumulators of the stripes
+    std::array<uint64_t, 8> lanes = {Prime1, Prime2, Prime3, ~Prime1, ~Prime2, ~Prime3, Prime1 ^ Prime2, Prime3};
+    // Partial stripe of the previous update
+    std::array<char, StripeSize> stripe = {};
+    size_t buffered = 0;
+    // Number of accumulated stripes
+    uint64_t stripes = 0;
+    // Number of hashed bytes
+    uint64_t length = 0;
+};
+
+} // namespace compression
@@ -0,0 +1,364 @@
+#pragma once
+
+#include "sparse.h"
+#include "types.h"
+#include <algorithm>
+#include <archive.h>
+#include <archive_entry.h>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#if defined(HAVE_LIBLZ4)
+#include <lz4frame.h>
+#endif
+
+namespace compression {
+
+/*!
+ * \brief Location of an entry in an indexed tar.lz4 archive
+ */
+struct IndexRecord {
+    // Pathname of the entry
+    std::string path;
+    // Offset of the first LZ4 frame of the entry in the archive
+    uint64_t offset = 0;
+    // Size of the entry data
+    uint64_t size = 0;
+};
+
+/*!
+ * \brief Encoder of the random-access index of tar.lz4 archives
+ *
+ * \details Every entry of an indexed archive starts with a new independent
+ *          LZ4 frame. The index is appended as LZ4 skippable frame, which
+ *          decoders ignore, so the archive stays a regular tar.lz4 file. Its
+ *          payload ends with a footer to locate it from the end of the file:
+ *
+ *          entries (offset u64, size u64, name length u16, name)...
+ *          count u64, payload size u32, magic "TIDX"
+ */
+class FrameIndex {
+public:
+    // Magic of the skippable frame carrying the index
+    static constexpr uint32_t FrameMagic = 0x184D2A5E;
+    // Magic closing the index payload
+    static constexpr uint32_t IndexMagic = 0x58444954;
+    // Size of the footer closing the payload
+    static constexpr size_t FooterSize = 16;
+
+    /*!
+     * \brief Register an entry
+     */
+    auto add(IndexRecord record) -> void { records.push_back(std::move(record)); }
+
+    /*!
+     * \brief Encode the skippable frame carrying the index
+     */
+    auto encode() const -> std::string {
+        std::string payload;
+        for (const auto &record : records) {
+            put(payload, record.offset, 8);
+            put(payload, record.size, 8);
+            put(payload, record.path.size(), 2);
+            payload += record.path;
+        }
+        put(payload, records.size(), 8);
+        put(payload, payload.size() + 8, 4);
+        put(payload, IndexMagic, 4);
+
+        std::string frame;
+        put(frame, FrameMagic, 4);
+        put(frame, payload.size(), 4);
+        return frame + payload;
+    }
+
+    static auto put(std::string &out, uint64_t value, size_t bytes) -> void {
+        for (size_t i = 0; i < bytes; ++i) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    static auto get(const char *in, size_t bytes) -> uint64_t {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value |= uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        return value;
+    }
+
+private:
+    // Entries in archive order
+    std::vector<IndexRecord> records;
+};
+
+/*!
+ * \brief Random access to the entries of an indexed tar.lz4 archive
+ *
+ * \details Looks up an entry in the trailing index and decompresses only the
+ *          frames of the entry.
+ */
+class TarIndex {
+public:
+    template <typename T>
+    using Result = compression::Result<T>;
+    using Pointer = std::unique_ptr<TarIndex>;
+    // Receives the data of an entry block by block, returns false to stop
+    using Consumer = std::function<bool(std::span<const char>)>;
+
+    /*!
+     * \brief Destructor
+     */
+    ~TarIndex() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    /*!
+     * \brief Open an archive and load its index
+     *
+     * \param filename Filename of the archive
+     *
+     * \return Result container either a reference to the index or an error code
+     */
+    static auto open(const std::string &filename) -> Result<Pointer> {
+        auto index = std::unique_ptr<TarIndex>(new TarIndex());
+        index->fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (index->fd < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        struct stat64 stat;
+        if (fstat64(index->fd, &stat) < 0) {
+            return std::unexpected(Error::StatFailed);
+        }
+        uint64_t fileSize = stat.st_size;
+
+        std::string footer(FrameIndex::FooterSize, '\0');
+        if (fileSize < footer.size() + 8 || !index->readAt(footer, fileSize - footer.size()) ||
+            FrameIndex::get(footer.data() + 12, 4) != FrameIndex::IndexMagic) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+
+        uint64_t count = FrameIndex::get(footer.data(), 8);
+        uint64_t size = FrameIndex::get(footer.data() + 8, 4);
+        // Every record takes 18 bytes at least
+        if (size < footer.size() || size + 8 > fileSize || count > (size - footer.size()) / 18) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        std::string payload(size, '\0');
+        if (!index->readAt(payload, fileSize - size)) {
+            return std::unexpected(Error::ReadFailed);
+        }
+
+        size_t position = 0;
+        index->records.reserve(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            if (position + 18 > size - footer.size()) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            IndexRecord record;
+            record.offset = FrameIndex::get(payload.data() + position, 8);
+            record.size = FrameIndex::get(payload.data() + position + 8, 8);
+            size_t length = FrameIndex::get(payload.data() + position + 16, 2);
+            if (position + 18 + length > size - footer.size()) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            record.path.assign(payload.data() + position + 18, length);
+            position += 18 + length;
+            index->lookup.emplace(record.path, index->records.size());
+            index->records.push_back(std::move(record));
+        }
+        return index;
+    }
+
+    /*!
+     * \brief All indexed entries in archive order
+     */
+    auto entries() const -> const std::vector<IndexRecord> & { return records; }
+
+    /*!
+     * \brief Find an entry by its pathname
+     *
+     * \return The entry, null if not contained
+     */
+    auto find(const std::string &path) const -> const IndexRecord * {
+        auto it = lookup.find(path);
+        return (it == lookup.end()) ? nullptr : &records[it->second];
+    }
+
+    /*!
+     * \brief Read the data of an entry
+     *
+     * \details The data of a hard link is read from its target. The holes of
+     *          a sparse entry are passed as zeros.
+     *
+     * \param path    Pathname of the entry
+     * \param consume Receives the data block by block
+     *
+     * \return Nothing on success, else error code
+     */
+    auto read(const std::string &path, const Consumer &consume) -> Result<void> { return read(path, consume, true); }
+
+private:
+    struct ReadDeleter {
+        auto operator()(struct archive *archive) -> void { archive_read_free(archive); }
+    };
+
+    /*!
+     * \brief Read the data of an entry, following a hard link once
+     */
+    auto read(const std::string &path, const Consumer &consume, bool follow) -> Result<void> {
+#if defined(HAVE_LIBLZ4)
+        auto record = find(path);
+        if (record == nullptr) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        Stream stream{fd, record->offset};
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&stream.context, LZ4F_VERSION))) {
+            return std::unexpected(Error::InitFailed);
+        }
+
+        // Parse the tar records of the entry from its first frame on
+        std::unique_ptr<struct archive, ReadDeleter> archive(archive_read_new());
+        if (archive == nullptr || archive_read_support_format_tar(archive.get()) != ARCHIVE_OK ||
+            archive_read_open(archive.get(), &stream, nullptr, &Stream::read, nullptr) != ARCHIVE_OK) {
+            return std::unexpected(Error::InitFailed);
+        }
+
+        struct archive_entry *header;
+        if (archive_read_next_header(archive.get(), &header) < ARCHIVE_WARN ||
+            archive_entry_pathname(header) == nullptr || archive_entry_pathname(header) != path) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        // Data of a hard link is stored with its target
+        if (follow && archive_entry_hardlink(header) != nullptr && archive_entry_size(header) == 0) {
+            return read(archive_entry_hardlink(header), consume, false);
+        }
+
+        // Blocks are located by their offset, the gaps between them are holes
+        uint64_t position = 0;
+        auto fill = [&](uint64_t end) {
+            while (position < end) {
+                auto zeros = SparseMap::zeros().first(std::min<uint64_t>(end - position, SparseMap::ZeroSize));
+                if (!consume(zeros)) {
+                    return false;
+                }
+                position += zeros.size();
+            }
+            return true;
+        };
+        while (true) {
+            const void *buffer;
+            size_t size;
+            la_int64_t offset;
+            auto res = archive_read_data_block(archive.get(), &buffer, &size, &offset);
+            if (res == ARCHIVE_EOF) {
+                fill(std::max<la_int64_t>(archive_entry_size(header), 0));
+                return std::expected<void, Error>();
+            }
+            if (res < ARCHIVE_WARN) {
+                return std::unexpected(Error::ReadFailed);
+            }
+            if (offset < 0 || static_cast<uint64_t>(offset) < position) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            if (!fill(offset) || !consume(std::span<const char>(static_cast<const char *>(buffer), size))) {
+                return std::expected<void, Error>();
+            }
+            position += size;
+        }
+#else
+        return std::unexpected(Error::InvalidType);
+#endif
+    }
+
+#if defined(HAVE_LIBLZ4)
+    /*!
+     * \brief Decompressing input of libarchive starting at a frame
+     */
+    struct Stream {
+        int fd;
+        // Offset of the next compressed byte to read
+        uint64_t position;
+        LZ4F_dctx *context = nullptr;
+        std::vector<char> input = std::vector<char>(64 << 10);
+        size_t inputOffset = 0;
+        size_t inputLength = 0;
+        std::vector<char> output = std::vector<char>(256 << 10);
+
+        ~Stream() {
+            if (context) {
+                LZ4F_freeDecompressionContext(context);
+            }
+        }
+
+        static auto read(struct archive *archive, void *data, const void **buffer) -> la_ssize_t {
+            auto stream = static_cast<Stream *>(data);
+            while (true) {
+                if (stream->inputOffset == stream->inputLength) {
+                    auto res = pread64(stream->fd, stream->input.data(), stream->input.size(), stream->position);
+                    if (res < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (res <= 0) {
+                        return res < 0 ? ARCHIVE_FATAL : 0;
+                    }
+                    stream->position += res;
+                    stream->inputOffset = 0;
+                    stream->inputLength = res;
+                }
+
+                size_t produced = stream->output.size();
+                size_t consumed = stream->inputLength - stream->inputOffset;
+                auto res = LZ4F_decompress(stream->context, stream->output.data(), &produced,
+                                           stream->input.data() + stream->inputOffset, &consumed, nullptr);
+                if (LZ4F_isError(res)) {
+                    archive_set_error(archive, EINVAL, "%s", LZ4F_getErrorName(res));
+                    return ARCHIVE_FATAL;
+                }
+                stream->inputOffset += consumed;
+                if (produced > 0) {
+                    *buffer = stream->output.data();
+                    return produced;
+                }
+            }
+        }
+    };
+#endif
+
+    TarIndex() = default;
+
+    auto readAt(std::string &buffer, uint64_t offset) const -> bool {
+        size_t length = 0;
+        while (length < buffer.size()) {
+            auto res = pread64(fd, buffer.data() + length, buffer.size() - length, offset + length);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                return false;
+            }
+            length += res;
+        }
+        return true;
+    }
+
+    // File descriptor of the archive
+    int fd = -1;
+    // Entries in archive order
+    std::vector<IndexRecord> records;
+    // Position of the entries by pathname
+    std::unordered_map<std::string, size_t> lookup;
+};
+
+} // namespace compression
@@ -0,0 +1,475 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "memory.h"
+#include "types.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace compression {
+
+/*!
+ * \brief Open an input file honoring the cache mode
+ *
+ * \details Direct reads fall back to buffered reads with dropped pages if
+ *          the file system doesn't support `O_DIRECT`.
+ *
+ * \param path   The file to open
+ * \param mode   Use of the page cache
+ * \param direct Set if the file is opened with `O_DIRECT`
+ *
+ * \return The file descriptor, negative on failure
+ */
+inline auto openInputFile(const std::string &path, CacheMode mode, bool &direct) -> int {
+    direct = false;
+    if (mode == CacheMode::Direct) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (fd >= 0) {
+            direct = true;
+            return fd;
+        }
+    }
+    return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+/*!
+ * \brief Chunk size keeping the offsets of direct reads aligned
+ */
+inline auto alignChunk(size_t chunkSize, CacheMode mode) -> size_t {
+    constexpr auto Alignment = BufferPool::Alignment;
+    if (mode != CacheMode::Direct) {
+        return chunkSize;
+    }
+    return std::max<size_t>((chunkSize + Alignment - 1) / Alignment * Alignment, Alignment);
+}
+
+/*!
+ * \brief Read from an input file honoring the cache mode
+ *
+ * \details Direct reads round the length up to `BufferPool::Alignment`, the
+ *          buffer has to be aligned and hold the rounded length. An unaligned
+ *          offset, after a short read, switches the file to buffered reads.
+ *
+ * \param fd     The file to read from
+ * \param buffer Receives the data
+ * \param length Number of bytes to read
+ * \param offset Offset in the file
+ * \param mode   Use of the page cache
+ * \param direct Set if the file is opened with `O_DIRECT`, cleared on fallback
+ *
+ * \return Number of bytes read up to the length, negative on failure
+ */
+inline auto readInputFile(int fd, char *buffer, size_t length, uint64_t offset, CacheMode mode, bool &direct)
+    -> ssize_t {
+    constexpr auto Alignment = BufferPool::Alignment;
+    if (direct && offset % Alignment != 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = false;
+    }
+
+    auto request = direct ? (length + Alignment - 1) / Alignment * Alignment : length;
+    ssize_t res;
+    do {
+        res = pread64(fd, buffer, request, offset);
+    } while (res < 0 && errno == EINTR);
+
+    if (res > 0 && !direct && mode != CacheMode::Keep) {
+        posix_fadvise(fd, offset, res, POSIX_FADV_DONTNEED);
+    }
+    return std::min<ssize_t>(res, length);
+}
+
+/*!
+ * \brief Source of the entry data
+ *
+ * \details The writer opens the queued files one after another and fetches
+ *          their content chunk by chunk. A returned chunk stays valid until
+ *          the next call of `read()`, `open()` or `close()`. Sources may make
+ *          use of `prefetch()` to start reading files before they're opened.
+ */
+class InputSource {
+public:
+    using Pointer = std::unique_ptr<InputSource>;
+
+    /*!
+     * \brief Destructor
+     */
+    virtual ~InputSource() = default;
+
+    /*!
+     * \brief Announce a file that will be opened later
+     *
+     * \details Files are expected to be opened in the order of announcement.
+     *
+     * \param path The file to read ahead
+     * \param size Number of bytes expected to be read
+     */
+    virtual auto prefetch([[maybe_unused]] const std::string &path, [[maybe_unused]] uint64_t size) -> void {}
+
+    /*!
+     * \brief Open a file for reading
+     *
+     * \param path The file to open
+     * \param size Number of bytes to read at most, usually the queued size
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto open(const std::string &path, uint64_t size) -> Result<void> = 0;
+
+    /*!
+     * \brief Check whether a file is opened
+     */
+    virtual auto is_open() const -> bool = 0;
+
+    /*!
+     * \brief Read the next chunk of the opened file
+     *
+     * \param mode In non-blocking mode, return instead of waiting for data
+     *
+     * \return The chunk on success, empty at the end of file, no value if the
+     *         data isn't available without blocking, else error code
+     */
+    virtual auto read(Mode mode) -> Result<std::optional<std::span<const char>>> = 0;
+
+    /*!
+     * \brief Advance over data not needed, e.g. a hole of a sparse file
+     *
+     * \details The last returned chunk becomes invalid. Sources reading ahead
+     *          don't support skipping, the data is read as usual.
+     *
+     * \param length Number of bytes to skip
+     *
+     * \return True if skipped, false if the data has to be read instead
+     */
+    virtual auto skip([[maybe_unused]] uint64_t length) -> bool { return false; }
+
+    /*!
+     * \brief Read the opened file again from its beginning
+     *
+     * \details The last returned chunk becomes invalid.
+     *
+     * \return True if rewound, false if the file has to be opened again
+     */
+    virtual auto rewind() -> bool { return false; }
+
+    /*!
+     * \brief Change the size of the chunks
+     *
+     * \details Takes effect for the chunks fetched after the call, the last
+     *          returned chunk becomes invalid.
+     *
+     * \param chunkSize Size of the chunks to read
+     */
+    virtual auto resize(size_t chunkSize) -> void = 0;
+
+    /*!
+     * \brief Close the opened file
+     */
+    virtual auto close() -> void = 0;
+
+    /*!
+     * \brief Invoke a callback once `read()` can return without blocking
+     *
+     * \details Sources without notification of their own invoke the callback
+     *          immediately. A later call replaces a pending callback.
+     *
+     * \param callback The callback to invoke once
+     */
+    virtual auto notify(std::function<void()> callback) -> void { callback(); }
+
+    /*!
+     * \brief Close the opened file and drop all announced files
+     */
+    virtual auto clear() -> void { close(); }
+
+    /*!
+     * \brief Set the use of the page cache
+     *
+     * \details Takes effect on the next opened file. Sources not supporting
+     *          a mode use the closest supported one.
+     *
+     * \param mode Use of the page cache
+     */
+    virtual auto cache([[maybe_unused]] CacheMode mode) -> void {}
+
+    /*!
+     * \brief Account the chunks read ahead in a memory budget
+     *
+     * \details Has to be set before the first open. Sources reading on demand
+     *          hold a single chunk and ignore it.
+     *
+     * \param memory The budget to acquire from, null to disable
+     */
+    virtual auto budget([[maybe_unused]] MemoryBudget *memory) -> void {}
+};
+
+/*!
+ * \brief Input source reading with `pread`
+ *
+ * \details The chunks are read into a buffer of the chunk size leased from
+ *          the shared buffer pool.
+ */
+class PreadSource : public InputSource {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param chunkSize Size of the chunks to read
+     */
+    explicit PreadSource(size_t chunkSize) : chunkSize(chunkSize) {}
+
+    /*!
+     * \brief Destructor
+     */
+    ~PreadSource() override { close(); }
+
+    auto open(const std::string &path, uint64_t size) -> Result<void> override {
+        close();
+        fd = openInputFile(path, cacheMode, direct);
+        if (fd < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        length = size;
+        return std::expected<void, Error>();
+    }
+
+    auto is_open() const -> bool override { return fd >= 0; }
+
+    /*!
+     * \brief File descriptor of the opened file
+     */
+    auto descriptor() const -> int { return fd; }
+
+    auto read([[maybe_unused]] Mode mode) -> Result<std::optional<std::span<const char>>> override {
+        if (position >= length) {
+            return std::span<const char>();
+        }
+        if (buffer.size() < chunkSize) {
+            buffer = BufferPool::shared().lease(chunkSize);
+        }
+
+        auto size = std::min<uint64_t>(chunkSize, length - position);
+        auto res = readInputFile(fd, buffer.get(), size, position, cacheMode, direct);
+        if (res < 0) {
+            return std::unexpected(Error::ReadFailed);
+        }
+        // Less data available than queued
+        if (res == 0) {
+            length = position;
+        }
+        position += res;
+        return std::span<const char>(buffer.get(), res);
+    }
+
+    auto skip(uint64_t length) -> bool override {
+        position = std::min(position + length, this->length);
+        return true;
+    }
+
+    auto rewind() -> bool override {
+        position = 0;
+        return true;
+    }
+
+    auto resize(size_t chunkSize) -> void override { this->chunkSize = alignChunk(chunkSize, cacheMode); }
+
+    auto close() -> void override {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        length = 0;
+        position = 0;
+    }
+
+    auto cache(CacheMode mode) -> void override {
+        cacheMode = mode;
+        resize(chunkSize);
+    }
+
+private:
+    // Size of the chunks to read
+    size_t chunkSize;
+    // Use of the page cache
+    CacheMode cacheMode = CacheMode::Keep;
+    // Opened file is read with `O_DIRECT`
+    bool direct = false;
+    // Buffer receiving the chunks, leased on first use
+    BufferPool::Buffer buffer;
+    // File descriptor of the opened file
+    int fd = -1;
+    // Number of bytes to read
+    uint64_t length = 0;
+    // Offset of the next chunk
+    uint64_t position = 0;
+};
+
+/*!
+ * \brief Input source mapping the files into memory
+ *
+ * \details Regular files are mapped into memory and handed out as slices of
+ *          the mapping, so the data is passed to the compression without any
+ *          copy. Special files, or files that can't be mapped, are read with
+ *          `pread` instead.
+ *
+ *          A mapped file that is truncated while it's read causes SIGBUS on
+ *          access, same as any other user of the mapping.
+ */
+class MmapSource : public InputSource {
+public:
+    // Number of bytes announced ahead of the read position
+    static constexpr size_t ReadAhead = 8 << 20;
+
+    /*!
+     * \brief Constructor
+     *
+     * \param chunkSize Size of the chunks, rounded up to full pages if mapped
+     */
+    explicit MmapSource(size_t chunkSize) : fallback(chunkSize) { resize(chunkSize); }
+
+    /*!
+     * \brief Destructor
+     */
+    ~MmapSource() override { close(); }
+
+    auto open(const std::string &path, uint64_t size) -> Result<void> override {
+        close();
+        auto res = fallback.open(path, size);
+        if (!res) {
+            return res;
+        }
+
+        // Direct reads bypass the cache, the mapping would fill it
+        struct stat64 stat;
+        int fd = fallback.descriptor();
+        if (cacheMode != CacheMode::Direct && fstat64(fd, &stat) == 0 && S_ISREG(stat.st_mode) && size > 0) {
+            // Never map beyond the end of the file
+            auto mapped = std::min<uint64_t>(size, stat.st_size);
+            auto addr = mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                map = static_cast<char *>(addr);
+                length = mapped;
+                madvise(map, length, MADV_SEQUENTIAL);
+            }
+        }
+
+        return std::expected<void, Error>();
+    }
+
+    auto is_open() const -> bool override { return fallback.is_open(); }
+
+    auto read(Mode mode) -> Result<std::optional<std::span<const char>>> override {
+        if (map == nullptr) {
+            return fallback.read(mode);
+        }
+        // The previous slice is consumed
+        if (cacheMode == CacheMode::Drop) {
+            drop();
+        }
+        if (position >= length) {
+            return std::span<const char>();
+        }
+
+        // Keep the kernel reading ahead of the compression
+        if (position + chunkSize > advised && advised < length) {
+            auto window = std::min<uint64_t>(std::max(ReadAhead, chunkSize), length - advised);
+            madvise(map + advised, window, MADV_WILLNEED);
+            advised += window;
+        }
+
+        std::span<const char> data(map + position, std::min<uint64_t>(chunkSize, length - position));
+        position += data.size();
+        return data;
+    }
+
+    auto skip(uint64_t length) -> bool override {
+        if (map == nullptr) {
+            return fallback.skip(length);
+        }
+        if (cacheMode == CacheMode::Drop) {
+            drop();
+        }
+        position = std::min(position + length, this->length);
+        advised = std::max(advised, position);
+        return true;
+    }
+
+    auto rewind() -> bool override {
+        if (map == nullptr) {
+            return fallback.rewind();
+        }
+        if (cacheMode == CacheMode::Drop) {
+            drop();
+        }
+        position = 0;
+        advised = 0;
+        dropped = 0;
+        return true;
+    }
+
+    auto resize(size_t chunkSize) -> void override {
+        auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        this->chunkSize = std::max<size_t>((chunkSize + page - 1) / page * page, page);
+        fallback.resize(chunkSize);
+    }
+
+    auto close() -> void override {
+        if (map != nullptr) {
+            if (cacheMode == CacheMode::Drop) {
+                drop();
+            }
+            munmap(map, length);
+            map = nullptr;
+        }
+        fallback.close();
+        length = 0;
+        position = 0;
+        advised = 0;
+        dropped = 0;
+    }
+
+    auto cache(CacheMode mode) -> void override {
+        cacheMode = mode;
+        fallback.cache(mode);
+    }
+
+private:
+    /*!
+     * \brief Drop the consumed range of the mapping from the page cache
+     */
+    auto drop() -> void {
+        if (position > dropped) {
+            madvise(map + dropped, position - dropped, MADV_DONTNEED);
+            posix_fadvise(fallback.descriptor(), dropped, position - dropped, POSIX_FADV_DONTNEED);
+            dropped = position;
+        }
+    }
+
+    // Reads files that can't be mapped
+    PreadSource fallback;
+    // Size of the slices, a multiple of the page size
+    size_t chunkSize;
+    // Mapping of the opened file, null if read with the fallback
+    char *map = nullptr;
+    // Number of bytes mapped
+    uint64_t length = 0;
+    // Offset of the next slice
+    uint64_t position = 0;
+    // End of the range announced with MADV_WILLNEED
+    uint64_t advised = 0;
+    // End of the range dropped from the page cache
+    uint64_t dropped = 0;
+    // Use of the page cache
+    CacheMode cacheMode = CacheMode::Keep;
+};
+
+} // namespace compression
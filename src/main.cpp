@@ -5,6 +5,7 @@
 
 #define USE_ZIP 1
 #define NONBLOCK 1
+#define THREADS 0
 
 int custom_open(struct archive *archive, void *data) {
     std::cout << "> Custom Open" << std::endl;
@@ -12,8 +13,8 @@ int custom_open(struct archive *archive, void *data) {
 }
 
 la_ssize_t custom_write(struct archive *archive, void *data, const void *buffer, size_t length) {
-    std::string s(reinterpret_cast<const char *>(buffer), length);
-    std::cerr << s << std::flush;
+    std::cerr.write(static_cast<const char *>(buffer), length);
+    std::cerr.flush();
     return length;
 }
 
@@ -37,7 +38,8 @@ int main(int argc, char **argv) {
     compression::Writer::Pointer writer;
 
     if (std::string(argv[1]) == "file") {
-        auto res = compression::Writer::open(argv[2], compression::ArchiveType::TarLz4);
+        auto res = compression::Writer::open(argv[2], compression::ArchiveType::TarLz4,
+                                             compression::Writer::Options{.threads = THREADS});
         if (!res) {
             std::cerr << "Failed to open output file " << static_cast<int>(res.error()) << std::endl;
             return 1;
@@ -46,7 +48,8 @@ int main(int argc, char **argv) {
         offset = 1;
     } else if (std::string(argv[1]) == "cerr") {
         auto res = compression::Writer::open(compression::ArchiveType::TarLz4, &custom_open, &custom_write,
-                                             &custom_close, &custom_free);
+                                             &custom_close, &custom_free, nullptr,
+                                             compression::Writer::Options{.threads = THREADS});
         if (!res) {
             std::cerr << "Failed to open output file" << std::endl;
             return 1;
@@ -75,7 +78,7 @@ int main(int argc, char **argv) {
         auto now = std::chrono::system_clock::now();
         compression::Writer::Result<compression::State> res;
         do {
-            res = writer->write(compression::Mode::NonBlock);
+            res = writer->write(compression::Budget{.time = std::chrono::microseconds(500)});
             if (!res) {
                 std::cerr << "Failed to write zip file " << static_cast<int>(res.error()) << std::endl;
                 return 1;
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "fingerprint.h"
+#include "index.h"
+#include "types.h"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace compression {
+
+/*!
+ * \brief Metadata and fingerprints of the files of an archive run
+ *
+ * \details A file is considered unchanged as long as its inode, size,
+ *          modification and change time match the record. Not thread-safe.
+ *          The file written by `save()` is laid out as:
+ *
+ *          magic "MNFT", count u64,
+ *          records (name length u16, name, inode u64, size u64, mtime u64, ctime u64, fingerprint 2x u64)...
+ */
+class Manifest {
+public:
+    // Magic starting the manifest file
+    static constexpr uint32_t Magic = 0x54464E4D;
+
+    /*!
+     * \brief Record of a file
+     */
+    struct Record {
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        // Modification and change time in nanoseconds
+        uint64_t mtime = 0;
+        uint64_t ctime = 0;
+        // Fingerprint of the content
+        Fingerprint fingerprint;
+
+        /*!
+         * \brief Record of a file with the given stats and content
+         */
+        static auto of(const struct stat64 &stat, const Fingerprint &fingerprint) -> Record {
+            return Record{uint64_t(stat.st_ino), uint64_t(stat.st_size), nanoseconds(stat.st_mtim),
+                          nanoseconds(stat.st_ctim), fingerprint};
+        }
+
+        /*!
+         * \brief Check whether the file is unchanged since the record
+         */
+        auto matches(const struct stat64 &stat) const -> bool {
+            return inode == uint64_t(stat.st_ino) && size == uint64_t(stat.st_size) &&
+                   mtime == nanoseconds(stat.st_mtim) && ctime == nanoseconds(stat.st_ctim);
+        }
+
+    private:
+        static auto nanoseconds(const struct timespec &time) -> uint64_t {
+            return uint64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+        }
+    };
+
+    /*!
+     * \brief Load the records from a file
+     *
+     * \details A missing file loads an empty manifest.
+     *
+     * \param filename The file written by `save()`
+     *
+     * \return Nothing on success, else error code
+     */
+    auto load(const std::string &filename) -> Result<void> {
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                records.clear();
+                return std::expected<void, Error>();
+            }
+            return std::unexpected(Error::OpenFailed);
+        }
+        std::string data;
+        std::string buffer(64 << 10, '\0');
+        while (true) {
+            auto res = ::read(fd, buffer.data(), buffer.size());
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                ::close(fd);
+                return std::unexpected(Error::ReadFailed);
+            }
+            if (res == 0) {
+                break;
+            }
+            data.append(buffer.data(), res);
+        }
+        ::close(fd);
+
+        if (data.size() < 12 || FrameIndex::get(data.data(), 4) != Magic) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        uint64_t count = FrameIndex::get(data.data() + 4, 8);
+        size_t position = 12;
+        std::unordered_map<std::string, Record> loaded;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (position + 2 > data.size()) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            size_t length = FrameIndex::get(data.data() + position, 2);
+            if (position + 2 + length + RecordSize > data.size()) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            std::string path(data.data() + position + 2, length);
+            auto fields = data.data() + position + 2 + length;
+            Record record;
+            record.inode = FrameIndex::get(fields, 8);
+            record.size = FrameIndex::get(fields + 8, 8);
+            record.mtime = FrameIndex::get(fields + 16, 8);
+            record.ctime = FrameIndex::get(fields + 24, 8);
+            record.fingerprint = Fingerprint{FrameIndex::get(fields + 32, 8), FrameIndex::get(fields + 40, 8)};
+            loaded.insert_or_assign(std::move(path), record);
+            position += 2 + length + RecordSize;
+        }
+        records = std::move(loaded);
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Save the records into a file
+     *
+     * \details Written into a temporary file renamed on success, so a failed
+     *          save keeps the previous file.
+     *
+     * \param filename The file to write
+     *
+     * \return Nothing on success, else error code
+     */
+    auto save(const std::string &filename) const -> Result<void> {
+        std::string data;
+        FrameIndex::put(data, Magic, 4);
+        FrameIndex::put(data, records.size(), 8);
+        for (const auto &[path, record] : records) {
+            FrameIndex::put(data, path.size(), 2);
+            data += path;
+            FrameIndex::put(data, record.inode, 8);
+            FrameIndex::put(data, record.size, 8);
+            FrameIndex::put(data, record.mtime, 8);
+            FrameIndex::put(data, record.ctime, 8);
+            FrameIndex::put(data, record.fingerprint.low, 8);
+            FrameIndex::put(data, record.fingerprint.high, 8);
+        }
+
+        auto temporary = filename + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        for (size_t written = 0; written < data.size();) {
+            auto res = ::write(fd, data.data() + written, data.size() - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                return std::unexpected(Error::WriteFailed);
+            }
+            written += res;
+        }
+        if (::close(fd) < 0 || ::rename(temporary.c_str(), filename.c_str()) < 0) {
+            ::unlink(temporary.c_str());
+            return std::unexpected(Error::WriteFailed);
+        }
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Find the record of a file
+     *
+     * \return The record, null if not contained
+     */
+    auto find(const std::string &path) const -> const Record * {
+        auto it = records.find(path);
+        return (it == records.end()) ? nullptr : &it->second;
+    }
+
+    /*!
+     * \brief Find the record of a file unchanged since
+     *
+     * \param path Path of the file
+     * \param stat Current stats of the file
+     *
+     * \return The record, null if not contained or changed
+     */
+    auto unchanged(const std::string &path, const struct stat64 &stat) const -> const Record * {
+        auto record = find(path);
+        return (record != nullptr && record->matches(stat)) ? record : nullptr;
+    }
+
+    /*!
+     * \brief Add or replace the record of a file
+     */
+    auto add(const std::string &path, const Record &record) -> void { records.insert_or_assign(path, record); }
+
+    /*!
+     * \brief All records by path of the file
+     */
+    auto entries() const -> const std::unordered_map<std::string, Record> & { return records; }
+
+    /*!
+     * \brief Number of records
+     */
+    auto size() const -> size_t { return records.size(); }
+
+private:
+    // Size of the fixed fields of a record in the file
+    static constexpr size_t RecordSize = 48;
+
+    // Records by path of the file
+    std::unordered_map<std::string, Record> records;
+};
+
+} // namespace compression
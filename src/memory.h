@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace compression {
+
+/*!
+ * \brief Memory budget shared by writers
+ *
+ * \details Accounts the input chunks read ahead and the compressed output
+ *          held in flight. Producers acquire the bytes of a buffer before
+ *          filling it and are throttled while the budget is exhausted. A
+ *          producer the consumer waits for forces the acquisition instead, so
+ *          the usage may exceed the limit by a chunk per writer but writers
+ *          never stall each other. Thread-safe.
+ */
+class MemoryBudget {
+public:
+    // Interval at which throttled producers check the budget again
+    static constexpr auto Throttle = std::chrono::milliseconds(5);
+
+    /*!
+     * \brief Constructor
+     *
+     * \param limit Maximum number of bytes in flight
+     */
+    explicit MemoryBudget(uint64_t limit) : maximum(limit) {}
+
+    /*!
+     * \brief Acquire bytes if available
+     *
+     * \return True if acquired, false if the budget is exhausted
+     */
+    auto tryAcquire(uint64_t bytes) -> bool {
+        auto current = usage.load(std::memory_order_relaxed);
+        do {
+            // A single buffer larger than the budget is admitted while idle
+            if (current + bytes > maximum && current > 0) {
+                throttles.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!usage.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+        track(current + bytes);
+        return true;
+    }
+
+    /*!
+     * \brief Acquire bytes beyond the limit
+     */
+    auto force(uint64_t bytes) -> void { track(usage.fetch_add(bytes, std::memory_order_relaxed) + bytes); }
+
+    /*!
+     * \brief Release acquired bytes
+     */
+    auto release(uint64_t bytes) -> void { usage.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    /*!
+     * \brief Bytes acquired currently
+     */
+    auto used() const -> uint64_t { return usage.load(std::memory_order_relaxed); }
+
+    /*!
+     * \brief Maximum of the bytes acquired at a time
+     */
+    auto peak() const -> uint64_t { return highest.load(std::memory_order_relaxed); }
+
+    /*!
+     * \brief Number of acquisitions refused
+     */
+    auto throttled() const -> uint64_t { return throttles.load(std::memory_order_relaxed); }
+
+    /*!
+     * \brief Maximum number of bytes in flight
+     */
+    auto limit() const -> uint64_t { return maximum; }
+
+private:
+    /*!
+     * \brief Update the peak usage
+     */
+    auto track(uint64_t current) -> void {
+        auto previous = highest.load(std::memory_order_relaxed);
+        while (previous < current && !highest.compare_exchange_weak(previous, current, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Maximum number of bytes in flight
+    uint64_t maximum;
+    // Bytes acquired currently
+    std::atomic<uint64_t> usage = 0;
+    // Maximum of the bytes acquired at a time
+    std::atomic<uint64_t> highest = 0;
+    // Number of acquisitions refused
+    std::atomic<uint64_t> throttles = 0;
+};
+
+} // namespace compression
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "sink.h"
+#include "thread_pool.h"
+#include "types.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Transport of a multipart upload
+ *
+ * \details Implemented on top of the client of the object storage, e.g. the
+ *          S3 `CreateMultipartUpload`, `UploadPart`, `CompleteMultipartUpload`
+ *          and `AbortMultipartUpload` requests. `upload()` is invoked
+ *          concurrently from the upload threads, the other methods from the
+ *          thread writing the archive.
+ */
+class MultipartUpload {
+public:
+    using Pointer = std::unique_ptr<MultipartUpload>;
+
+    /*!
+     * \brief Destructor
+     */
+    virtual ~MultipartUpload() = default;
+
+    /*!
+     * \brief Start the upload
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto create() -> Result<void> = 0;
+
+    /*!
+     * \brief Upload a part
+     *
+     * \param number Number of the part starting at 1
+     * \param data   Content of the part, valid during the call
+     *
+     * \return Identifier of the uploaded part, e.g. the ETag, else error code
+     */
+    virtual auto upload(size_t number, std::span<const char> data) -> Result<std::string> = 0;
+
+    /*!
+     * \brief Complete the upload
+     *
+     * \param parts Identifiers of all parts in order
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto complete(const std::vector<std::string> &parts) -> Result<void> = 0;
+
+    /*!
+     * \brief Abort the upload after a failure
+     */
+    virtual auto abort() -> void = 0;
+};
+
+/*!
+ * \brief Sink streaming the archive into a multipart upload
+ *
+ * \details The output is assembled into parts of the configured size, which
+ *          are uploaded concurrently while the archive is written. At most
+ *          `inflight` part buffers exist at a time, `write()` blocks until a
+ *          buffer is free once all are uploading. Failed uploads are aborted
+ *          on close.
+ */
+class MultipartSink : public Sink {
+public:
+    // Minimum size of all but the last part required by S3
+    static constexpr size_t MinimumPartSize = 5 << 20;
+
+    /*!
+     * \brief Options of the sink
+     */
+    struct Options {
+        // Size of the parts
+        size_t partSize = 16 << 20;
+        // Number of threads uploading parts
+        size_t threads = 4;
+        // Maximum number of part buffers, including the one being filled
+        size_t inflight = 6;
+    };
+
+    /*!
+     * \brief Constructor
+     *
+     * \param upload  Transport of the upload
+     * \param options Options of the sink
+     */
+    MultipartSink(MultipartUpload::Pointer upload, Options options)
+        : upload(std::move(upload)), partSize(std::max(options.partSize, MinimumPartSize)),
+          limit(std::max<size_t>(options.inflight, 2)), pool(std::max<size_t>(options.threads, 1)) {}
+
+    /*!
+     * \brief Destructor
+     *
+     * \details Aborts the upload if it isn't complete.
+     */
+    ~MultipartSink() override {
+        wait();
+        if (created && !completed) {
+            upload->abort();
+        }
+    }
+
+    auto open() -> Result<void> override {
+        auto res = upload->create();
+        created = res.has_value();
+        return res;
+    }
+
+    auto write(std::span<const struct iovec> blocks) -> Result<void> override {
+        for (auto &block : blocks) {
+            auto data = static_cast<const char *>(block.iov_base);
+            size_t length = block.iov_len;
+            while (length > 0) {
+                if (!part) {
+                    auto res = acquire();
+                    if (!res) {
+                        return res;
+                    }
+                }
+                auto size = std::min(length, partSize - filled);
+                std::memcpy(part.get() + filled, data, size);
+                filled += size;
+                data += size;
+                length -= size;
+                if (filled == partSize) {
+                    submit();
+                }
+            }
+        }
+        return std::expected<void, Error>();
+    }
+
+    auto close() -> Result<void> override {
+        if (!created || completed) {
+            return std::expected<void, Error>();
+        }
+        // The object consists of at least a single part
+        if (part || parts.empty()) {
+            if (!part) {
+                auto res = acquire();
+                if (!res) {
+                    return res;
+                }
+            }
+            submit();
+        }
+        wait();
+
+        // The upload threads are idle
+        if (error) {
+            return std::unexpected(*error);
+        }
+        auto res = upload->complete(parts);
+        completed = res.has_value();
+        return res;
+    }
+
+private:
+    /*!
+     * \brief Lease the buffer of the next part, waits for a free buffer
+     */
+    auto acquire() -> Result<void> {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() { return error || buffers < limit; });
+        if (error) {
+            return std::unexpected(*error);
+        }
+        ++buffers;
+        lock.unlock();
+        part = BufferPool::shared().lease(partSize);
+        filled = 0;
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Hand the filled part to the upload threads
+     */
+    auto submit() -> void {
+        auto buffer = std::make_shared<BufferPool::Buffer>(std::move(part));
+        size_t length = std::exchange(filled, 0);
+        size_t number;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            parts.emplace_back();
+            number = parts.size();
+        }
+        pool.submit([this, buffer, length, number]() {
+            auto res = upload->upload(number, std::span<const char>(buffer->get(), length));
+            buffer->reset();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (res) {
+                parts[number - 1] = std::move(res.value());
+            } else if (!error) {
+                error = res.error();
+            }
+            --buffers;
+            condition.notify_all();
+        });
+    }
+
+    /*!
+     * \brief Wait for all submitted parts
+     */
+    auto wait() -> void {
+        if (part) {
+            part.reset();
+            std::lock_guard<std::mutex> lock(mutex);
+            --buffers;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() { return buffers == 0; });
+    }
+
+    // Transport of the upload
+    MultipartUpload::Pointer upload;
+    // Size of the parts
+    size_t partSize;
+    // Maximum number of part buffers
+    size_t limit;
+    // Part being filled
+    BufferPool::Buffer part;
+    // Number of bytes in the part being filled
+    size_t filled = 0;
+    // Guards the state shared with the upload threads
+    std::mutex mutex;
+    // Signals finished uploads
+    std::condition_variable condition;
+    // Number of leased part buffers
+    size_t buffers = 0;
+    // Identifiers of the parts in order, empty while uploading
+    std::vector<std::string> parts;
+    // First failure of an upload
+    std::optional<Error> error;
+    // Upload is created, respectively completed
+    bool created = false;
+    bool completed = false;
+    // Threads uploading the parts, destroyed first
+    ThreadPool pool;
+};
+
+} // namespace compression
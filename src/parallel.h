@@ -0,0 +1,1090 @@
+#pragma once
+
+#include "crc.h"
+#include "dedup.h"
+#include "entry.h"
+#include "index.h"
+#include "input.h"
+#include "manifest.h"
+#include "memory.h"
+#include "probe.h"
+#include "progress.h"
+#include "sparse.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "types.h"
+#include "zip.h"
+#include <algorithm>
+#include <archive.h>
+#include <archive_entry.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+#if defined(HAVE_LIBLZ4)
+#include <lz4frame.h>
+#endif
+#if defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+#if defined(HAVE_LIBDEFLATE_H)
+#include <libdeflate.h>
+#endif
+
+namespace compression {
+
+/*!
+ * \brief Parallel compression engine
+ *
+ * \details Each queued file is compressed by one of the worker threads into
+ *          a self-contained byte sequence: a run of independent LZ4 frames of
+ *          the tar stream, or the local header, raw deflate stream and data
+ *          descriptor of a zip entry. The thread calling `drain()` acts as the
+ *          serializer and writes the sequences in queue order into the output
+ *          archive, which only passes the bytes through.
+ */
+class ParallelEngine {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param type      The archive type to produce
+     * \param input     Backend reading the input files
+     * \param threads   Number of worker threads
+     * \param chunkSize Size of the independently compressed chunks
+     * \param codec     Levels and options of the codecs
+     */
+    ParallelEngine(ArchiveType type, InputType input, size_t threads, size_t chunkSize,
+                   const CompressionOptions &codec = {})
+        : type(type), input(input), chunkSize(chunkSize), codec(codec), window(2 * threads), pool(threads) {}
+
+    /*!
+     * \brief Destructor
+     *
+     * \details Running workers stop at the next chunk boundary, workers
+     *          waiting for the claims of preceding entries are released.
+     */
+    ~ParallelEngine() {
+        aborted = true;
+        if (dedup) {
+            dedup->cancel();
+        }
+    }
+
+    /*!
+     * \brief Check whether the maximum number of entries is in flight
+     */
+    auto full() -> bool {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size() >= window;
+    }
+
+    /*!
+     * \brief Check whether all submitted entries are written
+     */
+    auto idle() -> bool {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.empty();
+    }
+
+    /*!
+     * \brief Submit a file for compression
+     *
+     * \param path The file to compress
+     * \param stat Stats of the file, the size is used as the entry size
+     */
+    auto submit(std::string path, const struct stat64 &stat) -> void {
+        auto job = std::make_shared<Job>();
+        job->path = std::move(path);
+        job->stat = stat;
+        job->sequence = submitted++;
+        job->memory = memory;
+        // Reserved in archive order, the workers claim out of order
+        job->reserved = dedup && S_ISREG(stat.st_mode) && stat.st_size > 0;
+        job->verify = job->reserved && dedup->reserve(stat.st_size, job->sequence);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        pool.submit([this, job]() {
+            auto begin = Counters::Clock::now();
+            auto res = (type == ArchiveType::Zip) ? compressZip(*job) : compressTar(*job);
+            if (collector) {
+                auto elapsed = Counters::Clock::now() - begin;
+                job->counters.compressTime = elapsed - job->counters.readTime;
+            }
+            // Entries of the same size don't wait for a failed one
+            if (job->reserved) {
+                dedup->settle(job->stat.st_size, job->sequence);
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!res) {
+                job->error = res.error();
+            }
+            job->done = true;
+            wake(lock);
+        });
+    }
+
+    /*!
+     * \brief Collect statistics of the entries
+     *
+     * \details Has to be set before the first submit. The collector is only
+     *          used by the thread calling `drain()`.
+     *
+     * \param collector The collector to report to
+     */
+    auto collect(StatsCollector *collector) -> void { this->collector = collector; }
+
+    /*!
+     * \brief Publish the progress of the entries
+     *
+     * \details Has to be set before the first submit. The entries progress
+     *          as they're written by `drain()`.
+     *
+     * \param progress The progress to update, null to disable
+     */
+    auto track(Progress *progress) -> void { tracker = progress; }
+
+    /*!
+     * \brief Set the use of the page cache by the workers
+     *
+     * \details Has to be set before the first submit.
+     */
+    auto cache(CacheMode mode) -> void { cacheMode = mode; }
+
+    /*!
+     * \brief Store the names of the owners of the entries
+     *
+     * \details Has to be set before the first submit.
+     *
+     * \param names The cache to look the names up, null to store the identifiers only
+     */
+    auto names(OwnerNames *names) -> void { ownerNames = names; }
+
+    /*!
+     * \brief Append a random-access index to tar.lz4 archives
+     *
+     * \details Has to be set before the first submit. Every entry starts with
+     *          a new frame anyway, `finish()` appends the frame offsets of the
+     *          entries as skippable frame, see `FrameIndex`.
+     */
+    auto index() -> void {
+        if (type == ArchiveType::TarLz4) {
+            frames.emplace();
+        }
+    }
+
+    /*!
+     * \brief Write identical tar entries as hard link to their first entry
+     *
+     * \details Has to be set before the first submit. The workers hash the
+     *          files while compressing them, or fingerprint them before if an
+     *          entry of the same size precedes them.
+     *
+     * \param dedup The detection shared with the writer
+     */
+    auto deduplicate(Dedup *dedup) -> void {
+        if (type != ArchiveType::Zip) {
+            this->dedup = dedup;
+        }
+    }
+
+    /*!
+     * \brief Record the written entries in a manifest
+     *
+     * \details Has to be set before the first submit. The workers hash the
+     *          content while reading it, the manifest is only updated by the
+     *          thread calling `drain()`.
+     *
+     * \param manifest The manifest to add to
+     */
+    auto record(Manifest *manifest) -> void { this->manifest = manifest; }
+
+    /*!
+     * \brief Account the compressed output in flight in a memory budget
+     *
+     * \details Has to be set before the first submit. While the budget is
+     *          exhausted, workers wait before queuing further segments,
+     *          except for the entry the serializer waits for.
+     *
+     * \param memory The budget to acquire from, null to disable
+     */
+    auto budget(MemoryBudget *memory) -> void { this->memory = memory; }
+
+    /*!
+     * \brief Invoke a callback once `drain()` can make progress
+     *
+     * \details The callback is invoked immediately if data is available, else
+     *          by the worker producing it. A later call replaces a pending
+     *          callback.
+     *
+     * \param callback The callback to invoke once
+     */
+    auto notify(std::function<void()> callback) -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!jobs.empty() && jobs.front()->segments.empty() && !jobs.front()->done) {
+            waiter = std::move(callback);
+            return;
+        }
+        lock.unlock();
+        callback();
+    }
+
+    /*!
+     * \brief Write the compressed entries in queue order
+     *
+     * \details Writes everything that is available, limited by the budget.
+     *          In blocking mode, waits for the workers if nothing could be
+     *          written yet.
+     *
+     * \param output The output archive
+     * \param block  Wait for progress if nothing is available
+     * \param budget Limits the bytes written in a single call
+     *
+     * \return Nothing on success, else error code
+     */
+    auto drain(struct archive *output, bool block, const Budget &budget = {}) -> Result<void> {
+        auto start = Budget::Clock::now();
+        uint64_t used = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        bool written = false;
+        while (!jobs.empty() && (!written || budget.allows(start, used))) {
+            auto job = jobs.front();
+            if (!job->started) {
+                job->record.offset = offset;
+                job->started = true;
+                if (collector) {
+                    collector->begin(job->path);
+                }
+                if (tracker) {
+                    tracker->begin(contentSize(*job));
+                }
+            }
+
+            if (job->segments.empty()) {
+                if (job->error) {
+                    return std::unexpected(*job->error);
+                }
+                if (job->done) {
+                    if (type == ArchiveType::Zip) {
+                        directory.add(std::move(job->record));
+                    } else if (frames) {
+                        frames->add(IndexRecord{job->path, job->record.offset, contentSize(*job)});
+                    }
+                    if (collector) {
+                        collector->merge(job->counters);
+                        collector->end();
+                    }
+                    if (tracker) {
+                        // Linked entries aren't read
+                        tracker->advance(contentSize(*job) - job->reported);
+                        tracker->end();
+                        tracker->report();
+                    }
+                    if (manifest) {
+                        auto fingerprint = job->fingerprint.value_or(job->hasher.digest());
+                        manifest->add(job->path, Manifest::Record::of(job->stat, fingerprint));
+                    }
+                    jobs.pop_front();
+                    if (memory) {
+                        // The next entry may be waiting to queue segments
+                        space.notify_all();
+                    }
+                    written = true;
+                    continue;
+                }
+                if (!block || written) {
+                    break;
+                }
+                progress.wait(lock);
+                continue;
+            }
+
+            auto segment = std::move(job->segments.front());
+            job->segments.pop_front();
+            lock.unlock();
+            auto begin = Counters::Clock::now();
+            if (archive_write_data(output, segment.data(), segment.size()) < 0) {
+                return std::unexpected(Error::WriteFailed);
+            }
+            if (collector) {
+                collector->compress(Counters::Clock::now() - begin);
+                collector->step();
+            }
+            if (tracker) {
+                auto consumed = std::min(job->consumed.load(std::memory_order_relaxed), contentSize(*job));
+                tracker->advance(consumed - job->reported);
+                job->reported = consumed;
+                tracker->report();
+            }
+            offset += segment.size();
+            used += segment.size();
+            written = true;
+            lock.lock();
+            if (memory) {
+                memory->release(segment.size());
+                job->charged -= segment.size();
+                space.notify_all();
+            }
+        }
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Write the end of the archive
+     *
+     * \details Requires all submitted entries to be drained.
+     *
+     * \param output The output archive
+     *
+     * \return Nothing on success, else error code
+     */
+    auto finish(struct archive *output) -> Result<void> {
+        std::string trailer;
+        switch (type) {
+#if defined(HAVE_ZLIB_H)
+        case ArchiveType::Zip:
+            trailer = directory.finish(offset);
+            break;
+#endif
+#if defined(HAVE_LIBLZ4)
+        case ArchiveType::TarLz4: {
+            // Two zero blocks terminate the tar stream
+            auto frame = compressFrame(std::string(1024, '\0'));
+            if (!frame) {
+                return std::unexpected(frame.error());
+            }
+            trailer = std::move(frame.value());
+            if (frames) {
+                trailer += frames->encode();
+            }
+            break;
+        }
+#endif
+        default:
+            return std::unexpected(Error::InvalidType);
+        }
+
+        if (archive_write_data(output, trailer.data(), trailer.size()) < 0) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        offset += trailer.size();
+        return std::expected<void, Error>();
+    }
+
+private:
+    /*!
+     * \brief Entry in flight
+     */
+    struct Job {
+        /*!
+         * \brief Destructor
+         *
+         * \details Returns the charge of the segments not written.
+         */
+        ~Job() {
+            if (memory) {
+                memory->release(charged);
+            }
+        }
+
+        std::string path;
+        struct stat64 stat;
+        // Position of the entry in the archive
+        uint64_t sequence = 0;
+        // Compressed output not yet written by the serializer
+        std::deque<std::string> segments;
+        // Zip metadata for the central directory, the offset of the entry is
+        // set for all archive types
+        ZipRecord record;
+        // Set by the serializer once the entry is at the front
+        bool started = false;
+        // Set by the worker once all segments are queued
+        bool done = false;
+        std::optional<Error> error;
+        // Statistics collected by the worker
+        Counters counters;
+        // Content hashed for the manifest and deduplication unless fingerprinted
+        // before
+        Hasher hasher;
+        std::optional<Fingerprint> fingerprint;
+        // Holes of the file, located on open
+        SparseMap sparse;
+        // Reserved for deduplication, fingerprinted before the header if an
+        // entry of the same size precedes it
+        bool reserved = false;
+        bool verify = false;
+        // Bytes read by the worker and published by the serializer if the
+        // progress is tracked
+        std::atomic<uint64_t> consumed = 0;
+        uint64_t reported = 0;
+        // Budget charged with the queued segments, null if unlimited
+        MemoryBudget *memory = nullptr;
+        uint64_t charged = 0;
+    };
+
+    /*!
+     * \brief Sink capturing the output of the tar formatter
+     */
+    struct Capture {
+        std::string data;
+        bool discard = false;
+
+        static auto write(struct archive *, void *userdata, const void *buffer, size_t length) -> la_ssize_t {
+            auto capture = static_cast<Capture *>(userdata);
+            if (!capture->discard) {
+                capture->data.append(static_cast<const char *>(buffer), length);
+            }
+            return length;
+        }
+    };
+
+    /*!
+     * \brief Hand a finished segment over to the serializer
+     *
+     * \details Waits while the memory budget is exhausted, unless the
+     *          serializer has no segment of the entry to write.
+     */
+    auto emit(Job &job, std::string segment) -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (memory) {
+            while (!memory->tryAcquire(segment.size())) {
+                if (aborted || (jobs.front().get() == &job && job.segments.empty())) {
+                    memory->force(segment.size());
+                    break;
+                }
+                space.wait_for(lock, MemoryBudget::Throttle);
+            }
+            job.charged += segment.size();
+        }
+        job.segments.push_back(std::move(segment));
+        wake(lock);
+    }
+
+    /*!
+     * \brief Signal progress to the serializer
+     *
+     * \details Invokes the pending callback after releasing the lock.
+     */
+    auto wake(std::unique_lock<std::mutex> &lock) -> void {
+        progress.notify_all();
+        auto callback = std::exchange(waiter, nullptr);
+        lock.unlock();
+        if (callback) {
+            callback();
+        }
+    }
+
+    /*!
+     * \brief Bytes of the content of an entry, zero unless a regular file
+     */
+    static auto contentSize(const Job &job) -> uint64_t { return S_ISREG(job.stat.st_mode) ? job.stat.st_size : 0; }
+
+    /*!
+     * \brief Open the input file of an entry
+     *
+     * \details The workers read blocking, an asynchronous backend gains
+     *          nothing over the plain reads of the concurrent workers. The
+     *          holes of a sparse file are located for `readChunk()`.
+     */
+    auto openInput(Job &job) -> Result<InputSource::Pointer> {
+        InputSource::Pointer source;
+        if (input == InputType::Mmap) {
+            source = std::make_unique<MmapSource>(chunkSize);
+        } else {
+            source = std::make_unique<PreadSource>(chunkSize);
+        }
+
+        source->cache(cacheMode);
+        auto res = source->open(job.path, job.stat.st_size);
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        job.sparse = SparseMap::of(job.path, job.stat);
+        return source;
+    }
+
+    /*!
+     * \brief Fingerprint the content of an entry before compressing it
+     *
+     * \details Reads the file through its source, which is rewound for the
+     *          compression afterwards.
+     *
+     * \return The fingerprint, error code if the file is truncated
+     */
+    auto fingerprintInput(const Job &job, InputSource &source) -> Result<Fingerprint> {
+        Hasher hasher;
+        for (uint64_t remaining = contentSize(job); remaining > 0;) {
+            if (aborted) {
+                return std::unexpected(Error::WriteFailed);
+            }
+            auto chunk = source.read(Mode::Block);
+            if (!chunk) {
+                return std::unexpected(chunk.error());
+            }
+            if (chunk->value().empty()) {
+                return std::unexpected(Error::FileChanged);
+            }
+            auto length = std::min<uint64_t>(chunk->value().size(), remaining);
+            hasher.update(chunk->value().first(length));
+            remaining -= length;
+        }
+        if (!source.rewind()) {
+            return std::unexpected(Error::ReadFailed);
+        }
+        return hasher.digest();
+    }
+
+    /*!
+     * \brief Compare the content of an entry with the preceding entry it links to
+     *
+     * \details Reads the file through its source up to the first difference,
+     *          the source is rewound for the compression afterwards.
+     *
+     * \return True if equal, error code if the file is truncated
+     */
+    auto compareInput(const Job &job, InputSource &source, ContentCheck &check) -> Result<bool> {
+        bool equal = true;
+        for (uint64_t remaining = contentSize(job); remaining > 0 && equal;) {
+            if (aborted) {
+                return std::unexpected(Error::WriteFailed);
+            }
+            auto chunk = source.read(Mode::Block);
+            if (!chunk) {
+                return std::unexpected(chunk.error());
+            }
+            if (chunk->value().empty()) {
+                return std::unexpected(Error::FileChanged);
+            }
+            auto length = std::min<uint64_t>(chunk->value().size(), remaining);
+            equal = check.compare(chunk->value().first(length));
+            remaining -= length;
+        }
+        if (!source.rewind()) {
+            return std::unexpected(Error::ReadFailed);
+        }
+        return equal;
+    }
+
+    /*!
+     * \brief Read the next chunk of the entry data
+     *
+     * \details Within a hole of a sparse file, the chunk is taken from
+     *          `SparseMap::zeros()` instead of read.
+     *
+     * \return The chunk, error code if the file is truncated
+     */
+    auto readChunk(Job &job, InputSource &source, uint64_t &remaining) -> Result<std::span<const char>> {
+        if (aborted) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        if (remaining == 0) {
+            return std::span<const char>();
+        }
+
+        auto zeros = job.sparse.zerosAt(job.stat.st_size - remaining);
+        if (!zeros.empty() && source.skip(zeros.size())) {
+            if ((manifest || dedup) && !job.fingerprint) {
+                job.hasher.update(zeros);
+            }
+            if (tracker) {
+                job.consumed.fetch_add(zeros.size(), std::memory_order_relaxed);
+            }
+            remaining -= zeros.size();
+            return zeros;
+        }
+
+        auto begin = Counters::Clock::now();
+        auto chunk = source.read(Mode::Block);
+        if (!chunk) {
+            return std::unexpected(chunk.error());
+        }
+        if (chunk->value().empty()) {
+            return std::unexpected(Error::FileChanged);
+        }
+        if (collector) {
+            job.counters.bytesIn += chunk->value().size();
+            job.counters.readTime += Counters::Clock::now() - begin;
+            job.counters.chunks.add(chunk->value().size());
+        }
+        if ((manifest || dedup) && !job.fingerprint) {
+            job.hasher.update(chunk->value());
+        }
+        if (tracker) {
+            job.consumed.fetch_add(chunk->value().size(), std::memory_order_relaxed);
+        }
+        remaining -= chunk->value().size();
+        return chunk->value();
+    }
+
+#if defined(HAVE_LIBLZ4)
+    /*!
+     * \brief Compress data into an independent LZ4 frame
+     */
+    auto compressFrame(const std::string &data) const -> Result<std::string> {
+        LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+        prefs.compressionLevel = codec.lz4Level;
+        prefs.frameInfo.blockSizeID = static_cast<LZ4F_blockSizeID_t>(codec.lz4BlockId());
+        prefs.frameInfo.blockMode = codec.lz4BlockDependence ? LZ4F_blockLinked : LZ4F_blockIndependent;
+        prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        prefs.frameInfo.contentSize = data.size();
+
+        std::string frame(LZ4F_compressFrameBound(data.size(), &prefs), '\0');
+        auto length = LZ4F_compressFrame(frame.data(), frame.size(), data.data(), data.size(), &prefs);
+        if (LZ4F_isError(length)) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        frame.resize(length);
+        return frame;
+    }
+#endif
+
+    /*!
+     * \brief Compress a file into tar records wrapped in LZ4 frames
+     *
+     * \details The tar records are produced by libarchive into memory and
+     *          split into frames of the configured chunk size.
+     */
+    auto compressTar(Job &job) -> Result<void> {
+#if defined(HAVE_LIBLZ4)
+        Capture capture;
+        std::unique_ptr<struct archive, ArchiveDeleter> formatter(archive_write_new());
+        if (formatter == nullptr) {
+            return std::unexpected(Error::InitFailed);
+        }
+        auto res = formatTar(job, formatter.get(), capture);
+
+        // The end of archive marker is written once by the serializer, an
+        // aborted entry is padded by libarchive on free
+        capture.discard = true;
+        return res;
+#else
+        return std::unexpected(Error::InvalidType);
+#endif
+    }
+
+#if defined(HAVE_LIBLZ4)
+    /*!
+     * \brief Write the tar records of a file through the formatter
+     */
+    auto formatTar(Job &job, struct archive *formatter, Capture &capture) -> Result<void> {
+        if (archive_write_set_format_pax(formatter) != ARCHIVE_OK ||
+            archive_write_set_bytes_per_block(formatter, 0) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetFormatFailed);
+        }
+        if (archive_write_open2(formatter, &capture, nullptr, &Capture::write, nullptr, nullptr) != ARCHIVE_OK) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        std::unique_ptr<struct archive_entry, EntryDeleter> header(archive_entry_new());
+        setMetadata(header.get(), job.path, job.stat, ownerNames);
+
+        uint64_t remaining = archive_entry_size(header.get());
+        if (S_ISLNK(job.stat.st_mode)) {
+            auto target = readSymlink(job.path, job.stat);
+            if (!target) {
+                return std::unexpected(target.error());
+            }
+            archive_entry_set_symlink(header.get(), target->c_str());
+            job.fingerprint = Hasher::of(target.value());
+        }
+
+        // Identical content is linked to its first entry once compared equal.
+        // An entry of a size submitted before is fingerprinted first unless
+        // cached, others are hashed while written
+        uint64_t size = remaining;
+        InputSource::Pointer source;
+        if (dedup && remaining > 0) {
+            job.fingerprint = dedup->cached(job.path, job.stat);
+            auto openSource = [&]() -> Result<void> {
+                if (source) {
+                    return std::expected<void, Error>();
+                }
+                auto opened = openInput(job);
+                if (!opened) {
+                    return std::unexpected(opened.error());
+                }
+                source = std::move(opened.value());
+                return std::expected<void, Error>();
+            };
+            if (!job.fingerprint && job.verify) {
+                if (auto opened = openSource(); !opened) {
+                    return opened;
+                }
+                auto fingerprint = fingerprintInput(job, *source);
+                if (!fingerprint) {
+                    return std::unexpected(fingerprint.error());
+                }
+                job.fingerprint = fingerprint.value();
+                dedup->store(job.path, job.stat, fingerprint.value());
+            }
+            if (job.fingerprint) {
+                if (auto target = dedup->claim(*job.fingerprint, remaining, job.sequence, job.path)) {
+                    auto check = ContentCheck::open(*target, remaining);
+                    if (check) {
+                        if (auto opened = openSource(); !opened) {
+                            return opened;
+                        }
+                        auto equal = compareInput(job, *source, check.value());
+                        if (!equal) {
+                            return std::unexpected(equal.error());
+                        }
+                        if (equal.value()) {
+                            setHardlink(header.get(), *target);
+                            remaining = 0;
+                            source.reset();
+                        }
+                    }
+                }
+            }
+        }
+
+        if (remaining > 0 && !source) {
+            auto opened = openInput(job);
+            if (!opened) {
+                return std::unexpected(opened.error());
+            }
+            source = std::move(opened.value());
+        }
+        if (remaining > 0) {
+            setSparse(header.get(), job.sparse);
+        }
+
+        if (archive_write_header(formatter, header.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::WriteFailed);
+        }
+
+        while (remaining > 0) {
+            auto chunk = readChunk(job, *source, remaining);
+            if (!chunk) {
+                return std::unexpected(chunk.error());
+            }
+            if (archive_write_data(formatter, chunk->data(), chunk->size()) < 0) {
+                return std::unexpected(Error::WriteFailed);
+            }
+            if (capture.data.size() >= chunkSize) {
+                auto frame = compressFrame(capture.data);
+                if (!frame) {
+                    return std::unexpected(frame.error());
+                }
+                emit(job, std::move(frame.value()));
+                capture.data.clear();
+            }
+        }
+
+        // Pads the entry to the record size
+        if (archive_write_finish_entry(formatter) != ARCHIVE_OK) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        // Hashed while written, later entries of the size may link to it
+        if (dedup && !job.fingerprint && size > 0) {
+            auto fingerprint = job.hasher.digest();
+            dedup->store(job.path, job.stat, fingerprint);
+            dedup->claim(fingerprint, size, job.sequence, job.path);
+        }
+        if (!capture.data.empty()) {
+            auto frame = compressFrame(capture.data);
+            if (!frame) {
+                return std::unexpected(frame.error());
+            }
+            emit(job, std::move(frame.value()));
+            capture.data.clear();
+        }
+        return std::expected<void, Error>();
+    }
+#endif
+
+    /*!
+     * \brief Compress a file into a zip entry
+     */
+    auto compressZip(Job &job) -> Result<void> {
+#if defined(HAVE_ZLIB_H)
+        std::unique_ptr<struct archive_entry, EntryDeleter> header(archive_entry_new());
+        setMetadata(header.get(), job.path, job.stat, ownerNames);
+
+        auto &record = job.record;
+        record.name = archive_entry_pathname(header.get());
+        record.mode = archive_entry_mode(header.get());
+        record.size = job.stat.st_size;
+        record.zip64 = record.size >= ZipDirectory::Zip64Threshold;
+        ZipDirectory::setTime(record, archive_entry_mtime(header.get()));
+
+        // The target of a symbolic link is stored as the entry data
+        if (S_ISLNK(job.stat.st_mode)) {
+            auto target = readSymlink(job.path, job.stat);
+            if (!target) {
+                return std::unexpected(target.error());
+            }
+            job.fingerprint = Hasher::of(target.value());
+            record.method = 0;
+            record.crc = Crc32::update(0, target.value());
+            record.compressedSize = target->size();
+            emit(job, ZipDirectory::localHeader(record));
+            emit(job, std::move(target.value()));
+            emit(job, ZipDirectory::descriptor(record));
+            return std::expected<void, Error>();
+        }
+
+#if defined(HAVE_LIBDEFLATE_H)
+        if (codec.oneShotSize > 0 && record.size <= codec.oneShotSize) {
+            return compressWhole(job);
+        }
+#endif
+
+        auto source = openInput(job);
+        if (!source) {
+            return std::unexpected(source.error());
+        }
+
+        // The method is decided on the first chunk
+        uint64_t remaining = record.size;
+        auto first = readChunk(job, *source.value(), remaining);
+        if (!first) {
+            return std::unexpected(first.error());
+        }
+        if (codec.storeIncompressible && Probe::incompressible(record.name, first.value())) {
+            record.method = 0;
+        }
+        emit(job, ZipDirectory::localHeader(record));
+
+        uint32_t crc = 0;
+        if (record.method == 0) {
+            auto chunk = first.value();
+            while (true) {
+                crc = Crc32::update(crc, chunk);
+                record.compressedSize += chunk.size();
+                if (!chunk.empty()) {
+                    emit(job, std::string(chunk.data(), chunk.size()));
+                }
+                if (remaining == 0) {
+                    break;
+                }
+                auto next = readChunk(job, *source.value(), remaining);
+                if (!next) {
+                    return std::unexpected(next.error());
+                }
+                chunk = next.value();
+            }
+            record.crc = crc;
+            emit(job, ZipDirectory::descriptor(record));
+            return std::expected<void, Error>();
+        }
+
+        z_stream stream{};
+        if (deflateInit2(&stream, codec.deflateLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+
+        std::string output(chunkSize, '\0');
+        int flush = Z_NO_FLUSH;
+        int res = Z_OK;
+        bool leading = true;
+        bool rle = false;
+
+        // Switch the strategy, the data deflated so far is flushed first
+        auto strategy = [&](int value) -> bool {
+            stream.next_in = nullptr;
+            stream.avail_in = 0;
+            do {
+                stream.next_out = reinterpret_cast<Bytef *>(output.data());
+                stream.avail_out = output.size();
+                res = deflateParams(&stream, codec.deflateLevel, value);
+                auto produced = output.size() - stream.avail_out;
+                if (produced > 0) {
+                    record.compressedSize += produced;
+                    emit(job, output.substr(0, produced));
+                }
+            } while (res == Z_BUF_ERROR);
+            return res == Z_OK;
+        };
+
+        do {
+            auto chunk = leading ? first : readChunk(job, *source.value(), remaining);
+            leading = false;
+            if (!chunk) {
+                deflateEnd(&stream);
+                return std::unexpected(chunk.error());
+            }
+            // The holes of sparse files are run-length encoded
+            bool zeros = chunk->data() == SparseMap::zeros().data();
+            if (zeros != rle && !strategy(zeros ? Z_RLE : Z_DEFAULT_STRATEGY)) {
+                deflateEnd(&stream);
+                return std::unexpected(Error::WriteFailed);
+            }
+            rle = zeros;
+            crc = Crc32::update(crc, chunk.value());
+            flush = (remaining == 0) ? Z_FINISH : Z_NO_FLUSH;
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(chunk->data()));
+            stream.avail_in = chunk->size();
+
+            do {
+                stream.next_out = reinterpret_cast<Bytef *>(output.data());
+                stream.avail_out = output.size();
+                res = deflate(&stream, flush);
+                if (res == Z_STREAM_ERROR) {
+                    deflateEnd(&stream);
+                    return std::unexpected(Error::WriteFailed);
+                }
+                auto produced = output.size() - stream.avail_out;
+                if (produced > 0) {
+                    record.compressedSize += produced;
+                    emit(job, output.substr(0, produced));
+                }
+            } while (stream.avail_out == 0);
+        } while (flush != Z_FINISH);
+        deflateEnd(&stream);
+
+        record.crc = crc;
+        emit(job, ZipDirectory::descriptor(record));
+        return std::expected<void, Error>();
+#else
+        return std::unexpected(Error::InvalidType);
+#endif
+    }
+
+#if defined(HAVE_LIBDEFLATE_H)
+    struct CompressorDeleter {
+        auto operator()(struct libdeflate_compressor *compressor) -> void { libdeflate_free_compressor(compressor); }
+    };
+
+    /*!
+     * \brief Compressor of libdeflate of the calling worker thread
+     */
+    auto compressor() const -> struct libdeflate_compressor * {
+        thread_local std::unique_ptr<struct libdeflate_compressor, CompressorDeleter> cached;
+        thread_local int cachedLevel = -1;
+        // libdeflate levels range from 0 to 12, the zlib default is 6
+        int level = (codec.deflateLevel < 0) ? 6 : codec.deflateLevel;
+        if (!cached || cachedLevel != level) {
+            cached.reset(libdeflate_alloc_compressor(level));
+            cachedLevel = level;
+        }
+        return cached.get();
+    }
+
+    /*!
+     * \brief Compress a zip entry in one shot with libdeflate
+     *
+     * \details The file is mapped, or read with the chunk size of the whole
+     *          file, and compressed by a single call into a leased buffer.
+     *          The record is expected to be filled except the method, sizes
+     *          and CRC.
+     */
+    auto compressWhole(Job &job) -> Result<void> {
+        auto &record = job.record;
+        InputSource::Pointer source;
+        if (input == InputType::Mmap) {
+            source = std::make_unique<MmapSource>(std::max<uint64_t>(record.size, 1));
+        } else {
+            source = std::make_unique<PreadSource>(std::max<uint64_t>(record.size, 1));
+        }
+        source->cache(cacheMode);
+        auto opened = source->open(job.path, record.size);
+        if (!opened) {
+            return std::unexpected(opened.error());
+        }
+
+        uint64_t remaining = record.size;
+        auto data = readChunk(job, *source, remaining);
+        if (!data) {
+            return std::unexpected(data.error());
+        }
+        // Short reads are collected into a single buffer
+        std::span<const char> content = data.value();
+        std::string collected;
+        if (remaining > 0) {
+            collected.assign(content.data(), content.size());
+            while (remaining > 0) {
+                auto next = readChunk(job, *source, remaining);
+                if (!next) {
+                    return std::unexpected(next.error());
+                }
+                collected.append(next->data(), next->size());
+            }
+            content = collected;
+        }
+        record.crc = Crc32::update(0, content);
+
+        std::string compressed;
+        if (codec.storeIncompressible && Probe::incompressible(record.name, content)) {
+            record.method = 0;
+            compressed.assign(content.data(), content.size());
+        } else {
+            auto deflater = compressor();
+            if (deflater == nullptr) {
+                return std::unexpected(Error::SetCompressionFailed);
+            }
+            compressed.resize(libdeflate_deflate_compress_bound(deflater, content.size()));
+            auto length = libdeflate_deflate_compress(deflater, content.data(), content.size(), compressed.data(),
+                                                      compressed.size());
+            if (length == 0) {
+                return std::unexpected(Error::WriteFailed);
+            }
+            compressed.resize(length);
+        }
+        record.compressedSize = compressed.size();
+
+        emit(job, ZipDirectory::localHeader(record));
+        emit(job, std::move(compressed));
+        emit(job, ZipDirectory::descriptor(record));
+        return std::expected<void, Error>();
+    }
+#endif
+
+    // Produced archive type
+    ArchiveType type;
+    // Backend reading the input files
+    InputType input;
+    // Size of the independently compressed chunks
+    size_t chunkSize;
+    // Levels and options of the codecs
+    CompressionOptions codec;
+    // Use of the page cache by the workers
+    CacheMode cacheMode = CacheMode::Keep;
+    // Maximum number of entries in flight
+    size_t window;
+    // Guards the jobs and their segments
+    std::mutex mutex;
+    // Signals new segments or finished jobs to the serializer
+    std::condition_variable progress;
+    // Signals written segments to the workers waiting for the budget
+    std::condition_variable space;
+    // Callback waiting for progress
+    std::function<void()> waiter;
+    // Collector of the statistics, null if not collected
+    StatsCollector *collector = nullptr;
+    // Progress of the entries, null if not tracked
+    Progress *tracker = nullptr;
+    // Entries in flight in queue order
+    std::deque<std::shared_ptr<Job>> jobs;
+    // Set on destruction to stop the workers early
+    std::atomic<bool> aborted = false;
+    // Central directory of the zip archive
+    ZipDirectory directory;
+    // Random-access index of the tar.lz4 archive, empty if disabled
+    std::optional<FrameIndex> frames;
+    // Detection of identical entries, null if disabled
+    Dedup *dedup = nullptr;
+    // Names of the owners of the entries, null if not stored
+    OwnerNames *ownerNames = nullptr;
+    // Manifest of the written entries, null if disabled
+    Manifest *manifest = nullptr;
+    // Budget charged with the queued segments, null if unlimited
+    MemoryBudget *memory = nullptr;
+    // Number of submitted entries
+    uint64_t submitted = 0;
+    // Number of bytes written into the output archive
+    uint64_t offset = 0;
+    // Worker threads, destroyed first to join them before the jobs
+    ThreadPool pool;
+};
+
+} // namespace compression
@@ -0,0 +1,461 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "input.h"
+#include "types.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Input source reading on a dedicated reader thread
+ *
+ * \details The reader thread fills a bounded ring of chunk buffers with
+ *          `pread` while the compression consumes the filled ones, so read
+ *          I/O and compression overlap even within a single file. The reader
+ *          continues with the announced files once the opened file is read
+ *          completely. In non-blocking mode, `read()` returns without data
+ *          instead of waiting for the reader. With a memory budget, the reader
+ *          is throttled while the budget is exhausted, unless the consumer has
+ *          no filled chunk to continue with.
+ */
+class PipelineSource : public InputSource {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param chunkSize Size of the chunks to read
+     * \param depth     Number of chunk buffers in the ring
+     */
+    PipelineSource(size_t chunkSize, size_t depth) : chunkSize(chunkSize), free(std::max<size_t>(depth, 2)) {
+        reader = std::thread([this]() { run(); });
+    }
+
+    /*!
+     * \brief Destructor
+     */
+    ~PipelineSource() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        reader.join();
+        // Chunks still held return their charge
+        release();
+        for (auto &chunk : ready) {
+            recycle(std::move(chunk));
+        }
+    }
+
+    auto prefetch(const std::string &path, uint64_t size) -> void override {
+        std::lock_guard<std::mutex> lock(mutex);
+        plans.push_back(Plan{nextId, path, size});
+        announced.push_back(Plan{nextId, path, size});
+        ++nextId;
+        condition.notify_all();
+    }
+
+    auto open(const std::string &path, uint64_t size) -> Result<void> override {
+        close();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        // Skip announced files that aren't opened
+        while (!announced.empty() && announced.front().path != path) {
+            announced.pop_front();
+        }
+        if (announced.empty()) {
+            plans.push_back(Plan{nextId, path, size});
+            current = nextId++;
+        } else {
+            current = announced.front().id;
+            announced.pop_front();
+        }
+
+        // Stop reading the skipped files
+        skipBelow = current;
+        for (auto &plan : plans) {
+            if (plan.id == current) {
+                plan.size = size;
+            }
+        }
+
+        openedPath = path;
+        length = size;
+        consumed = 0;
+        opened = true;
+        condition.notify_all();
+        return std::expected<void, Error>();
+    }
+
+    auto is_open() const -> bool override { return opened; }
+
+    auto read(Mode mode) -> Result<std::optional<std::span<const char>>> override {
+        std::unique_lock<std::mutex> lock(mutex);
+        release();
+        if (consumed >= length) {
+            return std::span<const char>();
+        }
+
+        while (true) {
+            discard();
+            if (!ready.empty() && ready.front().file == current) {
+                break;
+            }
+            if (!ready.empty() || completed >= current) {
+                // The reader finished the file short of the expected size
+                length = consumed;
+                return std::span<const char>();
+            }
+            if (mode == Mode::NonBlock) {
+                return std::nullopt;
+            }
+            condition.wait(lock);
+        }
+
+        auto chunk = std::move(ready.front());
+        ready.pop_front();
+        if (chunk.error) {
+            auto error = *chunk.error;
+            recycle(std::move(chunk));
+            condition.notify_all();
+            return std::unexpected(error);
+        }
+        if (chunk.length == 0) {
+            // Less data available than queued
+            recycle(std::move(chunk));
+            condition.notify_all();
+            length = consumed;
+            return std::span<const char>();
+        }
+
+        auto size = std::min<uint64_t>(chunk.length, length - consumed);
+        consumed += size;
+        lent = std::move(chunk);
+        return std::span<const char>(lent->data.get(), size);
+    }
+
+    /*!
+     * \brief Read the opened file again from its beginning
+     *
+     * \details The file is announced again ahead of the announced files,
+     *          which are read again as well.
+     */
+    auto rewind() -> bool override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!opened) {
+            return false;
+        }
+        release();
+        auto following = std::exchange(announced, {});
+        current = nextId++;
+        plans.push_back(Plan{current, openedPath, length});
+        for (auto &plan : following) {
+            plan.id = nextId++;
+            plans.push_back(plan);
+            announced.push_back(plan);
+        }
+        // Stop reading the previous announcements
+        skipBelow = current;
+        consumed = 0;
+        discard();
+        condition.notify_all();
+        return true;
+    }
+
+    auto notify(std::function<void()> callback) -> void override {
+        std::unique_lock<std::mutex> lock(mutex);
+        discard();
+        if (opened && consumed < length && ready.empty() && completed < current) {
+            waiter = std::move(callback);
+            return;
+        }
+        lock.unlock();
+        callback();
+    }
+
+    auto resize(size_t chunkSize) -> void override {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->chunkSize = alignChunk(chunkSize, cacheMode);
+    }
+
+    auto cache(CacheMode mode) -> void override {
+        std::lock_guard<std::mutex> lock(mutex);
+        cacheMode = mode;
+        chunkSize = alignChunk(chunkSize, cacheMode);
+    }
+
+    auto budget(MemoryBudget *memory) -> void override {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->memory = memory;
+    }
+
+    auto close() -> void override {
+        std::lock_guard<std::mutex> lock(mutex);
+        release();
+        if (opened) {
+            opened = false;
+            skipBelow = current + 1;
+            discard();
+            condition.notify_all();
+        }
+    }
+
+    auto clear() -> void override {
+        close();
+        std::lock_guard<std::mutex> lock(mutex);
+        announced.clear();
+        waiter = nullptr;
+        skipBelow = nextId;
+        discard();
+        condition.notify_all();
+    }
+
+private:
+    /*!
+     * \brief File to read
+     */
+    struct Plan {
+        uint64_t id;
+        std::string path;
+        uint64_t size;
+    };
+
+    /*!
+     * \brief Buffer of the ring
+     */
+    struct Chunk {
+        BufferPool::Buffer data;
+        size_t length = 0;
+        // Identifier of the file the chunk belongs to
+        uint64_t file = 0;
+        std::optional<Error> error;
+        // Bytes acquired from the memory budget
+        uint64_t charged = 0;
+    };
+
+    /*!
+     * \brief Return the chunk handed out last to the reader
+     *
+     * \details Requires the lock to be held.
+     */
+    auto release() -> void {
+        if (lent) {
+            recycle(std::move(*lent));
+            lent.reset();
+            condition.notify_all();
+        }
+    }
+
+    /*!
+     * \brief Return the filled chunks of skipped files to the reader
+     *
+     * \details Requires the lock to be held.
+     */
+    auto discard() -> void {
+        while (!ready.empty() && ready.front().file < skipBelow && !(opened && ready.front().file == current)) {
+            recycle(std::move(ready.front()));
+            ready.pop_front();
+            condition.notify_all();
+        }
+    }
+
+    /*!
+     * \brief Return a chunk to the reader and its charge to the budget
+     *
+     * \details Requires the lock to be held.
+     */
+    auto recycle(Chunk &&chunk) -> void {
+        if (chunk.charged > 0) {
+            memory->release(std::exchange(chunk.charged, 0));
+        }
+        free.push_back(std::move(chunk));
+    }
+
+    /*!
+     * \brief Charge a chunk to the memory budget
+     *
+     * \details Requires the lock to be held. Waits while the budget is
+     *          exhausted, unless the consumer has no filled chunk left.
+     *
+     * \param chunk The chunk to fill
+     * \param size  Number of bytes to read into the chunk
+     * \param file  Identifier of the file to read
+     *
+     * \return False if the file is skipped or the reader stops meanwhile
+     */
+    auto acquire(Chunk &chunk, uint64_t size, uint64_t file, std::unique_lock<std::mutex> &lock) -> bool {
+        while (!memory->tryAcquire(size)) {
+            if (ready.empty()) {
+                memory->force(size);
+                break;
+            }
+            condition.wait_for(lock, MemoryBudget::Throttle);
+            if (stopping || file < skipBelow) {
+                return false;
+            }
+        }
+        chunk.charged = size;
+        return true;
+    }
+
+    /*!
+     * \brief Signal new data to the consumer
+     *
+     * \details Invokes the pending callback without holding the lock.
+     */
+    auto wake(std::unique_lock<std::mutex> &lock) -> void {
+        condition.notify_all();
+        if (waiter) {
+            auto callback = std::exchange(waiter, nullptr);
+            lock.unlock();
+            callback();
+            lock.lock();
+        }
+    }
+
+    /*!
+     * \brief Main loop of the reader thread
+     */
+    auto run() -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            while (!plans.empty() && plans.front().id < skipBelow) {
+                plans.pop_front();
+            }
+            if (stopping) {
+                return;
+            }
+            if (plans.empty()) {
+                condition.wait(lock);
+                continue;
+            }
+
+            auto plan = plans.front();
+            auto mode = cacheMode;
+            lock.unlock();
+            bool direct = false;
+            int fd = openInputFile(plan.path, mode, direct);
+            lock.lock();
+
+            uint64_t offset = 0;
+            bool end = plan.size == 0;
+            while (!end) {
+                condition.wait(lock, [&]() { return stopping || plan.id < skipBelow || !free.empty(); });
+                if (stopping || plan.id < skipBelow) {
+                    break;
+                }
+
+                auto chunk = std::move(free.back());
+                free.pop_back();
+                // The size may have been updated on open
+                for (auto &entry : plans) {
+                    if (entry.id == plan.id) {
+                        plan.size = entry.size;
+                    }
+                }
+                auto size = std::min<uint64_t>(chunkSize, plan.size - offset);
+                if (memory && !acquire(chunk, size, plan.id, lock)) {
+                    free.push_back(std::move(chunk));
+                    break;
+                }
+                if (chunk.data.size() < size) {
+                    chunk.data = BufferPool::shared().lease(std::max(size, chunkSize));
+                }
+                lock.unlock();
+
+                ssize_t res = -1;
+                if (fd >= 0) {
+                    res = readInputFile(fd, chunk.data.get(), size, offset, mode, direct);
+                }
+
+                chunk.file = plan.id;
+                chunk.length = std::max<ssize_t>(res, 0);
+                chunk.error.reset();
+                if (fd < 0) {
+                    chunk.error = Error::OpenFailed;
+                } else if (res < 0) {
+                    chunk.error = Error::ReadFailed;
+                }
+                offset += chunk.length;
+                end = res <= 0 || offset >= plan.size;
+
+                lock.lock();
+                if (plan.id < skipBelow && !(opened && plan.id == current)) {
+                    recycle(std::move(chunk));
+                    break;
+                }
+                ready.push_back(std::move(chunk));
+                wake(lock);
+            }
+
+            if (fd >= 0) {
+                lock.unlock();
+                ::close(fd);
+                lock.lock();
+            }
+            if (!plans.empty() && plans.front().id == plan.id) {
+                plans.pop_front();
+            }
+            completed = plan.id;
+            wake(lock);
+        }
+    }
+
+    // Guards the state shared with the reader thread
+    std::mutex mutex;
+    // Signals free chunks, filled chunks and new files
+    std::condition_variable condition;
+    // Size of the chunks to read
+    size_t chunkSize;
+    // Use of the page cache
+    CacheMode cacheMode = CacheMode::Keep;
+    // Chunks available to the reader
+    std::vector<Chunk> free;
+    // Filled chunks in file order
+    std::deque<Chunk> ready;
+    // Chunk handed out by the last read
+    std::optional<Chunk> lent;
+    // Files to read by the reader thread
+    std::deque<Plan> plans;
+    // Announced files not yet opened
+    std::deque<Plan> announced;
+    // Callback waiting for data
+    std::function<void()> waiter;
+    // Budget charged with the filled chunks, null if unlimited
+    MemoryBudget *memory = nullptr;
+    // Identifier of the next file
+    uint64_t nextId = 1;
+    // Identifier and path of the opened file
+    uint64_t current = 0;
+    std::string openedPath;
+    // Files with lower identifiers are skipped, except the opened one
+    uint64_t skipBelow = 0;
+    // Identifier of the file read last by the reader
+    uint64_t completed = 0;
+    // Size and consumed bytes of the opened file
+    uint64_t length = 0;
+    uint64_t consumed = 0;
+    // Set if a file is opened
+    bool opened = false;
+    // Set on destruction to terminate the reader
+    bool stopping = false;
+    // Thread reading the chunks
+    std::thread reader;
+};
+
+} // namespace compression
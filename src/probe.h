@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+namespace compression {
+
+/*!
+ * \brief Probe whether data is worth compressing
+ *
+ * \details Data is considered incompressible if the file extension or the
+ *          leading magic bytes name an already compressed format, else if the
+ *          byte entropy of the sample exceeds `Threshold` bits per byte.
+ */
+class Probe {
+public:
+    // Entropy in bits per byte from which data is considered incompressible
+    static constexpr double Threshold = 7.5;
+    // Number of leading bytes used to estimate the entropy
+    static constexpr size_t SampleSize = 16 << 10;
+
+    /*!
+     * \brief Check whether data is incompressible
+     *
+     * \param path   Pathname of the file
+     * \param sample Leading data of the file
+     */
+    static auto incompressible(std::string_view path, std::span<const char> sample) -> bool {
+        return compressedExtension(path) || compressedMagic(sample) ||
+               entropy(sample.first(std::min(sample.size(), SampleSize))) > Threshold;
+    }
+
+    /*!
+     * \brief Shannon entropy of the data in bits per byte
+     */
+    static auto entropy(std::span<const char> data) -> double {
+        if (data.empty()) {
+            return 0;
+        }
+        std::array<uint32_t, 256> counts{};
+        for (auto c : data) {
+            ++counts[static_cast<unsigned char>(c)];
+        }
+        double sum = 0;
+        for (auto count : counts) {
+            if (count > 0) {
+                double p = double(count) / data.size();
+                sum -= p * std::log2(p);
+            }
+        }
+        return sum;
+    }
+
+private:
+    static auto compressedExtension(std::string_view path) -> bool {
+        static constexpr std::string_view extensions[] = {
+            "7z",  "apk", "avi", "avif", "br",  "bz2", "docx", "flac", "gif", "gz",  "heic", "jar", "jpeg", "jpg",
+            "lz4", "lzma", "m4a", "mkv", "mov", "mp3", "mp4",  "ogg",  "png", "rar", "tgz",  "webm", "webp", "xlsx",
+            "xz",  "zip", "zst"};
+        auto dot = path.rfind('.');
+        if (dot == std::string_view::npos || path.size() - dot - 1 > 4 || path.find('/', dot) != path.npos) {
+            return false;
+        }
+        char lower[4];
+        auto extension = path.substr(dot + 1);
+        for (size_t i = 0; i < extension.size(); ++i) {
+            lower[i] = (extension[i] >= 'A' && extension[i] <= 'Z') ? extension[i] - 'A' + 'a' : extension[i];
+        }
+        return std::find(std::begin(extensions), std::end(extensions), std::string_view(lower, extension.size())) !=
+               std::end(extensions);
+    }
+
+    static auto compressedMagic(std::span<const char> data) -> bool {
+        struct Magic {
+            size_t offset;
+            std::string_view bytes;
+        };
+        static constexpr Magic magics[] = {
+            {0, "\xFF\xD8\xFF"},               // JPEG
+            {0, "\x89PNG"},                    // PNG
+            {0, "GIF8"},                       // GIF
+            {0, "\x1F\x8B"},                   // gzip
+            {0, "PK\x03\x04"},                 // zip and derived formats
+            {0, "BZh"},                        // bzip2
+            {0, "\xFD" "7zXZ"},                // xz
+            {0, "\x28\xB5\x2F\xFD"},           // zstd
+            {0, "\x04\x22\x4D\x18"},           // LZ4
+            {0, "7z\xBC\xAF\x27\x1C"},         // 7z
+            {0, "Rar!"},                       // rar
+            {0, "OggS"},                       // Ogg
+            {0, "fLaC"},                       // FLAC
+            {0, "\x1A\x45\xDF\xA3"},           // Matroska and WebM
+            {4, "ftyp"},                       // MP4, MOV and HEIF
+        };
+        for (auto &magic : magics) {
+            if (data.size() >= magic.offset + magic.bytes.size() &&
+                std::memcmp(data.data() + magic.offset, magic.bytes.data(), magic.bytes.size()) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+} // namespace compression
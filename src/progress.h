@@ -0,0 +1,183 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+namespace compression {
+
+/*!
+ * \brief Progress of writers readable from other threads
+ *
+ * \details The writers publish the queued and written bytes and files with
+ *          relaxed atomics, without locks, so a monitor may poll
+ *          `snapshot()` of many writers at any rate. Alternatively, a
+ *          callback is invoked by the writer at most once per interval. A
+ *          progress shared by several writers sums their totals, the entry
+ *          is the one started last.
+ *
+ *          Bytes count the content of regular files. In parallel mode, an
+ *          entry progresses as its compressed data is written, the bytes of
+ *          the workers ahead are counted once their entry is written.
+ */
+class Progress {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /*!
+     * \brief Progress at a point in time
+     */
+    struct Snapshot {
+        // Queued files and the bytes of their content
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        // Written files and bytes of the queued ones
+        uint64_t filesDone = 0;
+        uint64_t bytesDone = 0;
+        // Size and written bytes of the current entry
+        uint64_t entryBytes = 0;
+        uint64_t entryDone = 0;
+        // Time since the first entry started
+        Clock::duration elapsed = Clock::duration::zero();
+
+        /*!
+         * \brief Average bytes written per second
+         */
+        auto throughput() const -> double {
+            auto seconds = std::chrono::duration<double>(elapsed).count();
+            return (seconds > 0) ? bytesDone / seconds : 0;
+        }
+
+        /*!
+         * \brief Estimated time until the queued bytes are written
+         *
+         * \return The estimate at the average throughput, no value before
+         *         the first bytes are written
+         */
+        auto eta() const -> std::optional<Clock::duration> {
+            auto rate = throughput();
+            if (rate <= 0) {
+                return std::nullopt;
+            }
+            auto remaining = (bytes > bytesDone) ? bytes - bytesDone : 0;
+            return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(remaining / rate));
+        }
+    };
+
+    using Callback = std::function<void(const Snapshot &)>;
+
+    /*!
+     * \brief Constructor of a progress polled with `snapshot()`
+     */
+    Progress() = default;
+
+    /*!
+     * \brief Constructor of a progress reported by callback
+     *
+     * \param callback Invoked on a writing thread at most once per interval
+     *                 and once the archive is written
+     * \param interval Minimum time between two invocations
+     */
+    explicit Progress(Callback callback, Clock::duration interval = std::chrono::milliseconds(100))
+        : callback(std::move(callback)), interval(interval) {}
+
+    Progress(const Progress &) = delete;
+    Progress &operator=(const Progress &) = delete;
+
+    /*!
+     * \brief The current progress
+     */
+    auto snapshot() const -> Snapshot {
+        Snapshot res;
+        res.files = files.load(std::memory_order_relaxed);
+        res.bytes = bytes.load(std::memory_order_relaxed);
+        res.filesDone = filesDone.load(std::memory_order_relaxed);
+        res.bytesDone = bytesDone.load(std::memory_order_relaxed);
+        res.entryBytes = entryBytes.load(std::memory_order_relaxed);
+        res.entryDone = entryDone.load(std::memory_order_relaxed);
+        auto since = started.load(std::memory_order_relaxed);
+        if (since != 0) {
+            res.elapsed = Clock::now() - Clock::time_point(Clock::duration(since));
+        }
+        return res;
+    }
+
+    /*!
+     * \brief Count a queued file
+     *
+     * \param size Bytes of its content
+     */
+    auto queue(uint64_t size) -> void {
+        files.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    /*!
+     * \brief Start an entry
+     *
+     * \param size Bytes of its content
+     */
+    auto begin(uint64_t size) -> void {
+        Clock::rep none = 0;
+        if (started.load(std::memory_order_relaxed) == 0) {
+            started.compare_exchange_strong(none, Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+        entryBytes.store(size, std::memory_order_relaxed);
+        entryDone.store(0, std::memory_order_relaxed);
+    }
+
+    /*!
+     * \brief Count bytes written of the current entry
+     */
+    auto advance(uint64_t bytes) -> void {
+        bytesDone.fetch_add(bytes, std::memory_order_relaxed);
+        entryDone.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /*!
+     * \brief Count the current entry as written
+     */
+    auto end() -> void { filesDone.fetch_add(1, std::memory_order_relaxed); }
+
+    /*!
+     * \brief Invoke the callback if the interval elapsed
+     *
+     * \details Called by the writers after their steps. Concurrent calls
+     *          invoke the callback once.
+     *
+     * \param force Invoke regardless of the interval
+     */
+    auto report(bool force = false) -> void {
+        if (!callback) {
+            return;
+        }
+        auto now = Clock::now().time_since_epoch().count();
+        auto due = next.load(std::memory_order_relaxed);
+        if (!force && now < due) {
+            return;
+        }
+        if (!next.compare_exchange_strong(due, now + interval.count(), std::memory_order_relaxed)) {
+            return;
+        }
+        callback(snapshot());
+    }
+
+private:
+    // Invoked at most once per interval
+    Callback callback;
+    Clock::duration interval = Clock::duration::zero();
+    // Earliest time of the next invocation
+    std::atomic<Clock::rep> next = 0;
+    // Start of the first entry, zero before
+    std::atomic<Clock::rep> started = 0;
+    std::atomic<uint64_t> files = 0;
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> filesDone = 0;
+    std::atomic<uint64_t> bytesDone = 0;
+    std::atomic<uint64_t> entryBytes = 0;
+    std::atomic<uint64_t> entryDone = 0;
+};
+
+} // namespace compression
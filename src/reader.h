@@ -0,0 +1,614 @@
+#pragma once
+
+#include "crc.h"
+#include "thread_pool.h"
+#include "types.h"
+#include "zip.h"
+#include <algorithm>
+#include <archive.h>
+#include <archive_entry.h>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#if defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+namespace compression {
+
+/*!
+ * \brief Reader of an archive file
+ *
+ * \details The reader counterpart of the writer. The archive type is
+ *          detected from the content. Entries are either consumed
+ *          directly, block by block without a copy, or extracted into a
+ *          destination directory. Zip archives opened by filename may be
+ *          extracted in parallel: the entries are located by the central
+ *          directory and decompressed independently by worker threads.
+ */
+class Reader {
+public:
+    template <typename T>
+    using Result = compression::Result<T>;
+    using Pointer = std::unique_ptr<Reader>;
+
+    /*!
+     * \brief Options of the reader
+     */
+    struct Options {
+        // Directory to extract the entries into
+        std::string destination = ".";
+        // Number of worker threads extracting zip entries, zero extracts on
+        // the calling thread
+        size_t threads = 0;
+        // Size of the blocks read from the archive
+        size_t blockSize = 1 << 20;
+    };
+
+    /*!
+     * \brief Header of an entry
+     */
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        mode_t mode;
+        time_t mtime;
+    };
+
+    /*!
+     * \brief Block of entry data
+     *
+     * \details Points into the buffers of libarchive and stays valid until the
+     *          next call of the reader.
+     */
+    struct Block {
+        std::span<const char> data;
+        // Offset of the block in the entry
+        int64_t offset;
+    };
+
+    /*!
+     * \brief Destructor of the reader
+     */
+    ~Reader() { close(); }
+
+    /*!
+     * \brief Open an archive to read from
+     *
+     * \details Extracts into the current directory on the calling thread.
+     *
+     * \param filename Filename of the archive
+     *
+     * \return Result container either a reference to the reader or an error code
+     */
+    static auto open(const std::string &filename) -> Result<Pointer> { return open(filename, Options()); }
+
+    /*!
+     * \brief Open an archive to read from
+     *
+     * \param filename Filename of the archive
+     * \param options  Options of the reader
+     *
+     * \return Result container either a reference to the reader or an error code
+     */
+    static auto open(const std::string &filename, Options options) -> Result<Pointer> {
+        auto reader = std::unique_ptr<Reader>(new Reader(std::move(options)));
+
+        // Zip archives are extracted in parallel if requested
+        if (reader->options.threads > 0) {
+            int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return std::unexpected(Error::OpenFailed);
+            }
+            auto records = ZipDirectory::read(fd);
+            if (records) {
+                reader->fd = fd;
+                reader->records = std::move(records.value());
+                reader->pool = std::make_unique<ThreadPool>(reader->options.threads);
+                return reader;
+            }
+            ::close(fd);
+        }
+
+        auto res = reader->open();
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        if (archive_read_open_filename(reader->archive.get(), filename.c_str(), reader->options.blockSize) !=
+            ARCHIVE_OK) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        return reader;
+    }
+
+    /*!
+     * \brief Open an archive using custom callbacks
+     *
+     * \param open     Custom callback to open the input
+     * \param read     Custom callback to read from the input
+     * \param close    Custom callback to close the input
+     * \param userdata Userdata passed to all callbacks
+     * \param options  Options of the reader, the archive is read sequentially
+     *
+     * \return Result container either a reference to the reader or an error code
+     */
+    static auto open(archive_open_callback open, archive_read_callback read, archive_close_callback close,
+                     void *userdata, Options options) -> Result<Pointer> {
+        auto reader = std::unique_ptr<Reader>(new Reader(std::move(options)));
+        auto res = reader->open();
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        if (archive_read_open(reader->archive.get(), userdata, open, read, close) != ARCHIVE_OK) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        return reader;
+    }
+
+    /*!
+     * \brief Advance to the next entry
+     *
+     * \details Skips the remaining data of the current entry. Not available
+     *          for archives extracted in parallel.
+     *
+     * \return The header of the entry, no value at the end of the archive, else error code
+     */
+    auto next() -> Result<std::optional<Entry>> {
+        if (!archive) {
+            return std::unexpected(Error::InvalidType);
+        }
+
+        struct archive_entry *header;
+        auto res = archive_read_next_header(archive.get(), &header);
+        if (res == ARCHIVE_EOF) {
+            return std::nullopt;
+        }
+        if (res < ARCHIVE_WARN) {
+            return std::unexpected(Error::ReadFailed);
+        }
+
+        // Headers may lack a pathname, e.g. of a corrupted archive
+        auto path = archive_entry_pathname(header);
+        if (path == nullptr) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+
+        current = header;
+        return Entry{path, static_cast<uint64_t>(archive_entry_size(header)), archive_entry_mode(header),
+                     archive_entry_mtime(header)};
+    }
+
+    /*!
+     * \brief Read the next block of the current entry
+     *
+     * \return The block on success, empty at the end of the entry, else error code
+     */
+    auto read() -> Result<Block> {
+        if (!archive || current == nullptr) {
+            return std::unexpected(Error::InvalidType);
+        }
+
+        const void *buffer;
+        size_t size;
+        la_int64_t offset;
+        auto res = archive_read_data_block(archive.get(), &buffer, &size, &offset);
+        if (res == ARCHIVE_EOF) {
+            return Block{{}, offset};
+        }
+        if (res < ARCHIVE_WARN) {
+            return std::unexpected(Error::ReadFailed);
+        }
+        return Block{std::span<const char>(static_cast<const char *>(buffer), size), offset};
+    }
+
+    /*!
+     * \brief Extract the entries into the destination directory
+     *
+     * \details Based on the provided mode either everything is extracted or
+     *          only a single step is performed. Paths leaving the destination
+     *          are rejected.
+     *
+     * \param mode Mode of operation
+     *
+     * \return Result with the state of operation on success, error code on failure.
+     */
+    auto extract(Mode mode = Mode::Block) -> Result<State> {
+        if (pool) {
+            return extractParallel(mode);
+        }
+        if (!archive || finished) {
+            return State::Finished;
+        }
+
+        if (!disk) {
+            disk.reset(archive_write_disk_new());
+            if (disk == nullptr) {
+                return std::unexpected(Error::InitFailed);
+            }
+            archive_write_disk_set_options(disk.get(), ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM |
+                                                           ARCHIVE_EXTRACT_SECURE_SYMLINKS |
+                                                           ARCHIVE_EXTRACT_SECURE_NODOTDOT);
+        }
+
+        do {
+            // Start the next entry
+            if (current == nullptr) {
+                auto entry = next();
+                if (!entry) {
+                    return std::unexpected(entry.error());
+                }
+                if (!entry->has_value()) {
+                    archive_write_close(disk.get());
+                    finished = true;
+                    return State::Finished;
+                }
+
+                auto target = resolve(entry->value().path);
+                if (!target) {
+                    return std::unexpected(target.error());
+                }
+                archive_entry_set_pathname(current, target->c_str());
+                // Hard links refer to an entry below the destination as well
+                if (auto hardlink = archive_entry_hardlink(current)) {
+                    auto linked = resolve(hardlink);
+                    if (!linked) {
+                        return std::unexpected(linked.error());
+                    }
+                    archive_entry_set_hardlink(current, linked->c_str());
+                }
+                if (archive_write_header(disk.get(), current) < ARCHIVE_WARN) {
+                    return std::unexpected(Error::WriteFailed);
+                }
+                continue;
+            }
+
+            auto block = read();
+            if (!block) {
+                return std::unexpected(block.error());
+            }
+            if (block->data.empty()) {
+                if (archive_write_finish_entry(disk.get()) < ARCHIVE_WARN) {
+                    return std::unexpected(Error::WriteFailed);
+                }
+                current = nullptr;
+                continue;
+            }
+            if (archive_write_data_block(disk.get(), block->data.data(), block->data.size(), block->offset) <
+                ARCHIVE_WARN) {
+                return std::unexpected(Error::WriteFailed);
+            }
+        } while (mode == Mode::Block);
+
+        return State::InProgress;
+    }
+
+    /*!
+     * \brief Close the archive
+     *
+     * \details Waits for running extractions, pending entries aren't
+     *          extracted.
+     */
+    auto close() -> void {
+        pool.reset();
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        current = nullptr;
+        disk.reset();
+        archive.reset();
+    }
+
+private:
+    struct ReadDeleter {
+        auto operator()(struct archive *archive) -> void { archive_read_free(archive); }
+    };
+
+    struct DiskDeleter {
+        auto operator()(struct archive *archive) -> void { archive_write_free(archive); }
+    };
+
+    /*!
+     * \brief Constructor
+     *
+     * \param options Options of the reader
+     */
+    Reader(Options options) : options(std::move(options)) {
+        this->options.destination = std::filesystem::absolute(this->options.destination).lexically_normal();
+    }
+
+    /*!
+     * \brief Creates the libarchive reader
+     *
+     * \return Nothing on success, else error code
+     */
+    auto open() -> Result<void> {
+        archive.reset(archive_read_new());
+        if (archive == nullptr) {
+            return std::unexpected(Error::InitFailed);
+        }
+        if (archive_read_support_filter_none(archive.get()) != ARCHIVE_OK ||
+            archive_read_support_format_tar(archive.get()) != ARCHIVE_OK ||
+            archive_read_support_format_zip(archive.get()) != ARCHIVE_OK) {
+            return std::unexpected(Error::SetFormatFailed);
+        }
+#if defined(HAVE_LIBLZ4)
+        if (archive_read_support_filter_lz4(archive.get()) < ARCHIVE_WARN) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+#endif
+#if defined(HAVE_ZSTD_H)
+        if (archive_read_support_filter_zstd(archive.get()) < ARCHIVE_WARN) {
+            return std::unexpected(Error::SetCompressionFailed);
+        }
+#endif
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Path of an entry below the destination
+     *
+     * \return The path on success, error code if it leaves the destination
+     */
+    auto resolve(const std::string &name) const -> Result<std::filesystem::path> {
+        std::filesystem::path path(name);
+        if (path.is_absolute()) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        for (const auto &part : path) {
+            if (part == "..") {
+                return std::unexpected(Error::InvalidArchive);
+            }
+        }
+        return std::filesystem::path(options.destination) / path;
+    }
+
+    /*!
+     * \brief Hand zip entries to the workers and collect their results
+     *
+     * \param mode Mode of operation
+     *
+     * \return Result with the state of operation on success, error code on failure.
+     */
+    auto extractParallel(Mode mode) -> Result<State> {
+        std::unique_lock<std::mutex> lock(mutex);
+        // Keep a bounded number of entries in flight
+        size_t window = 2 * options.threads;
+        do {
+            while (submitted < records.size() && submitted - completed < window) {
+                auto index = submitted++;
+                pool->submit([this, index]() {
+                    auto res = extractZip(records[index]);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!res && !error) {
+                        error = res.error();
+                    }
+                    ++completed;
+                    progress.notify_all();
+                });
+            }
+
+            if (error) {
+                return std::unexpected(*error);
+            }
+            if (completed == records.size()) {
+                return State::Finished;
+            }
+            if (mode == Mode::Block) {
+                progress.wait(lock, [&]() {
+                    return error || completed == records.size() ||
+                           (submitted < records.size() && submitted - completed < window);
+                });
+            }
+        } while (mode == Mode::Block);
+
+        return State::InProgress;
+    }
+
+    /*!
+     * \brief Extract a single zip entry, called by the workers
+     */
+    auto extractZip(const ZipRecord &record) -> Result<void> {
+        auto target = resolve(record.name);
+        if (!target) {
+            return std::unexpected(target.error());
+        }
+
+        std::error_code code;
+        if (!record.name.empty() && record.name.back() == '/') {
+            std::filesystem::create_directories(*target, code);
+            return code ? Result<void>(std::unexpected(Error::WriteFailed)) : std::expected<void, Error>();
+        }
+        std::filesystem::create_directories(target->parent_path(), code);
+        if (code) {
+            return std::unexpected(Error::WriteFailed);
+        }
+
+        auto offset = ZipDirectory::dataOffset(fd, record);
+        if (!offset) {
+            return std::unexpected(offset.error());
+        }
+        if (S_ISLNK(record.mode)) {
+            return extractSymlink(record, offset.value(), *target);
+        }
+
+        mode_t mode = (record.mode & 0777) ? (record.mode & 0777) : 0644;
+        int out = ::open(target->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+        if (out < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        auto res = inflateEntry(record, offset.value(), out);
+        if (res) {
+            struct timespec times[2];
+            times[0].tv_sec = times[1].tv_sec = ZipDirectory::getTime(record);
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            futimens(out, times);
+        }
+        ::close(out);
+        return res;
+    }
+
+    /*!
+     * \brief Create the symbolic link of a zip entry
+     *
+     * \details Only relative targets without parent references are created,
+     *          so the links of concurrently extracted entries can't lead out of
+     *          the destination.
+     */
+    auto extractSymlink(const ZipRecord &record, uint64_t offset, const std::filesystem::path &path) -> Result<void> {
+        if (record.method != 0 || record.compressedSize != record.size || record.size > PATH_MAX) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        std::string target(record.size, '\0');
+        if (::pread(fd, target.data(), target.size(), offset) != static_cast<ssize_t>(target.size())) {
+            return std::unexpected(Error::ReadFailed);
+        }
+        if (Crc32::update(0, target) != record.crc) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        if (!resolve(target)) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        ::unlink(path.c_str());
+        if (::symlink(target.c_str(), path.c_str()) < 0) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        return std::expected<void, Error>();
+    }
+
+    /*!
+     * \brief Decompress the data of a zip entry into a file
+     */
+    auto inflateEntry(const ZipRecord &record, uint64_t offset, int out) -> Result<void> {
+#if defined(HAVE_ZLIB_H)
+        if (record.method != 0 && record.method != 8) {
+            return std::unexpected(Error::InvalidType);
+        }
+
+        z_stream stream{};
+        if (record.method == 8 && inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+            return std::unexpected(Error::InitFailed);
+        }
+
+        std::vector<char> input(std::min<uint64_t>(options.blockSize, std::max<uint64_t>(record.compressedSize, 1)));
+        std::vector<char> output(record.method == 8 ? options.blockSize : 0);
+        uint64_t remaining = record.compressedSize;
+        uint64_t written = 0;
+        uint32_t crc = 0;
+        int status = Z_OK;
+
+        // Data exceeding the recorded size fails the entry, e.g. of a zip bomb
+        bool exceeded = false;
+        auto emit = [&](const char *data, size_t length) -> bool {
+            if (length > record.size - written) {
+                exceeded = true;
+                return false;
+            }
+            crc = Crc32::update(crc, std::span<const char>(data, length));
+            written += length;
+            while (length > 0) {
+                auto res = ::write(out, data, length);
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (res <= 0) {
+                    return false;
+                }
+                data += res;
+                length -= res;
+            }
+            return true;
+        };
+
+        auto res = std::expected<void, Error>();
+        while (remaining > 0 && status != Z_STREAM_END) {
+            auto length = pread64(fd, input.data(), std::min<uint64_t>(input.size(), remaining), offset);
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            if (length <= 0) {
+                res = std::unexpected(Error::ReadFailed);
+                break;
+            }
+            offset += length;
+            remaining -= length;
+
+            if (record.method == 0) {
+                if (!emit(input.data(), length)) {
+                    res = std::unexpected(exceeded ? Error::InvalidArchive : Error::WriteFailed);
+                    break;
+                }
+                continue;
+            }
+
+            stream.next_in = reinterpret_cast<Bytef *>(input.data());
+            stream.avail_in = length;
+            do {
+                stream.next_out = reinterpret_cast<Bytef *>(output.data());
+                stream.avail_out = output.size();
+                status = inflate(&stream, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                    break;
+                }
+                if (!emit(output.data(), output.size() - stream.avail_out)) {
+                    status = exceeded ? Z_DATA_ERROR : Z_ERRNO;
+                    break;
+                }
+            } while (stream.avail_out == 0 && status != Z_STREAM_END);
+
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                res = std::unexpected(status == Z_ERRNO ? Error::WriteFailed : Error::InvalidArchive);
+                break;
+            }
+        }
+
+        if (record.method == 8) {
+            inflateEnd(&stream);
+        }
+        if (res && (written != record.size || crc != record.crc)) {
+            res = std::unexpected(Error::InvalidArchive);
+        }
+        return res;
+#else
+        return std::unexpected(Error::InvalidType);
+#endif
+    }
+
+    // Options of the reader
+    Options options;
+    // Archive read sequentially through libarchive
+    std::unique_ptr<struct archive, ReadDeleter> archive;
+    // Writer of the extracted entries
+    std::unique_ptr<struct archive, DiskDeleter> disk;
+    // Header of the current entry, owned by libarchive
+    struct archive_entry *current = nullptr;
+    // Set once the archive is extracted completely
+    bool finished = false;
+    // Zip archive extracted in parallel
+    int fd = -1;
+    std::vector<ZipRecord> records;
+    // Guards the progress of the parallel extraction
+    std::mutex mutex;
+    // Signals finished entries
+    std::condition_variable progress;
+    // Number of entries handed to and finished by the workers
+    size_t submitted = 0;
+    size_t completed = 0;
+    // First error of the workers
+    std::optional<Error> error;
+    // Workers extracting the entries, destroyed first on close
+    std::unique_ptr<ThreadPool> pool;
+};
+
+} // namespace compression
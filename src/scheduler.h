@@ -0,0 +1,372 @@
+#pragma once
+
+#include "compression.h"
+#include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Pool of worker threads driving many writers
+ *
+ * \details Every added writer is written in non-blocking steps, each limited
+ *          to a time slice proportional to the priority of the writer. After
+ *          a step, the writer is queued again on the worker that ran it once
+ *          it can make progress, see `Writer::notify()`. Each worker takes the
+ *          writers of its own queue in order and steals from the other queues
+ *          when idle, so a large archive holds a core for a slice at a time
+ *          while the smaller ones keep progressing. Each writer is stepped by
+ *          a single worker at a time. Writers without worker threads of their
+ *          own spread the compression of all writers over the pool. A writer
+ *          that stopped early but can't wait for its input, because its
+ *          source has no notification, is parked for a backoff doubling up
+ *          to `MaxBackoff` instead of stepped again right away.
+ */
+class WriterPool {
+public:
+    // Time slice of a step at priority 1
+    static constexpr auto Slice = std::chrono::microseconds(500);
+    // Backoff of a writer that made no progress, doubled until progress
+    static constexpr auto MinBackoff = std::chrono::microseconds(50);
+    static constexpr auto MaxBackoff = std::chrono::milliseconds(5);
+
+    /*!
+     * \brief Options of an added writer
+     */
+    struct Options {
+        // Share of the pool relative to the other writers, at least 1
+        size_t priority = 1;
+        // Invoked on a worker once the writer is closed, with the error that
+        // stopped it if any
+        std::function<void(Result<void>)> done = nullptr;
+    };
+
+    /*!
+     * \brief Constructor
+     *
+     * \param threads Number of worker threads, at least 1
+     */
+    explicit WriterPool(size_t threads) {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i]() { run(i); });
+        }
+    }
+
+    /*!
+     * \brief Destructor
+     *
+     * \details Joins the workers after their current step and destroys the
+     *          writers not finished, which closes their archives.
+     */
+    ~WriterPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        // Pending notifications may still queue the slots until their writer
+        // is destroyed
+        for (auto &[id, slot] : slots) {
+            slot->writer.reset();
+        }
+    }
+
+    WriterPool(const WriterPool &) = delete;
+    WriterPool &operator=(const WriterPool &) = delete;
+
+    /*!
+     * \brief Add a writer to drive until all its files are written
+     *
+     * \details The files have to be queued before, the writer isn't
+     *          thread-safe and is only used by the pool afterwards. It is
+     *          closed and destroyed once written completely or failed.
+     *
+     * \param writer  The writer to drive
+     * \param options Priority and completion callback of the writer
+     */
+    auto add(Writer::Pointer writer, Options options) -> void {
+        auto slot = std::make_unique<Slot>();
+        slot->writer = std::move(writer);
+        slot->priority = std::max<size_t>(options.priority, 1);
+        slot->done = std::move(options.done);
+        auto pointer = slot.get();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pointer->id = nextId++;
+            pointer->home = pointer->id % queues.size();
+            slots.emplace(pointer->id, std::move(slot));
+        }
+        schedule(pointer);
+    }
+
+    /*!
+     * \brief Add a writer at priority 1 to drive until all its files are written
+     */
+    auto add(Writer::Pointer writer) -> void { add(std::move(writer), Options{}); }
+
+    /*!
+     * \brief Wait until all added writers are finished
+     */
+    auto wait() -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return slots.empty(); });
+    }
+
+    /*!
+     * \brief Number of writers not yet finished
+     */
+    auto active() const -> size_t {
+        std::lock_guard<std::mutex> lock(mutex);
+        return slots.size();
+    }
+
+    /*!
+     * \brief Number of worker threads
+     */
+    auto size() const -> size_t { return workers.size(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /*!
+     * \brief Writer driven by the pool
+     */
+    struct Slot {
+        // States of the notification, the step and the callback exchange it
+        // and the later of both schedules the writer
+        enum Signal { Stepping, Fired, Waiting };
+
+        uint64_t id = 0;
+        Writer::Pointer writer;
+        size_t priority = 1;
+        std::function<void(Result<void>)> done;
+        // Queue of the worker that ran the last step
+        size_t home = 0;
+        std::atomic<Signal> signal = Stepping;
+        // Current backoff, zero after progress
+        Clock::duration backoff = Clock::duration::zero();
+    };
+
+    /*!
+     * \brief Writer waiting for its backoff
+     */
+    struct Parked {
+        Clock::time_point due;
+        Slot *slot;
+
+        auto operator>(const Parked &other) const -> bool { return due > other.due; }
+    };
+
+    /*!
+     * \brief Queue of the writers ready to step, owned by a worker
+     */
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Slot *> slots;
+    };
+
+    /*!
+     * \brief Queue a writer on its home worker
+     */
+    auto schedule(Slot *slot) -> void {
+        auto &queue = *queues[slot->home];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.slots.push_back(slot);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++queued;
+        }
+        condition.notify_one();
+    }
+
+    /*!
+     * \brief Take the next writer, from the own queue first
+     *
+     * \param index Index of the worker
+     *
+     * \return The writer, null once the pool stops
+     */
+    auto take(size_t index) -> Slot * {
+        while (true) {
+            if (auto slot = unpark()) {
+                return slot;
+            }
+            if (auto slot = pop(*queues[index], false)) {
+                return slot;
+            }
+            for (size_t i = 1; i < queues.size(); ++i) {
+                if (auto slot = pop(*queues[(index + i) % queues.size()], true)) {
+                    return slot;
+                }
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            auto ready = [this]() { return stopping || queued > 0; };
+            if (parked.empty()) {
+                condition.wait(lock, ready);
+            } else {
+                condition.wait_until(lock, parked.top().due, ready);
+            }
+            if (stopping) {
+                return nullptr;
+            }
+        }
+    }
+
+    /*!
+     * \brief Take the parked writer whose backoff elapsed first
+     *
+     * \return The writer, null if none is due
+     */
+    auto unpark() -> Slot * {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (parked.empty() || parked.top().due > Clock::now()) {
+            return nullptr;
+        }
+        auto slot = parked.top().slot;
+        parked.pop();
+        return slot;
+    }
+
+    /*!
+     * \brief Step a writer again once its backoff elapsed
+     */
+    auto park(Slot &slot) -> void {
+        slot.backoff = std::clamp<Clock::duration>(2 * slot.backoff, MinBackoff, MaxBackoff);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            parked.push(Parked{Clock::now() + slot.backoff, &slot});
+        }
+        // An idle worker may wait for a later due time
+        condition.notify_one();
+    }
+
+    /*!
+     * \brief Remove a writer from a queue
+     *
+     * \details The owner takes the longest waiting writer, thieves take the
+     *          one queued last, which keeps the owner's order intact.
+     *
+     * \param queue The queue to take from
+     * \param steal Take from the back of another worker's queue
+     */
+    auto pop(Queue &queue, bool steal) -> Slot * {
+        Slot *slot = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.slots.empty()) {
+                return nullptr;
+            }
+            if (steal) {
+                slot = queue.slots.back();
+                queue.slots.pop_back();
+            } else {
+                slot = queue.slots.front();
+                queue.slots.pop_front();
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        --queued;
+        return slot;
+    }
+
+    /*!
+     * \brief Main loop of a worker thread
+     *
+     * \param index Index of the worker and its queue
+     */
+    auto run(size_t index) -> void {
+        while (auto slot = take(index)) {
+            slot->home = index;
+            step(*slot);
+        }
+    }
+
+    /*!
+     * \brief Write a time slice of a writer
+     */
+    auto step(Slot &slot) -> void {
+        auto begin = Clock::now();
+        auto res = slot.writer->write(Budget{.time = Slice * slot.priority});
+        if (res && res.value() == State::InProgress) {
+            // Stopped early for its input, unless it used up the slice
+            bool early = Clock::now() - begin < Slice * slot.priority;
+            slot.signal = Slot::Stepping;
+            slot.writer->notify([this, &slot]() {
+                if (slot.signal.exchange(Slot::Fired) == Slot::Waiting) {
+                    slot.backoff = Clock::duration::zero();
+                    schedule(&slot);
+                }
+            });
+            if (slot.signal.exchange(Slot::Waiting) != Slot::Fired) {
+                return;
+            }
+            // Invoked right away, the source can't wait for its input
+            if (early) {
+                park(slot);
+            } else {
+                slot.backoff = Clock::duration::zero();
+                schedule(&slot);
+            }
+            return;
+        }
+
+        slot.writer->close();
+        std::unique_ptr<Slot> owned;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = slots.find(slot.id);
+            owned = std::move(it->second);
+            slots.erase(it);
+        }
+        if (owned->done) {
+            owned->done(res ? Result<void>() : std::unexpected(res.error()));
+        }
+        owned.reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+    }
+
+    // Guards the writers, the queued count, the parked writers and the stop
+    // flag
+    mutable std::mutex mutex;
+    // Signals queued writers or the stop request to idle workers
+    std::condition_variable condition;
+    // Signals finished writers
+    std::condition_variable finished;
+    // Writers not yet finished by identifier
+    std::unordered_map<uint64_t, std::unique_ptr<Slot>> slots;
+    // Queues of the workers
+    std::vector<std::unique_ptr<Queue>> queues;
+    // Number of writers in all queues
+    size_t queued = 0;
+    // Writers waiting for their backoff, earliest first
+    std::priority_queue<Parked, std::vector<Parked>, std::greater<>> parked;
+    // Identifier of the next added writer
+    uint64_t nextId = 0;
+    // Set on destruction to terminate the workers
+    bool stopping = false;
+    // Worker threads
+    std::vector<std::thread> workers;
+};
+
+} // namespace compression
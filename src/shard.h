@@ -0,0 +1,390 @@
+#pragma once
+
+#include "compression.h"
+#include "fingerprint.h"
+#include "manifest.h"
+#include "scheduler.h"
+#include "types.h"
+#include "walk.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Writer distributing the queued files over several archives
+ *
+ * \details Every shard is an independent archive written by its own
+ *          `Writer`, all shards are written concurrently by a `WriterPool`.
+ *          The shards are named after the prefix with a five-digit number,
+ *          e.g. `data-00000.tar.lz4`, and listed in `<prefix>.shards` once
+ *          written, one line per shard:
+ *
+ *          filename  files  input bytes  archive bytes (tab-separated)
+ *
+ *          The files are only assigned to the shards while queuing. The
+ *          writer of a shard is opened by `write()` once a thread of the pool
+ *          is available, so at most `Options::threads` archives are open at a
+ *          time. Identical files are only linked within a shard. Callbacks of
+ *          the writer options are invoked concurrently from the shards, the
+ *          files of a shard count in the progress once it is opened.
+ */
+class ShardedWriter {
+public:
+    using Pointer = std::unique_ptr<ShardedWriter>;
+
+    /*!
+     * \brief Distribution of the files over the shards
+     */
+    enum class Split {
+        // Fill a shard up to the target size before starting the next
+        Size,
+        // Assign by a hash of the path to a fixed number of shards
+        Hash,
+    };
+
+    /*!
+     * \brief Options of the sharded writer
+     */
+    struct Options {
+        // Options of every shard
+        Writer::Options writer = {};
+        // Distribution of the files
+        Split split = Split::Size;
+        // Target input bytes of a shard split by size, a larger file takes a
+        // shard of its own
+        uint64_t shardSize = uint64_t(1) << 30;
+        // Number of shards split by hash
+        size_t shards = 4;
+        // Threads writing the shards, also the number of shards open at a
+        // time
+        size_t threads = std::thread::hardware_concurrency();
+    };
+
+    /*!
+     * \brief Written shard as listed in the shard manifest
+     */
+    struct Shard {
+        std::string filename;
+        // Number of queued files
+        uint64_t files = 0;
+        // Input bytes of the queued files
+        uint64_t bytes = 0;
+        // Size of the archive once written
+        uint64_t size = 0;
+    };
+
+    /*!
+     * \brief Create a sharded writer
+     *
+     * \details The archives are created by `write()`.
+     *
+     * \param prefix  Path of the shards without number and extension
+     * \param type    The archive type of the shards
+     * \param options Options of the writer
+     *
+     * \return Result container either a reference to the writer or an error code
+     */
+    static auto open(std::string prefix, ArchiveType type, Options options) -> Result<Pointer> {
+        if (Writer::extension(type).empty()) {
+            return std::unexpected(Error::InvalidType);
+        }
+        auto writer = Pointer(new ShardedWriter(std::move(prefix), type, options));
+        size_t count = (options.split == Split::Hash) ? std::max<size_t>(options.shards, 1) : 1;
+        for (size_t i = 0; i < count; ++i) {
+            writer->addShard();
+        }
+        return writer;
+    }
+
+    /*!
+     * \brief Add a file to a shard
+     *
+     * \details Fails if the file doesn't exist, isn't a regular file or
+     *          symbolic link, is unchanged since the previous manifest and
+     *          skipped, or the shards are written already.
+     *
+     * \param filename The filename to add
+     *
+     * \return True if the file is queued, false otherwise
+     */
+    auto add_file(std::string filename) -> bool {
+        struct stat64 stat;
+        if (0 != lstat64(filename.c_str(), &stat)) {
+            return false;
+        }
+        return enqueue(std::move(filename), stat).value_or(false);
+    }
+
+    /*!
+     * \brief Add all regular files below a directory to the shards
+     *
+     * \param directory The directory to add
+     *
+     * \return Number of files queued on success, else error code
+     */
+    auto add_directory(const std::string &directory) -> Result<size_t> {
+        size_t added = 0;
+        std::optional<Error> error;
+        auto res = walk(directory, [&](std::string path, const struct stat64 &stat) {
+            if (error) {
+                return;
+            }
+            auto queued = enqueue(std::move(path), stat);
+            if (!queued) {
+                error = queued.error();
+            } else {
+                added += queued.value() ? 1 : 0;
+            }
+        });
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        if (error) {
+            return std::unexpected(*error);
+        }
+        return added;
+    }
+
+    /*!
+     * \brief Write all shards and the shard manifest
+     *
+     * \details Blocks until every shard is written and closed. Records of the
+     *          shards are merged into `Writer::Options::manifest` afterwards.
+     *
+     * \return Nothing on success, else the first error of the shards
+     */
+    auto write() -> Result<void> {
+        if (written) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        written = true;
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::optional<Error> error;
+        {
+            size_t threads = std::max<size_t>(options.threads, 1);
+            size_t running = 0;
+            WriterPool pool(threads);
+            for (size_t i = 0; i < list.size(); ++i) {
+                // The next shard is opened once another one is closed
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    finished.wait(lock, [&]() { return running < threads || error; });
+                    if (error) {
+                        break;
+                    }
+                }
+                auto writer = openShard(i);
+                if (!writer) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = writer.error();
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++running;
+                }
+                pool.add(std::move(writer.value()), WriterPool::Options{.done = [&](Result<void> res) {
+                                                         std::lock_guard<std::mutex> lock(mutex);
+                                                         if (!res && !error) {
+                                                             error = res.error();
+                                                         }
+                                                         --running;
+                                                         finished.notify_all();
+                                                     }});
+            }
+            pool.wait();
+        }
+        queued.clear();
+
+        if (options.writer.manifest) {
+            for (auto &manifest : manifests) {
+                for (const auto &[path, record] : manifest->entries()) {
+                    options.writer.manifest->add(path, record);
+                }
+            }
+        }
+        if (error) {
+            return std::unexpected(*error);
+        }
+
+        for (auto &shard : list) {
+            struct stat64 stat;
+            if (0 != stat64(shard.filename.c_str(), &stat)) {
+                return std::unexpected(Error::StatFailed);
+            }
+            shard.size = stat.st_size;
+        }
+        return save();
+    }
+
+    /*!
+     * \brief The shards assigned so far, their size is set once written
+     */
+    auto shards() const -> const std::vector<Shard> & { return list; }
+
+private:
+    /*!
+     * \brief Constructor
+     */
+    ShardedWriter(std::string prefix, ArchiveType type, Options options)
+        : prefix(std::move(prefix)), type(type), options(std::move(options)) {}
+
+    /*!
+     * \brief File assigned to a shard
+     */
+    struct Queued {
+        std::string path;
+        struct stat64 stat;
+    };
+
+    /*!
+     * \brief Add the next shard without files
+     */
+    auto addShard() -> void {
+        char number[24];
+        std::snprintf(number, sizeof(number), "-%05zu", list.size());
+        list.push_back(Shard{prefix + number + Writer::extension(type)});
+        queued.emplace_back();
+    }
+
+    /*!
+     * \brief Open the writer of a shard and queue its files
+     *
+     * \return The writer on success, else error code
+     */
+    auto openShard(size_t index) -> Result<Writer::Pointer> {
+        auto name = list[index].filename;
+        name.resize(name.size() - Writer::extension(type).size());
+
+        // The shards are written concurrently, each records into its own.
+        // Unchanged files are skipped while queuing already.
+        auto shardOptions = options.writer;
+        shardOptions.previous = nullptr;
+        if (options.writer.manifest) {
+            manifests.push_back(std::make_shared<Manifest>());
+            shardOptions.manifest = manifests.back();
+        }
+        auto res = Writer::open(name, type, shardOptions);
+        if (!res) {
+            return std::unexpected(res.error());
+        }
+        for (auto &file : queued[index]) {
+            res.value()->add_file(std::move(file.path), file.stat);
+        }
+        queued[index].clear();
+        return std::move(res.value());
+    }
+
+    /*!
+     * \brief Queue a file into its shard
+     *
+     * \return True if queued, false if neither a regular file nor a
+     *         symbolic link, or unchanged since the previous manifest, else
+     *         error code
+     */
+    auto enqueue(std::string path, const struct stat64 &stat) -> Result<bool> {
+        // The shards are closed once written
+        if (written) {
+            return std::unexpected(Error::WriteFailed);
+        }
+        if (!S_ISREG(stat.st_mode) && !S_ISLNK(stat.st_mode)) {
+            return false;
+        }
+        // Carried over into the new manifest
+        if (options.writer.previous) {
+            if (auto record = options.writer.previous->unchanged(path, stat)) {
+                if (options.writer.manifest) {
+                    options.writer.manifest->add(path, *record);
+                }
+                return false;
+            }
+        }
+
+        size_t index = 0;
+        if (options.split == Split::Hash) {
+            index = Hasher::of(path).low % list.size();
+        } else {
+            auto &last = list.back();
+            if (last.files > 0 && last.bytes + uint64_t(stat.st_size) > options.shardSize) {
+                addShard();
+            }
+            index = list.size() - 1;
+        }
+        queued[index].push_back(Queued{std::move(path), stat});
+        ++list[index].files;
+        list[index].bytes += stat.st_size;
+        return true;
+    }
+
+    /*!
+     * \brief Write the shard manifest
+     *
+     * \details Written into a temporary file renamed on success.
+     *
+     * \return Nothing on success, else error code
+     */
+    auto save() const -> Result<void> {
+        std::string data;
+        for (const auto &shard : list) {
+            auto slash = shard.filename.rfind('/');
+            data += (slash == std::string::npos) ? shard.filename : shard.filename.substr(slash + 1);
+            data += '\t' + std::to_string(shard.files) + '\t' + std::to_string(shard.bytes) + '\t' +
+                    std::to_string(shard.size) + '\n';
+        }
+
+        auto filename = prefix + ".shards";
+        auto temporary = filename + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return std::unexpected(Error::OpenFailed);
+        }
+        for (size_t written = 0; written < data.size();) {
+            auto res = ::write(fd, data.data() + written, data.size() - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                return std::unexpected(Error::WriteFailed);
+            }
+            written += res;
+        }
+        if (::close(fd) < 0 || ::rename(temporary.c_str(), filename.c_str()) < 0) {
+            ::unlink(temporary.c_str());
+            return std::unexpected(Error::WriteFailed);
+        }
+        return std::expected<void, Error>();
+    }
+
+    // Path of the shards without number and extension
+    std::string prefix;
+    // Archive type of the shards
+    ArchiveType type;
+    // Options of the writer
+    Options options;
+    // Files of the shards not yet opened
+    std::vector<std::vector<Queued>> queued;
+    // Set once written, no further files are queued
+    bool written = false;
+    // Manifests of the shards, empty unless a manifest is requested
+    std::vector<std::shared_ptr<Manifest>> manifests;
+    // The shards in order
+    std::vector<Shard> list;
+};
+
+} // namespace compression
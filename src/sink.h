@@ -0,0 +1,121 @@
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <memory>
+#include <span>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace compression {
+
+/*!
+ * \brief Vectored receiver of the archive output
+ *
+ * \details The writer collects the output blocks of libarchive and hands
+ *          them over in batches, each block as separate `iovec`. This suits
+ *          `writev`, `sendmsg` or the assembly of upload parts and saves the
+ *          invocation of a callback per block. The blocks are only valid
+ *          during the call of `write()`.
+ */
+class Sink {
+public:
+    using Pointer = std::unique_ptr<Sink>;
+
+    /*!
+     * \brief Destructor
+     */
+    virtual ~Sink() = default;
+
+    /*!
+     * \brief Invoked once the archive is opened
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto open() -> Result<void> { return std::expected<void, Error>(); }
+
+    /*!
+     * \brief Write a batch of blocks completely
+     *
+     * \param blocks The blocks in archive order
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto write(std::span<const struct iovec> blocks) -> Result<void> = 0;
+
+    /*!
+     * \brief Invoked once the archive is complete
+     *
+     * \return Nothing on success, else error code
+     */
+    virtual auto close() -> Result<void> { return std::expected<void, Error>(); }
+};
+
+/*!
+ * \brief Sink writing into a file descriptor with `writev`
+ */
+class FdSink : public Sink {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param fd    The file descriptor to write to
+     * \param owned Close the file descriptor on close
+     */
+    explicit FdSink(int fd, bool owned = false) : fd(fd), owned(owned) {}
+
+    /*!
+     * \brief Destructor
+     */
+    ~FdSink() override { close(); }
+
+    auto write(std::span<const struct iovec> blocks) -> Result<void> override {
+        // Partially written blocks are continued from a local copy
+        struct iovec partial;
+        while (!blocks.empty()) {
+            auto count = std::min<size_t>(blocks.size(), IOV_MAX);
+            auto res = ::writev(fd, blocks.data(), count);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return std::unexpected(Error::WriteFailed);
+            }
+
+            size_t written = res;
+            while (!blocks.empty() && written >= blocks.front().iov_len) {
+                written -= blocks.front().iov_len;
+                blocks = blocks.subspan(1);
+            }
+            if (written > 0) {
+                partial.iov_base = static_cast<char *>(blocks.front().iov_base) + written;
+                partial.iov_len = blocks.front().iov_len - written;
+                auto rest = write(std::span<const struct iovec>(&partial, 1));
+                if (!rest) {
+                    return rest;
+                }
+                blocks = blocks.subspan(1);
+            }
+        }
+        return std::expected<void, Error>();
+    }
+
+    auto close() -> Result<void> override {
+        if (owned && fd >= 0 && ::close(fd) < 0) {
+            fd = -1;
+            return std::unexpected(Error::WriteFailed);
+        }
+        fd = -1;
+        return std::expected<void, Error>();
+    }
+
+private:
+    // File descriptor to write to
+    int fd;
+    // Close the file descriptor on close
+    bool owned;
+};
+
+} // namespace compression
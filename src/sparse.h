@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <span>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Data regions of a sparse file
+ *
+ * \details Located with `lseek(SEEK_DATA/SEEK_HOLE)`, file systems without
+ *          support report the whole file as data. Holes shorter than
+ *          `MinimumHole` are counted as data, their zeros cost less than the
+ *          bookkeeping. The holes aren't read but passed as zeros from
+ *          `zeros()`, the tar writer records them as sparse regions.
+ */
+class SparseMap {
+public:
+    // Holes shorter than this are counted as data
+    static constexpr uint64_t MinimumHole = 64 << 10;
+    // Size of the zero buffer passed for the holes
+    static constexpr size_t ZeroSize = 1 << 20;
+
+    /*!
+     * \brief Region of data within the file
+     */
+    struct Extent {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    /*!
+     * \brief Check whether a file may contain holes
+     *
+     * \details Files with fewer allocated blocks than their size may be
+     *          sparse, others are never probed.
+     */
+    static auto candidate(const struct stat64 &stat) -> bool {
+        return S_ISREG(stat.st_mode) && stat.st_size >= static_cast<off64_t>(MinimumHole) &&
+               uint64_t(stat.st_blocks) * 512 < uint64_t(stat.st_size);
+    }
+
+    /*!
+     * \brief Locate the data regions of a file
+     *
+     * \param path The file to probe
+     * \param stat Stats of the file, the size bounds the regions
+     *
+     * \return The regions, without holes if the file isn't sparse or can't be
+     *         probed
+     */
+    static auto of(const std::string &path, const struct stat64 &stat) -> SparseMap {
+        SparseMap map;
+        map.size = stat.st_size;
+        if (!candidate(stat)) {
+            return map;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return map;
+        }
+
+        std::vector<Extent> extents;
+        uint64_t offset = 0;
+        while (offset < map.size) {
+            auto data = lseek64(fd, offset, SEEK_DATA);
+            // The rest of the file is a hole
+            if (data < 0 && errno == ENXIO) {
+                break;
+            }
+            // Not supported by the file system
+            if (data < 0) {
+                ::close(fd);
+                return map;
+            }
+            auto hole = lseek64(fd, data, SEEK_HOLE);
+            if (hole < 0) {
+                ::close(fd);
+                return map;
+            }
+            auto begin = std::min<uint64_t>(data, map.size);
+            auto end = std::min<uint64_t>(hole, map.size);
+            if (begin >= end) {
+                break;
+            }
+            // Short holes are merged into the preceding data
+            if (!extents.empty() && begin - (extents.back().offset + extents.back().length) < MinimumHole) {
+                extents.back().length = end - extents.back().offset;
+            } else if (extents.empty() && begin < MinimumHole) {
+                extents.push_back(Extent{0, end});
+            } else {
+                extents.push_back(Extent{begin, end - begin});
+            }
+            offset = end;
+        }
+        ::close(fd);
+
+        // A short hole at the end is counted as data
+        if (!extents.empty() && map.size - (extents.back().offset + extents.back().length) < MinimumHole) {
+            extents.back().length = map.size - extents.back().offset;
+        }
+        if (extents.size() != 1 || extents.front().offset != 0 || extents.front().length != map.size) {
+            map.regions = std::move(extents);
+            map.sparse = true;
+        }
+        return map;
+    }
+
+    /*!
+     * \brief Check whether the file has holes
+     */
+    auto holes() const -> bool { return sparse; }
+
+    /*!
+     * \brief The data regions in order, empty if the file has no holes
+     */
+    auto extents() const -> const std::vector<Extent> & { return regions; }
+
+    /*!
+     * \brief Length of the hole at an offset
+     *
+     * \param offset Offset in the file
+     *
+     * \return Bytes of the hole starting at the offset, zero within data
+     */
+    auto hole(uint64_t offset) const -> uint64_t {
+        if (!sparse || offset >= size) {
+            return 0;
+        }
+        // First region starting after the offset
+        auto it = std::upper_bound(regions.begin(), regions.end(), offset,
+                                   [](uint64_t value, const Extent &extent) { return value < extent.offset; });
+        if (it != regions.begin()) {
+            auto previous = std::prev(it);
+            if (offset < previous->offset + previous->length) {
+                return 0;
+            }
+        }
+        return ((it == regions.end()) ? size : it->offset) - offset;
+    }
+
+    /*!
+     * \brief Zeros of the hole at an offset
+     *
+     * \return Up to `ZeroSize` zeros, empty within data
+     */
+    auto zerosAt(uint64_t offset) const -> std::span<const char> {
+        return zeros().first(std::min<uint64_t>(hole(offset), ZeroSize));
+    }
+
+    /*!
+     * \brief Zeros passed in place of the holes, `ZeroSize` bytes
+     */
+    static auto zeros() -> std::span<const char> {
+        static const std::vector<char> buffer(ZeroSize, 0);
+        return buffer;
+    }
+
+private:
+    // Size of the file
+    uint64_t size = 0;
+    // Data regions, empty if the file has no holes
+    std::vector<Extent> regions;
+    // Set if the file has holes
+    bool sparse = false;
+};
+
+} // namespace compression
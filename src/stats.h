@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace compression {
+
+/*!
+ * \brief Histogram of sizes in power-of-two buckets
+ *
+ * \details Bucket `i` counts the sizes of bit width `i`, i.e. sizes in the
+ *          range [2^(i-1), 2^i). The last bucket collects all larger sizes.
+ */
+struct Histogram {
+    std::array<uint64_t, 40> buckets{};
+
+    /*!
+     * \brief Count a size
+     */
+    auto add(uint64_t size) -> void { ++buckets[std::min<size_t>(std::bit_width(size), buckets.size() - 1)]; }
+
+    /*!
+     * \brief Add the counts of another histogram
+     */
+    auto merge(const Histogram &other) -> void {
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i] += other.buckets[i];
+        }
+    }
+};
+
+/*!
+ * \brief Counters of the writer
+ *
+ * \details The compress time covers the libarchive calls without the time
+ *          spent in the output callback. In parallel mode, the read and
+ *          compress times are the time spent by the workers.
+ */
+struct Counters {
+    using Clock = std::chrono::steady_clock;
+
+    // Bytes read from the input files
+    uint64_t bytesIn = 0;
+    // Bytes passed to the output
+    uint64_t bytesOut = 0;
+    // Time spent reading the input
+    Clock::duration readTime = Clock::duration::zero();
+    // Time spent compressing and formatting
+    Clock::duration compressTime = Clock::duration::zero();
+    // Time spent in the output callback
+    Clock::duration writeTime = Clock::duration::zero();
+    // Number of `write()` steps
+    uint64_t steps = 0;
+    // Sizes of the chunks read from the input
+    Histogram chunks;
+
+    /*!
+     * \brief Add the counters of another instance
+     */
+    auto merge(const Counters &other) -> void {
+        bytesIn += other.bytesIn;
+        bytesOut += other.bytesOut;
+        readTime += other.readTime;
+        compressTime += other.compressTime;
+        writeTime += other.writeTime;
+        steps += other.steps;
+        chunks.merge(other.chunks);
+    }
+};
+
+/*!
+ * \brief Counters of a single entry
+ *
+ * \details Output is attributed to the entry written while the output
+ *          callback is invoked, libarchive may buffer it until later entries.
+ */
+struct EntryStats : Counters {
+    std::string path;
+};
+
+/*!
+ * \brief Counters of the whole archive
+ */
+struct Stats : Counters {
+    // Number of entries written completely
+    uint64_t entries = 0;
+    // Bytes in flight and their maximum in the memory budget of the writer,
+    // which covers all writers sharing it
+    uint64_t memoryUsed = 0;
+    uint64_t memoryPeak = 0;
+};
+
+/*!
+ * \brief Collector of the writer statistics
+ */
+class StatsCollector {
+public:
+    using Clock = Counters::Clock;
+    using Callback = std::function<void(const EntryStats &, const Stats &)>;
+
+    /*!
+     * \brief Constructor
+     *
+     * \param callback Invoked for every finished entry, may be empty
+     */
+    explicit StatsCollector(Callback callback) : callback(std::move(callback)) {}
+
+    /*!
+     * \brief Start a new entry
+     */
+    auto begin(std::string path) -> void {
+        entry = EntryStats{};
+        entry.path = std::move(path);
+    }
+
+    /*!
+     * \brief Record a chunk read from the input
+     */
+    auto read(uint64_t bytes, Clock::duration elapsed) -> void {
+        entry.bytesIn += bytes;
+        entry.readTime += elapsed;
+        entry.chunks.add(bytes);
+    }
+
+    /*!
+     * \brief Record a call of libarchive
+     *
+     * \details The time spent in the output callback during the call is
+     *          accounted as write time instead.
+     */
+    auto compress(Clock::duration elapsed) -> void {
+        entry.compressTime += std::max(elapsed - callbackTime, Clock::duration::zero());
+        callbackTime = Clock::duration::zero();
+    }
+
+    /*!
+     * \brief Record a call of the output callback
+     */
+    auto output(uint64_t bytes, Clock::duration elapsed) -> void {
+        entry.bytesOut += bytes;
+        entry.writeTime += elapsed;
+        callbackTime += elapsed;
+    }
+
+    /*!
+     * \brief Record a `write()` step working on the current entry
+     */
+    auto step() -> void { ++entry.steps; }
+
+    /*!
+     * \brief Merge counters collected elsewhere into the current entry
+     */
+    auto merge(const Counters &counters) -> void { entry.merge(counters); }
+
+    /*!
+     * \brief Finish the current entry
+     */
+    auto end() -> void {
+        totals.merge(entry);
+        ++totals.entries;
+        if (callback) {
+            callback(entry, totals);
+        }
+        entry = EntryStats{};
+    }
+
+    /*!
+     * \brief Totals including the unfinished entry
+     */
+    auto stats() const -> Stats {
+        auto res = totals;
+        res.merge(entry);
+        return res;
+    }
+
+private:
+    // Invoked for every finished entry
+    Callback callback;
+    // Counters of the current entry
+    EntryStats entry;
+    // Counters of the finished entries
+    Stats totals;
+    // Time spent in the output callback since the last libarchive call
+    Clock::duration callbackTime = Clock::duration::zero();
+};
+
+} // namespace compression
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Fixed set of worker threads
+ *
+ * \details Tasks are executed in submission order by the first idle worker.
+ *          Destroying the pool drops all tasks that haven't started yet and
+ *          joins the workers after their current task returned.
+ */
+class ThreadPool {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param threads Number of worker threads
+     */
+    explicit ThreadPool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    /*!
+     * \brief Destructor
+     */
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /*!
+     * \brief Queue a task for execution
+     *
+     * \param task The task to execute on one of the workers
+     */
+    auto submit(std::function<void()> task) -> void {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        condition.notify_one();
+    }
+
+    /*!
+     * \brief Number of worker threads
+     */
+    auto size() const -> size_t { return workers.size(); }
+
+private:
+    /*!
+     * \brief Main loop of a worker thread
+     */
+    auto run() -> void {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    // Guards the task queue and the stop flag
+    std::mutex mutex;
+    // Signals new tasks or the stop request
+    std::condition_variable condition;
+    // Tasks not yet picked up by any worker
+    std::deque<std::function<void()>> tasks;
+    // Set on destruction to terminate the workers
+    bool stopping = false;
+    // Worker threads
+    std::vector<std::thread> workers;
+};
+
+} // namespace compression
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace compression {
+
+/*!
+ * \brief Tuner of the read chunk size
+ *
+ * \details The chunk size starts at a value suited for the archive type and
+ *          is adapted with the throughput measured over windows of write
+ *          steps: it's doubled as long as that raises the throughput
+ *          noticeably and reverted once it doesn't. A file never gets a chunk
+ *          larger than its size rounded up to full pages.
+ */
+class ChunkTuner {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Minimum number of steps and time of a measurement window
+    static constexpr size_t WindowSteps = 32;
+    static constexpr auto WindowTime = std::chrono::milliseconds(5);
+    // Relative throughput gain required to keep growing
+    static constexpr double Gain = 1.05;
+
+    /*!
+     * \brief Constructor
+     *
+     * \param type The archive type, determines the range of the chunk size
+     */
+    explicit ChunkTuner(ArchiveType type) {
+        switch (type) {
+        case ArchiveType::TarLz4:
+        case ArchiveType::TarZstd:
+            // Whole LZ4 blocks of 64 KiB up to 4 MiB per write, zstd jobs
+            // consume large inputs as well
+            minimum = 64 << 10;
+            maximum = 4 << 20;
+            current = 1 << 20;
+            break;
+        default:
+            // Deflate consumes its input in small windows
+            minimum = 16 << 10;
+            maximum = 1 << 20;
+            current = 128 << 10;
+            break;
+        }
+    }
+
+    /*!
+     * \brief Output block size for the archive type
+     *
+     * \details Large blocks reduce the number of calls of the output
+     *          callback, the block is independent of the chunk size.
+     */
+    static auto blockSize(ArchiveType type) -> size_t { return (type == ArchiveType::Zip) ? (256 << 10) : (1 << 20); }
+
+    /*!
+     * \brief Chunk size to read a file with
+     *
+     * \param fileSize Size of the file as given by `lstat64`
+     */
+    auto chunkSize(uint64_t fileSize) const -> size_t {
+        constexpr uint64_t page = 4096;
+        auto rounded = std::max<uint64_t>((fileSize + page - 1) / page * page, page);
+        return std::min<uint64_t>(current, rounded);
+    }
+
+    /*!
+     * \brief Record a write step
+     *
+     * \param bytes   Number of bytes passed to the archive in the step
+     * \param elapsed Duration of the step
+     */
+    auto record(size_t bytes, Clock::duration elapsed) -> void {
+        windowBytes += bytes;
+        windowTime += elapsed;
+        if (settled || ++windowSteps < WindowSteps || windowTime < WindowTime || windowBytes == 0) {
+            return;
+        }
+
+        double throughput = windowBytes / std::chrono::duration<double>(windowTime).count();
+        windowBytes = 0;
+        windowSteps = 0;
+        windowTime = Clock::duration::zero();
+
+        if (throughput > best * Gain && current < maximum) {
+            // Still gaining, try the next size
+            best = throughput;
+            previous = current;
+            current = std::min(current * 2, maximum);
+        } else {
+            // Stay with the best measured size
+            if (throughput <= best) {
+                current = std::max(previous, minimum);
+            }
+            settled = true;
+        }
+    }
+
+private:
+    // Range of the chunk size
+    size_t minimum;
+    size_t maximum;
+    // Chunk size in use
+    size_t current;
+    // Chunk size measured before the current one
+    size_t previous = 0;
+    // Best throughput measured so far in bytes per second
+    double best = 0;
+    // Growing stopped
+    bool settled = false;
+    // Measurement window
+    size_t windowBytes = 0;
+    size_t windowSteps = 0;
+    Clock::duration windowTime = Clock::duration::zero();
+};
+
+} // namespace compression
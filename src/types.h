@@ -0,0 +1,165 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <expected>
+
+namespace compression {
+
+/*!
+ * \brief Error codes
+ *
+ * \details The Error codes are returned if an operation fails
+ */
+enum class Error {
+    InitFailed = 0,
+    SetFormatFailed,
+    SetCompressionFailed,
+    OpenFailed,
+    WriteFailed,
+    StatFailed,
+    FileChanged,
+    InvalidType,
+    ReadFailed,
+    InvalidArchive,
+};
+
+/*!
+ * \brief Modes of operation
+ *
+ * \details The two possible modes are given as non-blocking and blocking.
+ *          In case of non-blocking mode, the operation will perform only a
+ *          single step before returning.
+ */
+enum class Mode {
+    NonBlock,
+    Block,
+};
+
+/*!
+ * \brief State of operation
+ *
+ * \details The state of operation is either given as in progress or finished.
+ *          Any blocking call will guarantee that it's finished after a single
+ *          call. A non-blocking call may return with 'InProgress' if the
+ *          operation couldn't finish without blocking or if required multiple
+ *          steps to fully finalize the operation.
+ */
+enum class State {
+    InProgress,
+    Finished,
+};
+
+enum class ArchiveType {
+    Zip,
+    TarLz4,
+    TarZstd,
+};
+
+/*!
+ * \brief Backends reading the input files
+ *
+ * \details Backends not available at build time fail on open.
+ */
+enum class InputType {
+    Mmap,
+    Pread,
+    IoUring,
+    Pipeline,
+};
+
+/*!
+ * \brief Use of the page cache
+ *
+ * \details Archiving bulk data through the page cache evicts the working
+ *          set of other processes. Dropping the pages keeps the cache clean
+ *          at the cost of the reads ahead by the kernel.
+ */
+enum class CacheMode {
+    // Read and write through the page cache
+    Keep,
+    // Drop the pages of the input once read and of the output once written
+    Drop,
+    // Read the input with `O_DIRECT`, the output is dropped as with `Drop`
+    Direct,
+};
+
+/*!
+ * \brief Budget of a non-blocking operation
+ *
+ * \details Limits the work done by a single non-blocking call. The call
+ *          performs steps until either limit is reached, but at least a
+ *          single step. A limit of zero is unlimited.
+ */
+struct Budget {
+    using Clock = std::chrono::steady_clock;
+
+    // Time available to the call
+    Clock::duration time = Clock::duration::zero();
+    // Number of input bytes to pass to the archive
+    uint64_t bytes = 0;
+
+    /*!
+     * \brief Check whether another step fits into the budget
+     *
+     * \param start Begin of the call
+     * \param used  Number of bytes passed so far
+     */
+    auto allows(Clock::time_point start, uint64_t used) const -> bool {
+        if (bytes > 0 && used >= bytes) {
+            return false;
+        }
+        return time == Clock::duration::zero() || Clock::now() - start < time;
+    }
+};
+
+/*!
+ * \brief Options of the codecs
+ *
+ * \details Applies to the archives written by libarchive and by the parallel
+ *          engine alike. Only the options of the written archive type are
+ *          used.
+ */
+struct CompressionOptions {
+    // Deflate level of zip entries from 0 to 9, -1 uses the zlib default
+    int deflateLevel = -1;
+    // LZ4 level from 1 to 9, levels from 3 on use the high compression mode
+    int lz4Level = 1;
+    // Maximum size of the LZ4 blocks, 64 KiB, 256 KiB, 1 MiB or 4 MiB
+    uint32_t lz4BlockSize = 4 << 20;
+    // Compress LZ4 blocks depending on the previous block of the frame,
+    // improves the ratio of small blocks
+    bool lz4BlockDependence = false;
+    // Level of zstd
+    int zstdLevel = 3;
+    // Store zip entries without compression if a probe of their first chunk
+    // finds them incompressible, see `Probe`
+    bool storeIncompressible = false;
+    // Zip entries up to this size are compressed in one shot with libdeflate
+    // by the parallel engine instead of streaming zlib, zero disables.
+    // Requires libdeflate, see `ENABLE_LIBDEFLATE`.
+    uint64_t oneShotSize = 0;
+
+    /*!
+     * \brief LZ4 block size identifier from 4 to 7, zero if unsupported
+     */
+    auto lz4BlockId() const -> int {
+        for (int id = 4; id <= 7; ++id) {
+            if (lz4BlockSize == (1u << (2 * id + 8))) {
+                return id;
+            }
+        }
+        return 0;
+    }
+};
+
+/*!
+ * \brief Result of an operation
+ *
+ * \details Contains either the value of a successful operation or the error
+ *          code of the failure.
+ */
+template <typename T>
+using Result = std::expected<T, Error>;
+
+} // namespace compression
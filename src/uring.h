@@ -0,0 +1,786 @@
+#pragma once
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include "buffer_pool.h"
+#include "input.h"
+#include "types.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <span>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Minimal io_uring submission and completion ring
+ *
+ * \details Wraps the raw system calls, only reads and opens are supported.
+ */
+class Uring {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param entries Number of submission queue entries
+     */
+    explicit Uring(unsigned entries) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return;
+        }
+
+        sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sqSize = cqSize = std::max(sqSize, cqSize);
+        }
+
+        sq = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) {
+            sq = nullptr;
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq = sq;
+        } else {
+            cq = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED) {
+                cq = nullptr;
+                return;
+            }
+        }
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        auto addr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (addr == MAP_FAILED) {
+            return;
+        }
+        sqes = static_cast<struct io_uring_sqe *>(addr);
+
+        auto sqBase = static_cast<char *>(sq);
+        sqHead = reinterpret_cast<unsigned *>(sqBase + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sqBase + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned *>(sqBase + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqArray = reinterpret_cast<unsigned *>(sqBase + params.sq_off.array);
+
+        auto cqBase = static_cast<char *>(cq);
+        cqHead = reinterpret_cast<unsigned *>(cqBase + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cqBase + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cqBase + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(cqBase + params.cq_off.cqes);
+    }
+
+    /*!
+     * \brief Destructor
+     */
+    ~Uring() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+        }
+        if (cq != nullptr && cq != sq) {
+            munmap(cq, cqSize);
+        }
+        if (sq != nullptr) {
+            munmap(sq, sqSize);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    /*!
+     * \brief Check whether the ring is set up
+     */
+    auto valid() const -> bool { return sqes != nullptr; }
+
+    /*!
+     * \brief Queue a read request
+     *
+     * \return False if the submission queue is full
+     */
+    auto read(int file, void *buffer, unsigned length, uint64_t offset, uint64_t userdata) -> bool {
+        auto sqe = acquire();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = file;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = userdata;
+        commit();
+        return true;
+    }
+
+    /*!
+     * \brief Queue an open request, the result is the file descriptor
+     *
+     * \param path Path of the file, kept alive until the completion
+     *
+     * \return False if the submission queue is full
+     */
+    auto openat(const char *path, int flags, uint64_t userdata) -> bool {
+        auto sqe = acquire();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(path);
+        sqe->open_flags = flags;
+        sqe->user_data = userdata;
+        commit();
+        return true;
+    }
+
+    /*!
+     * \brief Submit the queued requests
+     *
+     * \param wait Number of completions to wait for
+     *
+     * \return False on failure of the system call
+     */
+    auto submit(unsigned wait = 0) -> bool {
+        if (queued == 0 && wait == 0) {
+            return true;
+        }
+        int res;
+        do {
+            res = syscall(__NR_io_uring_enter, fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            return false;
+        }
+        queued -= std::min<unsigned>(res, queued);
+        return true;
+    }
+
+    /*!
+     * \brief Signal the completions on an eventfd
+     *
+     * \return False if not supported by the kernel
+     */
+    auto signal(int eventFd) -> bool {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventFd, 1) == 0;
+    }
+
+    /*!
+     * \brief Pass all available completions to the handler
+     *
+     * \param handler Invoked with the userdata and result of each request
+     */
+    template <typename Handler>
+    auto reap(Handler &&handler) -> void {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            auto cqe = &cqes[head & cqMask];
+            handler(cqe->user_data, cqe->res);
+            ++head;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+private:
+    /*!
+     * \brief Next free submission queue entry, cleared
+     *
+     * \return Null if the submission queue is full
+     */
+    auto acquire() -> struct io_uring_sqe * {
+        unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            return nullptr;
+        }
+        auto sqe = &sqes[tail & sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /*!
+     * \brief Queue the entry returned by `acquire()`
+     */
+    auto commit() -> void {
+        unsigned tail = *sqTail;
+        sqArray[tail & sqMask] = tail & sqMask;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++queued;
+    }
+
+    // File descriptor of the ring
+    int fd = -1;
+    // Mapped ring memory
+    void *sq = nullptr;
+    void *cq = nullptr;
+    size_t sqSize = 0;
+    size_t cqSize = 0;
+    size_t sqesSize = 0;
+    // Submission queue
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    // Completion queue
+    struct io_uring_cqe *cqes = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    // Requests queued but not yet submitted
+    unsigned queued = 0;
+};
+
+/*!
+ * \brief Input source reading with io_uring
+ *
+ * \details A fixed number of chunk buffers is kept in flight. The reads are
+ *          issued in order over the opened file and the announced files
+ *          following it, so the disk latency overlaps with the compression of
+ *          the previous chunks. In non-blocking mode, `read()` returns without
+ *          data instead of waiting for a completion. With a memory budget, no
+ *          further reads are issued while the budget is exhausted, unless the
+ *          opened file has none in flight. The files are opened through the
+ *          ring as well, a failed open is reported by `read()`. For
+ *          `notify()`, the completions are signaled on an eventfd watched by
+ *          a thread started on the first wait.
+ */
+class UringSource : public InputSource {
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param chunkSize Size of the chunks to read
+     * \param depth     Number of reads kept in flight
+     */
+    UringSource(size_t chunkSize, unsigned depth = 8) : chunkSize(chunkSize), ring(depth), slots(depth) {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            freeSlots.push_back(i);
+        }
+    }
+
+    /*!
+     * \brief Destructor
+     *
+     * \details Waits for the reads and opens in flight, the kernel writes
+     *          into the buffers.
+     */
+    ~UringSource() override {
+        if (watcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            eventfd_write(eventFd, 1);
+            watcher.join();
+        }
+        if (eventFd >= 0) {
+            ::close(eventFd);
+        }
+        clear();
+        while (inflight > 0 && ring.submit(1)) {
+            reap();
+        }
+    }
+
+    /*!
+     * \brief Check whether the ring is set up
+     */
+    auto valid() const -> bool { return ring.valid(); }
+
+    auto prefetch(const std::string &path, uint64_t size) -> void override {
+        auto file = std::make_unique<File>();
+        file->path = path;
+        file->size = size;
+        files.push_back(std::move(file));
+        fill();
+    }
+
+    auto open(const std::string &path, uint64_t size) -> Result<void> override {
+        close();
+
+        // Drop announced files that are skipped
+        while (!files.empty() && files.front()->path != path) {
+            drop();
+        }
+        if (files.empty()) {
+            prefetch(path, size);
+        }
+
+        // Opened asynchronously unless done since the announcement
+        auto &file = *files.front();
+        if (file.failed) {
+            drop();
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        file.size = size;
+        opened = true;
+        fill();
+        return std::expected<void, Error>();
+    }
+
+    auto is_open() const -> bool override { return opened; }
+
+    auto read(Mode mode) -> Result<std::optional<std::span<const char>>> override {
+        release();
+        fill();
+
+        // The reads are issued once the file is opened
+        auto &file = *files.front();
+        while (file.fd < 0 && !file.failed) {
+            reap();
+            fill();
+            if (file.fd >= 0 || file.failed) {
+                break;
+            }
+            if (mode == Mode::NonBlock) {
+                return std::nullopt;
+            }
+            if (!ring.submit(1)) {
+                return std::unexpected(Error::ReadFailed);
+            }
+        }
+        if (file.failed) {
+            return std::unexpected(Error::OpenFailed);
+        }
+
+        if (file.reads.empty()) {
+            return std::span<const char>();
+        }
+
+        auto index = file.reads.front();
+        auto &slot = slots[index];
+        while (slot.state == Slot::Busy) {
+            reap();
+            if (slot.state != Slot::Busy) {
+                break;
+            }
+            if (mode == Mode::NonBlock) {
+                return std::nullopt;
+            }
+            if (!ring.submit(1)) {
+                return std::unexpected(Error::ReadFailed);
+            }
+        }
+
+        // Transient failure, issue the read again
+        if (slot.result == -EAGAIN || slot.result == -EINTR) {
+            submit(index);
+            return mode == Mode::Block ? read(mode) : std::nullopt;
+        }
+
+        file.reads.pop_front();
+        if (slot.result < 0) {
+            recycle(index);
+            return std::unexpected(Error::ReadFailed);
+        }
+        if (slot.offset >= file.size || slot.result == 0) {
+            // End of file, or beyond the requested size
+            recycle(index);
+            file.size = slot.offset;
+            return std::span<const char>();
+        }
+
+        auto length = std::min<uint64_t>(slot.result, file.size - slot.offset);
+        if (length < slot.length && slot.offset + length < file.size) {
+            // Short read, the rest is read next
+            file.retry.emplace_back(slot.offset + length, slot.length - length);
+        }
+
+        // The data is copied out of the page cache
+        if (cacheMode != CacheMode::Keep) {
+            posix_fadvise(slot.fd, slot.offset, length, POSIX_FADV_DONTNEED);
+        }
+        lent = index;
+        return std::span<const char>(slot.data.get(), length);
+    }
+
+    auto rewind() -> bool override {
+        if (!opened) {
+            return false;
+        }
+        release();
+        auto &file = *files.front();
+        abandon(file);
+        file.retry.clear();
+        file.next = 0;
+        fill();
+        return true;
+    }
+
+    auto resize(size_t chunkSize) -> void override { this->chunkSize = chunkSize; }
+
+    /*!
+     * \brief Invoke a callback once `read()` can return without blocking
+     *
+     * \details Waits for the open or the first read of the opened file, any
+     *          completion signaled in the meantime invokes the callback as
+     *          well.
+     */
+    auto notify(std::function<void()> callback) -> void override {
+        // Completions up to here are reaped below
+        eventfd_t count;
+        if (eventFd >= 0) {
+            eventfd_read(eventFd, &count);
+        }
+        reap();
+        if (!opened || inflight == 0 || !waiting() || !watch()) {
+            callback();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiter = std::move(callback);
+        }
+        condition.notify_all();
+    }
+
+    /*!
+     * \brief Set the use of the page cache
+     *
+     * \details Direct reads aren't supported, the pages are dropped instead.
+     */
+    auto cache(CacheMode mode) -> void override { cacheMode = mode; }
+
+    auto budget(MemoryBudget *memory) -> void override { this->memory = memory; }
+
+    auto close() -> void override {
+        release();
+        if (opened) {
+            drop();
+            opened = false;
+        }
+    }
+
+    auto clear() -> void override {
+        close();
+        while (!files.empty()) {
+            drop();
+        }
+    }
+
+private:
+    /*!
+     * \brief Buffer of a single read request
+     */
+    struct Slot {
+        enum State { Free, Busy, Done, Orphan };
+
+        BufferPool::Buffer data;
+        State state = Free;
+        int fd = -1;
+        uint64_t offset = 0;
+        unsigned length = 0;
+        int result = 0;
+        // Bytes acquired from the memory budget
+        uint64_t charged = 0;
+    };
+
+    /*!
+     * \brief File opened or announced
+     */
+    struct File {
+        std::string path;
+        uint64_t size = 0;
+        int fd = -1;
+        bool failed = false;
+        // Set while the open is in flight, and once the file is dropped
+        // before its completion
+        bool opening = false;
+        bool dropped = false;
+        // Offset of the next read to issue
+        uint64_t next = 0;
+        // Ranges to read again after a short read
+        std::deque<std::pair<uint64_t, unsigned>> retry;
+        // Slots of the issued reads in file order
+        std::deque<size_t> reads;
+    };
+
+    /*!
+     * \brief Check whether the next read of the opened file is in flight
+     */
+    auto waiting() const -> bool {
+        auto &file = *files.front();
+        if (file.opening) {
+            return true;
+        }
+        return !file.reads.empty() && slots[file.reads.front()].state == Slot::Busy;
+    }
+
+    /*!
+     * \brief Start the thread watching the completions
+     *
+     * \return False if the completions can't be signaled
+     */
+    auto watch() -> bool {
+        if (watcher.joinable()) {
+            return true;
+        }
+        // Not supported, tried before
+        if (eventFd >= 0) {
+            return false;
+        }
+        eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (eventFd < 0 || !ring.signal(eventFd)) {
+            return false;
+        }
+        watcher = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                condition.wait(lock, [this]() { return stopping || waiter; });
+                if (stopping) {
+                    return;
+                }
+                lock.unlock();
+                struct pollfd event = {eventFd, POLLIN, 0};
+                while (::poll(&event, 1, -1) < 0 && errno == EINTR) {
+                }
+                eventfd_t count;
+                eventfd_read(eventFd, &count);
+                lock.lock();
+                if (stopping) {
+                    return;
+                }
+                // Invoked without the lock, the callback may call notify()
+                if (auto callback = std::exchange(waiter, nullptr)) {
+                    lock.unlock();
+                    callback();
+                    lock.lock();
+                }
+            }
+        });
+        return true;
+    }
+
+    // Marks the completions of opens, their userdata is the file
+    static constexpr uint64_t OpenTag = uint64_t(1) << 63;
+
+    /*!
+     * \brief Issue the open of an announced file
+     */
+    auto openFile(File &file) -> void {
+        if (ring.openat(file.path.c_str(), O_RDONLY | O_CLOEXEC, OpenTag | reinterpret_cast<uintptr_t>(&file))) {
+            file.opening = true;
+            ++inflight;
+        }
+    }
+
+    /*!
+     * \brief Issue the read of a slot
+     */
+    auto submit(size_t index) -> void {
+        auto &slot = slots[index];
+        slot.state = Slot::Busy;
+        ring.read(slot.fd, slot.data.get(), slot.length, slot.offset, index);
+        ++inflight;
+        ring.submit();
+    }
+
+    /*!
+     * \brief Issue reads with all free slots
+     */
+    auto fill() -> void {
+        for (auto &file : files) {
+            // The files are read in order, the next one once it is opened
+            if (file->fd < 0 && !file->failed) {
+                if (!file->opening) {
+                    openFile(*file);
+                }
+                break;
+            }
+            while (!freeSlots.empty() && !file->failed && (!file->retry.empty() || file->next < file->size)) {
+                uint64_t length = file->retry.empty() ? std::min<uint64_t>(chunkSize, file->size - file->next)
+                                                      : file->retry.front().second;
+                if (memory && !memory->tryAcquire(length)) {
+                    // The consumer waits for a read of the opened file
+                    if (file != files.front() || !file->reads.empty()) {
+                        ring.submit();
+                        return;
+                    }
+                    memory->force(length);
+                }
+
+                auto index = freeSlots.back();
+                freeSlots.pop_back();
+                auto &slot = slots[index];
+                slot.fd = file->fd;
+                slot.charged = memory ? length : 0;
+
+                if (!file->retry.empty()) {
+                    // Must be read before the ranges already issued
+                    std::tie(slot.offset, slot.length) = file->retry.front();
+                    file->retry.pop_front();
+                    file->reads.push_front(index);
+                } else {
+                    slot.offset = file->next;
+                    slot.length = std::min<uint64_t>(chunkSize, file->size - file->next);
+                    file->next += slot.length;
+                    file->reads.push_back(index);
+                }
+
+                if (slot.data.size() < slot.length) {
+                    slot.data = BufferPool::shared().lease(std::max<size_t>(slot.length, chunkSize));
+                }
+
+                slot.state = Slot::Busy;
+                ring.read(slot.fd, slot.data.get(), slot.length, slot.offset, index);
+                ++inflight;
+            }
+            if (freeSlots.empty()) {
+                break;
+            }
+        }
+        ring.submit();
+    }
+
+    /*!
+     * \brief Collect the completed reads and opens
+     */
+    auto reap() -> void {
+        ring.reap([this](uint64_t index, int result) {
+            --inflight;
+            if (index & OpenTag) {
+                complete(reinterpret_cast<File *>(index & ~OpenTag), result);
+                return;
+            }
+            auto &slot = slots[index];
+            if (slot.state == Slot::Orphan) {
+                recycle(index);
+            } else {
+                slot.result = result;
+                slot.state = Slot::Done;
+            }
+        });
+    }
+
+    /*!
+     * \brief Complete the open of a file, a dropped file is closed again
+     */
+    auto complete(File *file, int result) -> void {
+        file->opening = false;
+        file->fd = (result >= 0) ? result : -1;
+        file->failed = result < 0;
+        if (file->dropped) {
+            if (file->fd >= 0) {
+                ::close(file->fd);
+            }
+            std::erase_if(closing, [&](const auto &pending) { return pending.get() == file; });
+        }
+    }
+
+    /*!
+     * \brief Return the slot of the last chunk
+     */
+    auto release() -> void {
+        if (lent) {
+            recycle(*lent);
+            lent.reset();
+        }
+    }
+
+    /*!
+     * \brief Make a slot available and return its charge to the budget
+     */
+    auto recycle(size_t index) -> void {
+        auto &slot = slots[index];
+        if (slot.charged > 0) {
+            memory->release(std::exchange(slot.charged, 0));
+        }
+        slot.state = Slot::Free;
+        freeSlots.push_back(index);
+    }
+
+    /*!
+     * \brief Give up the issued reads of a file, reads in flight are collected later
+     */
+    auto abandon(File &file) -> void {
+        for (auto index : file.reads) {
+            auto &slot = slots[index];
+            if (slot.state == Slot::Busy) {
+                slot.state = Slot::Orphan;
+            } else {
+                recycle(index);
+            }
+        }
+        file.reads.clear();
+    }
+
+    /*!
+     * \brief Drop the first file, reads in flight are collected later
+     */
+    auto drop() -> void {
+        auto &file = *files.front();
+        abandon(file);
+        // Reads in flight keep their own reference of the file, an open in
+        // flight needs its path until the completion
+        if (file.fd >= 0) {
+            ::close(file.fd);
+        }
+        if (file.opening) {
+            file.dropped = true;
+            closing.push_back(std::move(files.front()));
+        }
+        files.pop_front();
+    }
+
+    // Size of the chunks to read
+    size_t chunkSize;
+    // Use of the page cache
+    CacheMode cacheMode = CacheMode::Keep;
+    // Ring used to issue the reads
+    Uring ring;
+    // Buffers of the reads
+    std::vector<Slot> slots;
+    // Slots available for new reads
+    std::vector<size_t> freeSlots;
+    // Slot of the chunk returned by the last read
+    std::optional<size_t> lent;
+    // Number of reads and opens in flight
+    size_t inflight = 0;
+    // Budget charged with the issued reads, null if unlimited
+    MemoryBudget *memory = nullptr;
+    // Opened file followed by the announced files
+    std::deque<std::unique_ptr<File>> files;
+    // Dropped files with the open in flight
+    std::vector<std::unique_ptr<File>> closing;
+    // Set if the first file is opened
+    bool opened = false;
+    // Signaled by the ring on completions, watched for the waiter
+    int eventFd = -1;
+    std::thread watcher;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::function<void()> waiter;
+    bool stopping = false;
+};
+
+} // namespace compression
+
+#endif
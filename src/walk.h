@@ -0,0 +1,107 @@
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Walk a directory tree
+ *
+ * \details Visits every regular file and symbolic link below the directory,
+ *          in lexical order within each directory. The tree is traversed
+ *          relative to the opened directories with `openat` and `fstatat`, so
+ *          every file is stated once and directories are descended without a
+ *          stat if the file system reports the entry type. Symbolic links
+ *          aren't followed.
+ *
+ * \param root  The directory to walk
+ * \param visit Invoked with the path below the root and the stats of each file
+ *
+ * \return Nothing on success, else error code
+ */
+inline auto walk(const std::string &root, const std::function<void(std::string, const struct stat64 &)> &visit)
+    -> Result<void> {
+    struct Walker {
+        const std::function<void(std::string, const struct stat64 &)> &visit;
+
+        auto directory(int fd, std::string &prefix) -> Result<void> {
+            DIR *dir = fdopendir(fd);
+            if (dir == nullptr) {
+                ::close(fd);
+                return std::unexpected(Error::OpenFailed);
+            }
+
+            std::vector<std::pair<std::string, unsigned char>> names;
+            while (auto entry = readdir64(dir)) {
+                std::string name(entry->d_name);
+                if (name != "." && name != "..") {
+                    names.emplace_back(std::move(name), entry->d_type);
+                }
+            }
+            std::sort(names.begin(), names.end());
+
+            auto res = std::expected<void, Error>();
+            auto length = prefix.size();
+            for (auto &[name, type] : names) {
+                prefix.resize(length);
+                prefix += name;
+
+                struct stat64 stat;
+                if (type != DT_DIR) {
+                    if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+                        continue;
+                    }
+                    if (fstatat64(dirfd(dir), name.c_str(), &stat, AT_SYMLINK_NOFOLLOW) < 0) {
+                        res = std::unexpected(Error::StatFailed);
+                        break;
+                    }
+                    if (S_ISREG(stat.st_mode) || S_ISLNK(stat.st_mode)) {
+                        visit(prefix, stat);
+                        continue;
+                    }
+                    if (!S_ISDIR(stat.st_mode)) {
+                        continue;
+                    }
+                }
+
+                int child = openat(dirfd(dir), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child < 0) {
+                    res = std::unexpected(Error::OpenFailed);
+                    break;
+                }
+                prefix += '/';
+                res = directory(child, prefix);
+                if (!res) {
+                    break;
+                }
+            }
+
+            prefix.resize(length);
+            closedir(dir);
+            return res;
+        }
+    };
+
+    int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::unexpected(Error::OpenFailed);
+    }
+
+    std::string prefix = root;
+    if (!prefix.empty() && prefix.back() != '/') {
+        prefix += '/';
+    }
+    Walker walker{visit};
+    return walker.directory(fd, prefix);
+}
+
+} // namespace compression
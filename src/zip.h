@@ -0,0 +1,405 @@
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace compression {
+
+/*!
+ * \brief Metadata of a single zip entry
+ *
+ * \details Collected while the entry is compressed and reused to emit the
+ *          central directory once the archive is closed.
+ */
+struct ZipRecord {
+    // Pathname stored in the archive
+    std::string name;
+    // CRC-32 of the uncompressed data
+    uint32_t crc = 0;
+    // Uncompressed size in bytes
+    uint64_t size = 0;
+    // Compressed size in bytes
+    uint64_t compressedSize = 0;
+    // Offset of the local header in the archive
+    uint64_t offset = 0;
+    // Compression method, 8 for deflate and 0 for store
+    uint16_t method = 8;
+    // Modification time in MS-DOS format
+    uint16_t time = 0;
+    uint16_t date = 0;
+    // Unix mode of the entry
+    uint32_t mode = 0;
+    // Local header and data descriptor use ZIP64 sizes
+    bool zip64 = false;
+};
+
+/*!
+ * \brief Encoder and decoder of the zip container records
+ *
+ * \details The entries are written in streaming fashion: the local header
+ *          doesn't contain the sizes and CRC, they are given in the data
+ *          descriptor after the compressed data. ZIP64 extensions are only
+ *          emitted if any size or offset exceeds the 32-bit limits.
+ */
+class ZipDirectory {
+public:
+    // Entries above this size are flagged as ZIP64 in advance
+    static constexpr uint64_t Zip64Threshold = 0xF0000000;
+
+    /*!
+     * \brief Convert a timestamp into MS-DOS date and time
+     *
+     * \param time The timestamp, clamped to the MS-DOS epoch of 1980
+     * \param record The record to update
+     */
+    static auto setTime(ZipRecord &record, time_t time) -> void {
+        struct tm tm;
+        if (localtime_r(&time, &tm) == nullptr || tm.tm_year < 80) {
+            record.time = 0;
+            record.date = (1 << 5) | 1;
+            return;
+        }
+        record.time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+        record.date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    }
+
+    /*!
+     * \brief Convert the MS-DOS date and time of a record into a timestamp
+     */
+    static auto getTime(const ZipRecord &record) -> time_t {
+        struct tm tm{};
+        tm.tm_year = (record.date >> 9) + 80;
+        tm.tm_mon = ((record.date >> 5) & 0xF) - 1;
+        tm.tm_mday = record.date & 0x1F;
+        tm.tm_hour = record.time >> 11;
+        tm.tm_min = (record.time >> 5) & 0x3F;
+        tm.tm_sec = (record.time & 0x1F) * 2;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    /*!
+     * \brief Encode the local header of an entry
+     */
+    static auto localHeader(const ZipRecord &record) -> std::string {
+        std::string out;
+        put32(out, 0x04034b50);
+        put16(out, record.zip64 ? 45 : 20);
+        put16(out, flags(record));
+        put16(out, record.method);
+        put16(out, record.time);
+        put16(out, record.date);
+        put32(out, 0);
+        put32(out, record.zip64 ? 0xFFFFFFFF : 0);
+        put32(out, record.zip64 ? 0xFFFFFFFF : 0);
+        put16(out, record.name.size());
+        put16(out, record.zip64 ? 20 : 0);
+        out += record.name;
+        if (record.zip64) {
+            put16(out, 0x0001);
+            put16(out, 16);
+            put64(out, 0);
+            put64(out, 0);
+        }
+        return out;
+    }
+
+    /*!
+     * \brief Encode the data descriptor following the entry data
+     */
+    static auto descriptor(const ZipRecord &record) -> std::string {
+        std::string out;
+        put32(out, 0x08074b50);
+        put32(out, record.crc);
+        if (record.zip64) {
+            put64(out, record.compressedSize);
+            put64(out, record.size);
+        } else {
+            put32(out, record.compressedSize);
+            put32(out, record.size);
+        }
+        return out;
+    }
+
+    /*!
+     * \brief Read the central directory of an archive
+     *
+     * \details Supports ZIP64 archives. Encrypted entries are rejected.
+     *
+     * \param fd File descriptor of the archive
+     *
+     * \return The records of all entries on success, else error code
+     */
+    static auto read(int fd) -> Result<std::vector<ZipRecord>> {
+        struct stat64 stat;
+        if (fstat64(fd, &stat) < 0) {
+            return std::unexpected(Error::StatFailed);
+        }
+
+        // The end record is followed by a comment of up to 64 KiB
+        uint64_t fileSize = stat.st_size;
+        std::string tail(std::min<uint64_t>(fileSize, 0xFFFF + 22 + 20), '\0');
+        if (!readAt(fd, tail, fileSize - tail.size())) {
+            return std::unexpected(Error::ReadFailed);
+        }
+
+        size_t end = std::string::npos;
+        for (size_t i = tail.size() >= 22 ? tail.size() - 22 + 1 : 0; i-- > 0;) {
+            if (get32(tail.data() + i) == 0x06054b50) {
+                end = i;
+                break;
+            }
+        }
+        if (end == std::string::npos) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+
+        uint64_t count = get16(tail.data() + end + 10);
+        uint64_t size = get32(tail.data() + end + 12);
+        uint64_t offset = get32(tail.data() + end + 16);
+        if (end >= 20 && get32(tail.data() + end - 20) == 0x07064b50) {
+            // ZIP64 end of central directory record
+            std::string record(56, '\0');
+            if (!readAt(fd, record, get64(tail.data() + end - 20 + 8)) || get32(record.data()) != 0x06064b50) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            count = get64(record.data() + 32);
+            size = get64(record.data() + 40);
+            offset = get64(record.data() + 48);
+        }
+        // Every record of the central directory takes 46 bytes at least
+        if (size > fileSize || offset > fileSize - size || count > size / 46) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+
+        std::string directory(size, '\0');
+        if (!readAt(fd, directory, offset)) {
+            return std::unexpected(Error::ReadFailed);
+        }
+
+        std::vector<ZipRecord> result;
+        result.reserve(count);
+        size_t position = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            const char *p = directory.data() + position;
+            if (position + 46 > directory.size() || get32(p) != 0x02014b50) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            size_t nameLength = get16(p + 28);
+            size_t extraLength = get16(p + 30);
+            size_t commentLength = get16(p + 32);
+            if (position + 46 + nameLength + extraLength + commentLength > directory.size()) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+            if (get16(p + 8) & 0x0001) {
+                return std::unexpected(Error::InvalidArchive);
+            }
+
+            ZipRecord record;
+            record.method = get16(p + 10);
+            record.time = get16(p + 12);
+            record.date = get16(p + 14);
+            record.crc = get32(p + 16);
+            record.compressedSize = get32(p + 20);
+            record.size = get32(p + 24);
+            record.offset = get32(p + 42);
+            // Unix mode if created on a Unix system
+            record.mode = ((get16(p + 4) >> 8) == 3) ? (get32(p + 38) >> 16) : 0;
+            record.name.assign(p + 46, nameLength);
+
+            // ZIP64 extra field with the values exceeding 32 bits
+            const char *extra = p + 46 + nameLength;
+            for (size_t e = 0; e + 4 <= extraLength;) {
+                size_t length = get16(extra + e + 2);
+                if (get16(extra + e) == 0x0001) {
+                    size_t field = e + 4;
+                    auto next = [&](uint64_t &value) {
+                        if (value == 0xFFFFFFFF && field + 8 <= e + 4 + length && field + 8 <= extraLength) {
+                            value = get64(extra + field);
+                            field += 8;
+                        }
+                    };
+                    next(record.size);
+                    next(record.compressedSize);
+                    next(record.offset);
+                    record.zip64 = true;
+                }
+                e += 4 + length;
+            }
+
+            result.push_back(std::move(record));
+            position += 46 + nameLength + extraLength + commentLength;
+        }
+        return result;
+    }
+
+    /*!
+     * \brief Offset of the entry data behind the local header
+     *
+     * \param fd     File descriptor of the archive
+     * \param record The record of the entry
+     *
+     * \return The offset on success, else error code
+     */
+    static auto dataOffset(int fd, const ZipRecord &record) -> Result<uint64_t> {
+        std::string header(30, '\0');
+        if (!readAt(fd, header, record.offset) || get32(header.data()) != 0x04034b50) {
+            return std::unexpected(Error::InvalidArchive);
+        }
+        return record.offset + 30 + get16(header.data() + 26) + get16(header.data() + 28);
+    }
+
+    /*!
+     * \brief Register a completely written entry for the central directory
+     */
+    auto add(ZipRecord record) -> void { records.push_back(std::move(record)); }
+
+    /*!
+     * \brief Encode the central directory and the end records
+     *
+     * \param offset Offset of the central directory in the archive
+     *
+     * \return The encoded trailer of the archive
+     */
+    auto finish(uint64_t offset) const -> std::string {
+        std::string out;
+        for (const auto &record : records) {
+            bool bigSize = record.size >= 0xFFFFFFFF;
+            bool bigCompressed = record.compressedSize >= 0xFFFFFFFF;
+            bool bigOffset = record.offset >= 0xFFFFFFFF;
+            uint16_t extra = 8 * (bigSize + bigCompressed + bigOffset);
+            uint16_t version = (record.zip64 || extra > 0) ? 45 : 20;
+
+            put32(out, 0x02014b50);
+            put16(out, (3 << 8) | version);
+            put16(out, version);
+            put16(out, flags(record));
+            put16(out, record.method);
+            put16(out, record.time);
+            put16(out, record.date);
+            put32(out, record.crc);
+            put32(out, bigCompressed ? 0xFFFFFFFF : record.compressedSize);
+            put32(out, bigSize ? 0xFFFFFFFF : record.size);
+            put16(out, record.name.size());
+            put16(out, extra > 0 ? extra + 4 : 0);
+            put16(out, 0);
+            put16(out, 0);
+            put16(out, 0);
+            put32(out, record.mode << 16);
+            put32(out, bigOffset ? 0xFFFFFFFF : record.offset);
+            out += record.name;
+            if (extra > 0) {
+                put16(out, 0x0001);
+                put16(out, extra);
+                if (bigSize) {
+                    put64(out, record.size);
+                }
+                if (bigCompressed) {
+                    put64(out, record.compressedSize);
+                }
+                if (bigOffset) {
+                    put64(out, record.offset);
+                }
+            }
+        }
+
+        uint64_t size = out.size();
+        uint64_t count = records.size();
+        if (count >= 0xFFFF || size >= 0xFFFFFFFF || offset >= 0xFFFFFFFF) {
+            // ZIP64 end of central directory record
+            put32(out, 0x06064b50);
+            put64(out, 44);
+            put16(out, (3 << 8) | 45);
+            put16(out, 45);
+            put32(out, 0);
+            put32(out, 0);
+            put64(out, count);
+            put64(out, count);
+            put64(out, size);
+            put64(out, offset);
+            // ZIP64 end of central directory locator
+            put32(out, 0x07064b50);
+            put32(out, 0);
+            put64(out, offset + size);
+            put32(out, 1);
+        }
+
+        put32(out, 0x06054b50);
+        put16(out, 0);
+        put16(out, 0);
+        put16(out, count >= 0xFFFF ? 0xFFFF : count);
+        put16(out, count >= 0xFFFF ? 0xFFFF : count);
+        put32(out, size >= 0xFFFFFFFF ? 0xFFFFFFFF : size);
+        put32(out, offset >= 0xFFFFFFFF ? 0xFFFFFFFF : offset);
+        put16(out, 0);
+        return out;
+    }
+
+private:
+    /*!
+     * \brief General purpose flags of an entry
+     *
+     * \details Bit 3 announces the data descriptor, bit 11 marks UTF-8 names.
+     */
+    static auto flags(const ZipRecord &record) -> uint16_t {
+        uint16_t flags = 0x0008;
+        for (unsigned char c : record.name) {
+            if (c >= 0x80) {
+                flags |= 0x0800;
+                break;
+            }
+        }
+        return flags;
+    }
+
+    static auto readAt(int fd, std::string &buffer, uint64_t offset) -> bool {
+        size_t length = 0;
+        while (length < buffer.size()) {
+            auto res = pread64(fd, buffer.data() + length, buffer.size() - length, offset + length);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                return false;
+            }
+            length += res;
+        }
+        return true;
+    }
+
+    static auto get16(const char *in) -> uint16_t {
+        auto p = reinterpret_cast<const unsigned char *>(in);
+        return p[0] | (p[1] << 8);
+    }
+
+    static auto get32(const char *in) -> uint32_t { return get16(in) | (uint32_t(get16(in + 2)) << 16); }
+
+    static auto get64(const char *in) -> uint64_t { return get32(in) | (uint64_t(get32(in + 4)) << 32); }
+
+    static auto put16(std::string &out, uint16_t value) -> void {
+        out.push_back(static_cast<char>(value));
+        out.push_back(static_cast<char>(value >> 8));
+    }
+
+    static auto put32(std::string &out, uint32_t value) -> void {
+        put16(out, value);
+        put16(out, value >> 16);
+    }
+
+    static auto put64(std::string &out, uint64_t value) -> void {
+        put32(out, value);
+        put32(out, value >> 32);
+    }
+
+    // Records of all completely written entries
+    std::vector<ZipRecord> records;
+};
+
+} // namespace compression
@@ -0,0 +1,580 @@
+#include "compression.h"
+#include "crc.h"
+#include "dedup.h"
+#include "fingerprint.h"
+#include "index.h"
+#include "manifest.h"
+#include "reader.h"
+#include "zip.h"
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <archive.h>
+#include <archive_entry.h>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#if defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+/*!
+ * \brief Tests of the archive formats and the parsers of untrusted input
+ *
+ * \details Each test runs in a temporary directory of its own and is
+ *          selected by name, registered with CTest one by one.
+ *
+ *          Usage: parsers-test <test>
+ */
+
+namespace {
+
+namespace fs = std::filesystem;
+
+/*!
+ * \brief Failure of a check, reported with the failing expression
+ */
+struct Failure {
+    std::string message;
+};
+
+#define CHECK(condition)                                                                                               \
+    do {                                                                                                               \
+        if (!(condition)) {                                                                                            \
+            throw Failure{std::string(__FILE__ ":") + std::to_string(__LINE__) + ": " #condition};                     \
+        }                                                                                                              \
+    } while (false)
+
+/*!
+ * \brief Temporary working directory removed on destruction
+ */
+class Scratch {
+public:
+    Scratch() {
+        std::string pattern = (fs::temp_directory_path() / "parsers-test-XXXXXX").string();
+        CHECK(mkdtemp(pattern.data()) != nullptr);
+        path = pattern;
+        previous = fs::current_path();
+        fs::current_path(path);
+    }
+
+    ~Scratch() {
+        fs::current_path(previous);
+        std::error_code error;
+        fs::remove_all(path, error);
+    }
+
+    Scratch(const Scratch &) = delete;
+    Scratch &operator=(const Scratch &) = delete;
+
+    fs::path path;
+
+private:
+    fs::path previous;
+};
+
+auto readFile(const fs::path &path) -> std::string {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+auto writeFile(const fs::path &path, const std::string &data) -> void {
+    if (path.has_parent_path()) {
+        fs::create_directories(path.parent_path());
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    CHECK(out.good());
+}
+
+/*!
+ * \brief Deterministic content that compresses moderately
+ */
+auto content(size_t size, unsigned seed) -> std::string {
+    std::string data(size, '\0');
+    uint32_t state = seed * 2654435761u + 1;
+    for (auto &c : data) {
+        state = state * 1103515245u + 12345u;
+        c = static_cast<char>('a' + (state >> 16) % 16);
+    }
+    return data;
+}
+
+/*!
+ * \brief Create the input tree below `input`, returns the contents by path
+ */
+auto createInput() -> std::map<std::string, std::string> {
+    std::map<std::string, std::string> files = {
+        {"input/empty", ""},
+        {"input/small.txt", content(1000, 1)},
+        {"input/nested/medium.bin", content(300000, 2)},
+        {"input/nested/large.bin", content(3 << 20, 3)},
+        {"input/nested/copy.bin", content(300000, 2)},
+    };
+    for (const auto &[path, data] : files) {
+        writeFile(path, data);
+    }
+    fs::create_symlink("small.txt", "input/link");
+    return files;
+}
+
+/*!
+ * \brief Check the extracted tree against the input
+ */
+auto compareTree(const fs::path &root, const std::map<std::string, std::string> &files) -> void {
+    for (const auto &[path, data] : files) {
+        CHECK(fs::is_regular_file(root / path));
+        CHECK(readFile(root / path) == data);
+    }
+    CHECK(fs::is_symlink(root / "input/link"));
+    CHECK(fs::read_symlink(root / "input/link") == "small.txt");
+}
+
+auto writeArchive(const std::string &name, compression::ArchiveType type, compression::Writer::Options options)
+    -> void {
+    auto writer = compression::Writer::open(name, type, options);
+    CHECK(writer.has_value());
+    CHECK(writer.value()->add_directory("input").has_value());
+    auto res = writer.value()->write();
+    CHECK(res.has_value() && res.value() == compression::State::Finished);
+    writer.value()->close();
+}
+
+auto extractArchive(const std::string &filename, const std::string &destination, size_t threads)
+    -> compression::Result<compression::State> {
+    fs::create_directories(destination);
+    compression::Reader::Options options;
+    options.destination = destination;
+    options.threads = threads;
+    auto reader = compression::Reader::open(filename, options);
+    if (!reader) {
+        return std::unexpected(reader.error());
+    }
+    return reader.value()->extract();
+}
+
+/*!
+ * \brief Write and extract an archive, serially and in parallel
+ */
+auto roundTrip(compression::ArchiveType type) -> void {
+    Scratch scratch;
+    auto files = createInput();
+    auto extension = compression::Writer::extension(type);
+    for (size_t threads : {0, 2}) {
+        compression::Writer::Options options;
+        options.threads = threads;
+        auto name = "archive-" + std::to_string(threads);
+        writeArchive(name, type, options);
+
+        // Zip archives are extracted in parallel as well
+        for (size_t readers : {0, 2}) {
+            auto destination = "output-" + std::to_string(threads) + "-" + std::to_string(readers);
+            auto res = extractArchive(name + extension, destination, readers);
+            CHECK(res.has_value() && res.value() == compression::State::Finished);
+            compareTree(destination, files);
+        }
+    }
+}
+
+/*!
+ * \brief Write a zip archive with a single entry of the given record
+ */
+auto writeZip(const std::string &filename, compression::ZipRecord record, const std::string &data) -> void {
+    record.mode = 0100644;
+    record.compressedSize = data.size();
+    compression::ZipDirectory::setTime(record, 0);
+
+    std::string archive = compression::ZipDirectory::localHeader(record) + data;
+    archive += compression::ZipDirectory::descriptor(record);
+    compression::ZipDirectory directory;
+    directory.add(record);
+    archive += directory.finish(archive.size());
+    writeFile(filename, archive);
+}
+
+/*!
+ * \brief Write a zip archive with a single stored entry
+ */
+auto writeZip(const std::string &filename, const std::string &name, const std::string &data) -> void {
+    compression::ZipRecord record;
+    record.name = name;
+    record.method = 0;
+    record.size = data.size();
+    record.crc = compression::Crc32::update(0, data);
+    writeZip(filename, record, data);
+}
+
+/*!
+ * \brief Extract an entry leaving the destination, which has to be rejected
+ */
+auto traversal(const std::string &name, const fs::path &escaped) -> void {
+    writeZip("evil.zip", name, "escaped");
+    for (size_t threads : {0, 2}) {
+        auto res = extractArchive("evil.zip", "output/nested", threads);
+        CHECK(!res.has_value());
+        CHECK(!fs::exists(escaped));
+    }
+}
+
+auto zipDotDot() -> void {
+    Scratch scratch;
+    traversal("../escaped", scratch.path / "output/escaped");
+    traversal("inner/../../../escaped", scratch.path / "escaped");
+}
+
+auto zipAbsolute() -> void {
+    Scratch scratch;
+    auto target = scratch.path / "absolute";
+    traversal(target.string(), target);
+}
+
+#if defined(HAVE_ZLIB_H)
+/*!
+ * \brief Extract entries inflating beyond their recorded size, which fail
+ */
+auto zipBomb() -> void {
+    Scratch scratch;
+    std::string data(16 << 20, '\0');
+    z_stream stream{};
+    CHECK(deflateInit2(&stream, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    std::string deflated(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(data.data());
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(deflated.data());
+    stream.avail_out = deflated.size();
+    CHECK(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+    deflated.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    auto check = [](const std::string &filename) {
+        auto res = extractArchive(filename, "output", 2);
+        CHECK(!res.has_value());
+        CHECK(!fs::exists("output/bomb") || fs::file_size("output/bomb") <= 1000);
+        fs::remove_all("output");
+    };
+    compression::ZipRecord record;
+    record.name = "bomb";
+    record.size = 1000;
+    record.crc = compression::Crc32::update(0, std::string_view(data).substr(0, record.size));
+    record.method = 8;
+    writeZip("deflated.zip", record, deflated);
+    check("deflated.zip");
+    record.method = 0;
+    writeZip("stored.zip", record, data.substr(0, 1 << 20));
+    check("stored.zip");
+}
+#endif
+
+/*!
+ * \brief Parse every truncation of a zip archive, none may be accepted
+ */
+auto zipTruncated() -> void {
+    Scratch scratch;
+    createInput();
+    writeArchive("archive", compression::ArchiveType::Zip, {});
+    auto data = readFile("archive.zip");
+    for (size_t length = 0; length < data.size(); length += (length < data.size() - 4096) ? 997 : 1) {
+        writeFile("truncated.zip", data.substr(0, length));
+        int fd = ::open("truncated.zip", O_RDONLY | O_CLOEXEC);
+        CHECK(fd >= 0);
+        auto records = compression::ZipDirectory::read(fd);
+        ::close(fd);
+        CHECK(!records.has_value());
+    }
+}
+
+/*!
+ * \brief Parse ZIP64 end records of forged directory bounds and entry counts
+ */
+auto zipForgedCount() -> void {
+    Scratch scratch;
+    auto put = [](std::string &out, uint64_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) {
+            out += static_cast<char>(value >> (8 * i));
+        }
+    };
+    struct Forged {
+        uint64_t count;
+        uint64_t size;
+        uint64_t offset;
+    };
+    // Sizes overflowing the offset, counts exceeding the directory
+    for (auto [count, size, offset] :
+         {Forged{1, 1ull << 63, 1ull << 63}, Forged{1ull << 62, 98, 0}, Forged{UINT64_MAX, 0, 0}}) {
+        std::string data;
+        // ZIP64 end of central directory record
+        put(data, 0x06064b50, 4);
+        put(data, 44, 8);
+        put(data, 45, 2);
+        put(data, 45, 2);
+        put(data, 0, 8);
+        put(data, count, 8);
+        put(data, count, 8);
+        put(data, size, 8);
+        put(data, offset, 8);
+        // ZIP64 end of central directory locator
+        put(data, 0x07064b50, 4);
+        put(data, 0, 4);
+        put(data, 0, 8);
+        put(data, 1, 4);
+        // End of central directory record
+        put(data, 0x06054b50, 4);
+        put(data, 0, 4);
+        put(data, 0xFFFF, 2);
+        put(data, 0xFFFF, 2);
+        put(data, 0xFFFFFFFF, 4);
+        put(data, 0xFFFFFFFF, 4);
+        put(data, 0, 2);
+        CHECK(data.size() == 98);
+        writeFile("forged.zip", data);
+
+        int fd = ::open("forged.zip", O_RDONLY | O_CLOEXEC);
+        CHECK(fd >= 0);
+        auto records = compression::ZipDirectory::read(fd);
+        ::close(fd);
+        CHECK(!records.has_value());
+
+        // Left to the sequential reader, which finds no entries
+        extractArchive("forged.zip", "output", 2);
+        CHECK(fs::is_empty("output"));
+    }
+}
+
+/*!
+ * \brief Load every truncation of a manifest, none may be accepted
+ */
+auto manifestTruncated() -> void {
+    Scratch scratch;
+    auto files = createInput();
+    compression::Writer::Options options;
+    options.manifest = std::make_shared<compression::Manifest>();
+    writeArchive("archive", compression::ArchiveType::TarLz4, options);
+    CHECK(options.manifest->size() == files.size() + 1);
+    CHECK(options.manifest->save("full.manifest").has_value());
+
+    compression::Manifest loaded;
+    CHECK(loaded.load("full.manifest").has_value());
+    CHECK(loaded.size() == options.manifest->size());
+
+    auto data = readFile("full.manifest");
+    for (size_t length = 0; length < data.size(); ++length) {
+        writeFile("truncated.manifest", data.substr(0, length));
+        compression::Manifest manifest;
+        CHECK(!manifest.load("truncated.manifest").has_value());
+    }
+}
+
+/*!
+ * \brief Open every truncation of an indexed archive, none may be accepted
+ */
+auto indexTruncated() -> void {
+    Scratch scratch;
+    auto files = createInput();
+    compression::Writer::Options options;
+    options.index = true;
+    writeArchive("archive", compression::ArchiveType::TarLz4, options);
+
+    auto index = compression::TarIndex::open("archive.tar.lz4");
+    CHECK(index.has_value());
+    std::string data;
+    auto res = index.value()->read("input/nested/medium.bin", [&](std::span<const char> block) {
+        data.append(block.data(), block.size());
+        return true;
+    });
+    CHECK(res.has_value() && data == files["input/nested/medium.bin"]);
+
+    auto archive = readFile("archive.tar.lz4");
+    for (size_t cut = 1; cut <= 512 && cut < archive.size(); ++cut) {
+        writeFile("truncated.tar.lz4", archive.substr(0, archive.size() - cut));
+        CHECK(!compression::TarIndex::open("truncated.tar.lz4").has_value());
+    }
+}
+
+/*!
+ * \brief Targets of the hard links of an archive by pathname
+ */
+auto hardlinks(const std::string &filename) -> std::map<std::string, std::string> {
+    std::unique_ptr<struct archive, decltype(&archive_read_free)> archive(archive_read_new(), archive_read_free);
+    archive_read_support_filter_all(archive.get());
+    archive_read_support_format_all(archive.get());
+    CHECK(archive_read_open_filename(archive.get(), filename.c_str(), 1 << 16) == ARCHIVE_OK);
+    std::map<std::string, std::string> links;
+    struct archive_entry *header;
+    while (archive_read_next_header(archive.get(), &header) == ARCHIVE_OK) {
+        if (auto target = archive_entry_hardlink(header)) {
+            links[archive_entry_pathname(header)] = target;
+        }
+    }
+    return links;
+}
+
+/*!
+ * \brief Link identical entries only, also if their fingerprints collide
+ *
+ * \details Covers reordered stripes and fingerprints forged in the cache, of
+ *          small files as well as files written in chunks.
+ */
+auto dedupCollision() -> void {
+    Scratch scratch;
+    std::map<std::string, std::string> files;
+    for (size_t size : {4096, 1 << 20}) {
+        auto prefix = std::to_string(size) + "-";
+        auto first = content(size, 4);
+        auto swapped = first;
+        std::swap_ranges(swapped.begin(), swapped.begin() + 64, swapped.begin() + 64);
+        CHECK(compression::Hasher::of(first) != compression::Hasher::of(swapped));
+        files[prefix + "a-first"] = first;
+        files[prefix + "b-copy"] = first;
+        files[prefix + "c-swapped"] = swapped;
+        files[prefix + "d-forged"] = content(size, 5);
+    }
+    for (const auto &[path, data] : files) {
+        writeFile(path, data);
+    }
+
+    for (size_t threads : {0, 2}) {
+        auto cache = std::make_shared<compression::DedupCache>();
+        for (size_t size : {4096, 1 << 20}) {
+            auto prefix = std::to_string(size) + "-";
+            struct stat64 stat;
+            CHECK(lstat64((prefix + "d-forged").c_str(), &stat) == 0);
+            cache->store(prefix + "d-forged", stat, compression::Hasher::of(files[prefix + "a-first"]));
+        }
+
+        compression::Writer::Options options;
+        options.threads = threads;
+        options.dedup = cache;
+        auto name = "archive-" + std::to_string(threads);
+        auto writer = compression::Writer::open(name, compression::ArchiveType::TarLz4, options);
+        CHECK(writer.has_value());
+        for (const auto &[path, data] : files) {
+            CHECK(writer.value()->add_file(path));
+        }
+        auto res = writer.value()->write();
+        CHECK(res.has_value() && res.value() == compression::State::Finished);
+        writer.value()->close();
+
+        auto links = hardlinks(name + ".tar.lz4");
+        CHECK(links.size() == 2);
+        CHECK(links["4096-b-copy"] == "4096-a-first");
+        CHECK(links["1048576-b-copy"] == "1048576-a-first");
+
+        auto destination = "output-" + std::to_string(threads);
+        auto extracted = extractArchive(name + ".tar.lz4", destination, 0);
+        CHECK(extracted.has_value() && extracted.value() == compression::State::Finished);
+        for (const auto &[path, data] : files) {
+            CHECK(readFile(fs::path(destination) / path) == data);
+        }
+    }
+}
+
+/*!
+ * \brief Open an indexed archive of forged entry counts, none may be accepted
+ */
+auto indexForgedCount() -> void {
+    Scratch scratch;
+    createInput();
+    compression::Writer::Options options;
+    options.index = true;
+    writeArchive("archive", compression::ArchiveType::TarLz4, options);
+
+    auto archive = readFile("archive.tar.lz4");
+    auto footer = archive.size() - compression::FrameIndex::FooterSize;
+    auto count = compression::FrameIndex::get(archive.data() + footer, 8);
+    for (uint64_t forged : {count + 1, uint64_t(1) << 60, UINT64_MAX}) {
+        std::string data = archive.substr(0, footer);
+        compression::FrameIndex::put(data, forged, 8);
+        data += archive.substr(footer + 8);
+        writeFile("forged.tar.lz4", data);
+        CHECK(!compression::TarIndex::open("forged.tar.lz4").has_value());
+    }
+}
+
+/*!
+ * \brief Read a sparse entry through the index, the holes are read as zeros
+ */
+auto indexSparse() -> void {
+    Scratch scratch;
+    fs::create_directories("input");
+    std::string expected(4 << 20, '\0');
+    auto head = content(4096, 6);
+    auto middle = content(4096, 7);
+    expected.replace(0, head.size(), head);
+    expected.replace(2 << 20, middle.size(), middle);
+
+    // Data regions between holes, the file ends within a hole
+    int fd = ::open("input/sparse.bin", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0);
+    CHECK(pwrite64(fd, head.data(), head.size(), 0) == ssize_t(head.size()));
+    CHECK(pwrite64(fd, middle.data(), middle.size(), 2 << 20) == ssize_t(middle.size()));
+    CHECK(ftruncate64(fd, expected.size()) == 0);
+    ::close(fd);
+
+    for (size_t threads : {0, 2}) {
+        compression::Writer::Options options;
+        options.index = true;
+        options.threads = threads;
+        auto name = "archive-" + std::to_string(threads);
+        writeArchive(name, compression::ArchiveType::TarLz4, options);
+
+        auto index = compression::TarIndex::open(name + ".tar.lz4");
+        CHECK(index.has_value());
+        std::string data;
+        auto res = index.value()->read("input/sparse.bin", [&](std::span<const char> block) {
+            data.append(block.data(), block.size());
+            return true;
+        });
+        CHECK(res.has_value());
+        CHECK(data == expected);
+    }
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const std::map<std::string, std::function<void()>> tests = {
+#if defined(HAVE_ZLIB_H)
+        {"roundtrip-zip", []() { roundTrip(compression::ArchiveType::Zip); }},
+        {"zip-dotdot", zipDotDot},
+        {"zip-absolute", zipAbsolute},
+        {"zip-truncated", zipTruncated},
+        {"zip-forged-count", zipForgedCount},
+        {"zip-bomb", zipBomb},
+#endif
+#if defined(HAVE_LIBLZ4)
+        {"roundtrip-tar-lz4", []() { roundTrip(compression::ArchiveType::TarLz4); }},
+        {"manifest-truncated", manifestTruncated},
+        {"index-truncated", indexTruncated},
+        {"index-forged-count", indexForgedCount},
+        {"index-sparse", indexSparse},
+        {"dedup-collision", dedupCollision},
+#endif
+#if defined(HAVE_ZSTD_H)
+        {"roundtrip-tar-zstd", []() { roundTrip(compression::ArchiveType::TarZstd); }},
+#endif
+    };
+
+    if (argc != 2 || !tests.contains(argv[1])) {
+        std::cerr << "Usage: " << argv[0] << " <test>" << std::endl;
+        for (const auto &[name, test] : tests) {
+            std::cerr << "  " << name << std::endl;
+        }
+        return 2;
+    }
+    try {
+        tests.at(argv[1])();
+    } catch (const Failure &failure) {
+        std::cerr << failure.message << std::endl;
+        return 1;
+    } catch (const std::exception &exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}